@@ -0,0 +1,467 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "batch.h"
+#include "wakit.h"
+#include "macro.h"
+#include "cli_io.h"
+#include "dynamic_string.h"
+
+#define BATCH_MAX_FIELDS 6
+
+typedef enum {
+  AddOperation,
+  EditOperation,
+  RemoveOperation,
+  MoveOperation
+} operation_type;
+
+typedef enum {
+  EditName,
+  EditCommand,
+  EditType,
+  EditApp,
+  EditDefault
+} edit_variable;
+
+typedef struct {
+  operation_type type;
+  int line;
+
+  string name;
+  cmd new_cmd;           // Add
+  edit_variable variable; // Edit
+  string value;          // Edit
+  unsigned int position; // Move (1-based)
+} batch_operation;
+
+/// Index of the commands ///
+
+// Hash table (open addressing) of the nodes of the list, by name or by app
+// (for the default profiles). The removed ones leave a tombstone
+typedef struct {
+  cmd_node **slots;
+  size_t capacity;
+  size_t used; // Including the tombstones
+  bool by_app;
+} name_index;
+
+static cmd_node tombstone;
+
+static uint64_t hash_name(const char *name) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *name; name++) {
+    hash ^= (unsigned char) *name;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static const char *index_key(name_index *idx, cmd_node *node) {
+  return (idx->by_app) ? node->info.app.str : node->info.name.str;
+}
+
+static cmd_node **index_slot(name_index *idx, const char *name, bool for_insert) {
+  cmd_node **free_slot = NULL;
+  for (size_t i = hash_name(name) & (idx->capacity - 1); ; i = (i + 1) & (idx->capacity - 1)) {
+    cmd_node **slot = &idx->slots[i];
+    if (!*slot) return (for_insert && free_slot) ? free_slot : slot;
+    if (*slot == &tombstone) {
+      if (!free_slot) free_slot = slot;
+    } else if (!strcmp(index_key(idx, *slot), name)) {
+      return slot;
+    }
+  }
+}
+
+static cmd_node *index_find(name_index *idx, const char *name) {
+  if (!idx->capacity) return NULL;
+
+  cmd_node **slot = index_slot(idx, name, false);
+  return (*slot && *slot != &tombstone) ? *slot : NULL;
+}
+
+static bool index_add(name_index *idx, cmd_node *node) {
+  if ((idx->used + 1) * 2 > idx->capacity) {
+    name_index bigger = { .capacity = (idx->capacity) ? idx->capacity * 2 : 1024, .by_app = idx->by_app };
+    if ( !(bigger.slots = calloc(bigger.capacity, sizeof(cmd_node *))) ) return false;
+
+    for (size_t i=0; i<idx->capacity; i++) {
+      if (!idx->slots[i] || idx->slots[i] == &tombstone) continue;
+      *index_slot(&bigger, index_key(idx, idx->slots[i]), true) = idx->slots[i];
+      bigger.used++;
+    }
+    free(idx->slots);
+    *idx = bigger;
+  }
+
+  cmd_node **slot = index_slot(idx, index_key(idx, node), true);
+  if (!*slot) idx->used++;
+  *slot = node;
+  return true;
+}
+
+static void index_remove(name_index *idx, const char *name) {
+  if (!idx->capacity) return;
+
+  cmd_node **slot = index_slot(idx, name, false);
+  if (*slot) *slot = &tombstone;
+}
+
+// Only if the node is the one indexed with its key
+static void index_remove_node(name_index *idx, cmd_node *node) {
+  if (!index_key(idx, node)) return; // Actions don't have an app
+  if (index_find(idx, index_key(idx, node)) == node) index_remove(idx, index_key(idx, node));
+}
+
+/// Parsing ///
+
+// Splits the line in tab separated fields (and unescapes them)
+static int split_fields(char *line, char *fields[BATCH_MAX_FIELDS]) {
+  int len = 0;
+  while (len < BATCH_MAX_FIELDS) {
+    fields[len++] = line;
+    char *tab = strchr(line, '\t');
+    if (!tab) break;
+    *tab = '\0';
+    line = tab + 1;
+  }
+
+  for (int i=0; i<len; i++) {
+    char *to = fields[i];
+    for (char *from = fields[i]; *from; from++) {
+      if (*from == '\\' && from[1]) {
+        from++;
+        *to++ = (*from == 't') ? '\t' : (*from == 'n') ? '\n' : *from;
+      } else {
+        *to++ = *from;
+      }
+    }
+    *to = '\0';
+  }
+  return len;
+}
+
+static bool parse_error(int line, const char *msg) {
+  string err = {0};
+  str_append(&err, "Line ");
+  str_append_int(&err, line);
+  str_append(&err, " of the batch: ");
+  str_append(&err, msg);
+  ERROR(err.str);
+  str_free(&err);
+  return false;
+}
+
+static void free_operation(batch_operation *op) {
+  str_free(&op->name);
+  str_free(&op->value);
+  str_free(&op->new_cmd.name);
+  str_free(&op->new_cmd.cmd);
+  str_free(&op->new_cmd.app);
+}
+
+static bool parse_add(batch_operation *op, char **fields, int len) {
+  if (len < 4) return parse_error(op->line, "expected 'add <name> <command> <type>'");
+  if (!*fields[1]) return parse_error(op->line, "the name can't be empty");
+  if (!valid_command(fields[2])) return parse_error(op->line, "invalid multi-step command");
+
+  cmd *c = &op->new_cmd;
+  INIT_CMD((*c));
+  if (!strcmp(fields[3], "action")) {
+    if (len > 4) return parse_error(op->line, "actions don't have an app");
+    c->type = Action;
+    c->default_for_app = false;
+  } else if (!strcmp(fields[3], "profile")) {
+    c->type = Profile;
+    str_append(&c->app, (len > 4 && *fields[4]) ? fields[4] : "generic");
+    c->default_for_app = (len > 5 && !strcmp(fields[5], "default"));
+    if (len > 5 && !c->default_for_app) return parse_error(op->line, "expected 'default' after the app");
+    if (c->default_for_app && !strcmp(c->app.str, "generic")) return parse_error(op->line, "generic profiles can't be default");
+  } else {
+    return parse_error(op->line, "the type should be 'action' or 'profile'");
+  }
+
+  str_append(&c->name, fields[1]);
+  str_append(&c->cmd, fields[2]);
+  return true;
+}
+
+static bool parse_edit(batch_operation *op, char **fields, int len) {
+  if (len != 4) return parse_error(op->line, "expected 'edit <name> <variable> <value>'");
+
+  const char *var = fields[2], *value = fields[3];
+  if (!strcmp(var, "name")) {
+    if (!*value) return parse_error(op->line, "the name can't be empty");
+    op->variable = EditName;
+  } else if (!strcmp(var, "command")) {
+    if (!valid_command(value)) return parse_error(op->line, "invalid multi-step command");
+    op->variable = EditCommand;
+  } else if (!strcmp(var, "type")) {
+    if (strcmp(value, "profile") && strcmp(value, "action")) return parse_error(op->line, "the type should be 'action' or 'profile'");
+    op->variable = EditType;
+  } else if (!strcmp(var, "app")) {
+    if (!*value) return parse_error(op->line, "the app can't be empty");
+    op->variable = EditApp;
+  } else if (!strcmp(var, "default")) {
+    if (strcmp(value, "yes") && strcmp(value, "no")) return parse_error(op->line, "'yes' or 'no' was expected");
+    op->variable = EditDefault;
+  } else {
+    return parse_error(op->line, "the variable should be 'name', 'command', 'type', 'app' or 'default'");
+  }
+
+  str_append(&op->value, value);
+  return true;
+}
+
+static bool parse_operation(char *line, batch_operation *op) {
+  char *fields[BATCH_MAX_FIELDS];
+  const int len = split_fields(line, fields);
+  if (len < 2) return parse_error(op->line, "expected an operation and the name of a command");
+  str_append(&op->name, fields[1]);
+
+  if (!strcmp(fields[0], "add")) {
+    op->type = AddOperation;
+    return parse_add(op, fields, len);
+
+  } else if (!strcmp(fields[0], "edit")) {
+    op->type = EditOperation;
+    return parse_edit(op, fields, len);
+
+  } else if (!strcmp(fields[0], "remove")) {
+    op->type = RemoveOperation;
+    if (len != 2) return parse_error(op->line, "expected 'remove <name>'");
+    return true;
+
+  } else if (!strcmp(fields[0], "move")) {
+    op->type = MoveOperation;
+    char *end = NULL;
+    const long position = (len == 3) ? strtol(fields[2], &end, 10) : 0;
+    if (len != 3 || *end || position < 1) return parse_error(op->line, "expected 'move <name> <position>' (from 1)");
+    op->position = position;
+    return true;
+  }
+
+  return parse_error(op->line, "the operation should be 'add', 'edit', 'remove' or 'move'");
+}
+
+/// Applying ///
+
+typedef struct {
+  cmd_node *list;
+  cmd_node *tail;
+  name_index index;
+  name_index defaults; // Default profile of each app
+} batch_state;
+
+// There's only one default profile for each app (the previous one is
+// disabled). The node should be a custom profile
+static bool set_default(batch_state *s, cmd_node *node, bool default_for_app) {
+  index_remove_node(&s->defaults, node);
+  node->info.default_for_app = default_for_app;
+  if (!default_for_app) return true;
+
+  cmd_node *def_profile = index_find(&s->defaults, node->info.app.str);
+  if (def_profile) def_profile->info.default_for_app = false;
+  return index_add(&s->defaults, node);
+}
+
+static cmd_node *find_tail(cmd_node *list) {
+  while (list && list->next) list = list->next;
+  return list;
+}
+
+static bool apply_add(batch_state *s, batch_operation *op) {
+  if (index_find(&s->index, op->name.str)) return parse_error(op->line, "the command name is already registered");
+
+  cmd_node *node = malloc(sizeof(cmd_node));
+  if (!node) return parse_error(op->line, "no free space");
+
+  node->info = op->new_cmd;
+  node->next = NULL;
+  INIT_CMD(op->new_cmd); // Owned by the list
+  if (s->tail) s->tail->next = node;
+  else s->list = node;
+  s->tail = node;
+
+  if (!index_add(&s->index, node) || !set_default(s, node, node->info.default_for_app))
+    return parse_error(op->line, "no free space");
+  return true;
+}
+
+static bool apply_edit(batch_state *s, batch_operation *op) {
+  cmd_node *node = index_find(&s->index, op->name.str);
+  if (!node) return parse_error(op->line, "can't find the command");
+
+  cmd *info = &node->info;
+  switch (op->variable) {
+    case EditName:
+      if (strcmp(op->value.str, info->name.str) && index_find(&s->index, op->value.str))
+        return parse_error(op->line, "the command name is already registered");
+      // The commands that use it are changed too
+      if (!rename_references(s->list, info->name.str, op->value.str)) return false;
+      index_remove(&s->index, info->name.str);
+      str_replace(&info->name, op->value.str);
+      return index_add(&s->index, node) || parse_error(op->line, "no free space");
+
+    case EditCommand:
+      str_replace(&info->cmd, op->value.str);
+      return true;
+
+    case EditType:
+      set_default(s, node, false);
+      if (!strcmp(op->value.str, "profile")) {
+        str_replace(&info->app, "generic");
+        info->type = Profile;
+      } else {
+        str_free(&info->app);
+        info->type = Action;
+      }
+      return true;
+
+    case EditApp:
+      if (info->type != Profile) return parse_error(op->line, "the command should be a profile in order to edit this");
+      if (info->default_for_app) {
+        const bool default_for_app = strcmp(op->value.str, "generic");
+        set_default(s, node, false);
+        str_replace(&info->app, op->value.str);
+        return set_default(s, node, default_for_app) || parse_error(op->line, "no free space");
+      }
+      str_replace(&info->app, op->value.str);
+      return true;
+
+    case EditDefault:
+      if (info->type != Profile) return parse_error(op->line, "the command should be a profile in order to edit this");
+      if (!strcmp(info->app.str, "generic")) return parse_error(op->line, "the command should not be a generic profile in order to edit this");
+      return set_default(s, node, !strcmp(op->value.str, "yes")) || parse_error(op->line, "no free space");
+  }
+
+  return false;
+}
+
+static bool apply_operation(batch_state *s, batch_operation *op) {
+  cmd_node *node = NULL;
+  switch (op->type) {
+    case AddOperation:
+      return apply_add(s, op);
+
+    case EditOperation:
+      return apply_edit(s, op);
+
+    case RemoveOperation:
+      if ( !(node = remove_command(&s->list, op->name.str)) ) return parse_error(op->line, "can't find the command");
+      index_remove(&s->index, op->name.str);
+      index_remove_node(&s->defaults, node);
+      if (node == s->tail) s->tail = find_tail(s->list);
+      free_cmd(node);
+      return true;
+
+    case MoveOperation:
+      if ( !(node = remove_command(&s->list, op->name.str)) ) return parse_error(op->line, "can't find the command");
+      if (!insert_command_node_at(&s->list, node, op->position - 1)) {
+        index_remove(&s->index, op->name.str);
+        index_remove_node(&s->defaults, node);
+        free_cmd(node);
+        return parse_error(op->line, "invalid position to move the command");
+      }
+      s->tail = find_tail(s->list);
+      return true;
+  }
+
+  return false;
+}
+
+// Reads a whole line without the line break. Returns false on EOF
+static bool read_batch_line(FILE *f, string *line) {
+  str_free(line);
+
+  char buffer[4096];
+  while (fgets(buffer, sizeof(buffer), f)) {
+    str_append(line, buffer);
+    if (line->str[line->str_len-1] == '\n') {
+      line->str[--line->str_len] = '\0';
+      return true;
+    }
+  }
+
+  return (line->str != NULL);
+}
+
+// The operations are read from the file (or from stdin if it's NULL or "-")
+int run_batch(const char *path) {
+  FILE *f = (!path || !strcmp(path, "-")) ? stdin : fopen(path, "r");
+  if (!f) {
+    ERROR("Unable to open the batch file");
+    return 1;
+  }
+
+  // Validate all the operations before touching the list
+  batch_operation *ops = NULL;
+  int ops_len = 0, ops_size = 0, line_number = 0;
+  bool ok = true;
+  string line = {0};
+  while (read_batch_line(f, &line)) {
+    line_number++;
+    if (!line.str_len || line.str[0] == '#') continue;
+
+    if (ops_len == ops_size) {
+      ops_size = (ops_size) ? ops_size * 2 : 64;
+      batch_operation *aux = realloc(ops, sizeof(batch_operation) * ops_size);
+      if (!aux) {
+        ok = parse_error(line_number, "no free space");
+        break;
+      }
+      ops = aux;
+    }
+
+    batch_operation *op = &ops[ops_len++];
+    memset(op, 0, sizeof(*op));
+    op->line = line_number;
+    if (!parse_operation(line.str, op)) ok = false;
+  }
+  str_free(&line);
+  if (f != stdin) fclose(f);
+
+  // Locked from the load to the save, so the changes made by other wakits
+  // meanwhile aren't lost
+  batch_state s = { .defaults.by_app = true };
+  const bool locked = ok && lock_config(true);
+  if (!locked) ok = false;
+  if (ok && load_cmd_list(&s.list) != 0) ok = false;
+
+  if (ok) {
+    s.tail = find_tail(s.list);
+    for (cmd_node *aux = s.list; ok && aux; aux = aux->next) {
+      if (!index_add(&s.index, aux)
+          || (aux->info.default_for_app && !index_add(&s.defaults, aux))
+      ) {
+        ok = parse_error(0, "no free space");
+      }
+    }
+  }
+
+  for (int i=0; ok && i<ops_len; i++) ok = apply_operation(&s, &ops[i]);
+  if (ok) ok = valid_list_references(s.list);
+
+  if (ok) {
+    if (!save_cmd_list(s.list)) ok = false;
+    else {
+      string msg = {0};
+      str_append_int(&msg, ops_len);
+      str_append(&msg, " operations applied");
+      DEBUG(msg.str);
+      str_free(&msg);
+    }
+  } else {
+    ERROR("Nothing was changed");
+  }
+  if (locked) unlock_config();
+
+  for (int i=0; i<ops_len; i++) free_operation(&ops[i]);
+  free(ops);
+  free(s.index.slots);
+  free(s.defaults.slots);
+  free_cmd_list(&s.list);
+  return (ok) ? 0 : 1;
+}
@@ -0,0 +1,19 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+// Each line of a batch is an operation, with tab separated fields:
+//   add     <name>  <command>  action
+//   add     <name>  <command>  profile  [<app>|generic  [default]]
+//   edit    <name>  name|command|type|app|default  <value>
+//   remove  <name>
+//   move    <name>  <position (1-based)>
+// Backslashes, tabs and line breaks inside the fields are escaped (\\, \t,
+// \n). Empty lines and lines starting with '#' are ignored.
+//
+// Every operation is validated before changing anything. They're applied to
+// the list in memory and it's saved once at the end (or not at all, if one
+// of them fails)
+
+int run_batch(const char *path);
+
+#endif // BATCH_H
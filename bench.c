@@ -0,0 +1,505 @@
+// Benchmarks for the core data paths (cmd list, save file and dynamic strings).
+//
+// It's built by 'make bench' and linked with the wakit objects. Allocations are
+// counted by wrapping malloc/calloc/realloc at link time (-Wl,--wrap=...), so
+// only the allocations made by wakit's code are counted.
+//
+// Every result is printed as one JSON object per line:
+//   {"bench":"load_cmd_list","n":1000,"iters":42,"ns_per_op":123.4,"allocs_per_op":3001.0}
+//
+// 'wakit_bench --stress [editors] [readers] [updates]' runs concurrent wakits
+// instead: the editors add commands ('wakit -a') while the readers load the
+// list, and then it checks that no update was lost and no read was torn:
+//   {"bench":"stress","editors":8,"readers":8,"updates":800,"lost":0,"torn_reads":0,...}
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wakit.h"
+#include "cli_io.h"
+#include "dynamic_string.h"
+
+// Minimum time spent on each benchmark (the operation is repeated until then)
+#define BENCH_MIN_NS 200000000L
+#define BENCH_MAX_ITERS 1000000L
+
+#define STRESS_EDITORS 8
+#define STRESS_READERS 8
+#define STRESS_UPDATES 100 // Per editor
+
+// main() of wakit (renamed when bench_wakit.o is built)
+int wakit_main(int argc, char *argv[]);
+
+static const size_t sizes[] = {10, 1000, 10000, 100000};
+
+static const char *apps[] = {
+  "krita", "gimp", "inkscape", "mypaint", "blender", "xournalpp", "firefox",
+  "libreoffice", "darktable", "rnote", "opentoonz", "godot", "freecad", "okular",
+  "zathura", "obs", "kdenlive", "drawing", "pinta", "scribus"
+};
+#define APPS_LEN (sizeof(apps)/sizeof(apps[0]))
+
+static const char *settings[] = {
+  "xsetwacom set %TabletID% Area 0 0 15200 9500",
+  "xsetwacom set %TabletID% Rotate half",
+  "xsetwacom set %TabletID% PressureCurve 0 10 90 100",
+  "xsetwacom set %TabletID% Button 2 key ctrl z",
+  "xsetwacom set %TabletID% Button 3 key shift",
+  "xsetwacom set %TabletID% MapToOutput HDMI-1",
+  "xsetwacom set %TabletID% Mode Absolute",
+  "xsetwacom set %TabletID% Threshold 26"
+};
+#define SETTINGS_LEN (sizeof(settings)/sizeof(settings[0]))
+
+/// Allocation counter ///
+
+static unsigned long allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  allocations++;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  allocations++;
+  return __real_realloc(ptr, size);
+}
+
+/// Helpers ///
+
+static long now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static void report(const char *name, size_t n, long iters, long elapsed_ns, unsigned long allocs) {
+  printf("{\"bench\":\"%s\",\"n\":%zu,\"iters\":%ld,\"ns_per_op\":%.1f,\"allocs_per_op\":%.1f}\n",
+         name, n, iters, (double) elapsed_ns / iters, (double) allocs / iters);
+  fflush(stdout);
+}
+
+// Deterministic pseudo-random numbers, so every run uses the same config
+static unsigned long rand_state = 1;
+static unsigned long next_rand() {
+  rand_state = rand_state * 6364136223846793005UL + 1442695040888963407UL;
+  return rand_state >> 33;
+}
+
+// Generates a config with a mix of actions, generic profiles, custom profiles
+// and one default profile per app (when there are enough commands)
+static cmd_node *generate_list(size_t n) {
+  cmd_node *list = NULL, *tail = NULL;
+  rand_state = n;
+
+  for (size_t i=0; i<n; i++) {
+    cmd c;
+    INIT_CMD(c);
+
+    str_append(&c.name, "cmd-");
+    str_append_int(&c.name, i);
+
+    const int steps = 1 + next_rand() % 4;
+    for (int s=0; s<steps; s++) {
+      if (s) str_append(&c.cmd, " ; ");
+      str_append(&c.cmd, settings[next_rand() % SETTINGS_LEN]);
+    }
+
+    const unsigned long kind = next_rand() % 10;
+    if (kind < 4) {
+      c.type = Action;
+      c.default_for_app = false;
+    } else if (kind < 6) {
+      c.type = Profile;
+      str_append(&c.app, "generic");
+      c.default_for_app = false;
+    } else {
+      c.type = Profile;
+      str_append(&c.app, apps[i % APPS_LEN]);
+      // The first profile of each app (after the first round) is the default one
+      c.default_for_app = (i / APPS_LEN == 1);
+    }
+
+    // Appended by hand to keep the generation linear
+    cmd_node *node = malloc(sizeof(cmd_node));
+    node->info = c;
+    node->next = NULL;
+    if (tail) tail->next = node;
+    else list = node;
+    tail = node;
+  }
+
+  return list;
+}
+
+static cmd_node *nth_node(cmd_node *list, size_t n) {
+  while (list && n--) list = list->next;
+  return list;
+}
+
+/// Benchmarks ///
+
+static void bench_load(size_t n) {
+  long iters = 0, start = now_ns(), elapsed = 0;
+  unsigned long allocs = allocations;
+  do {
+    cmd_node *list = NULL;
+    if (load_cmd_list(&list) != 0) ERROR("Unable to load the generated list");
+    free_cmd_list(&list);
+    iters++;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS && iters < BENCH_MAX_ITERS);
+
+  report("load_cmd_list", n, iters, elapsed, allocations - allocs);
+}
+
+static void bench_load_without_bodies(size_t n) {
+  long iters = 0, start = now_ns(), elapsed = 0;
+  unsigned long allocs = allocations;
+  do {
+    cmd_node *list = NULL;
+    if (load_cmd_list_fields(&list, WithoutBodies) != 0) ERROR("Unable to load the generated list");
+    free_cmd_list(&list);
+    iters++;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS && iters < BENCH_MAX_ITERS);
+
+  report("load_cmd_list_without_bodies", n, iters, elapsed, allocations - allocs);
+}
+
+static void bench_save(cmd_node *list, size_t n) {
+  long iters = 0, start = now_ns(), elapsed = 0;
+  unsigned long allocs = allocations;
+  do {
+    if (!save_cmd_list(list)) ERROR("Unable to save the generated list");
+    iters++;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS && iters < BENCH_MAX_ITERS);
+
+  report("save_cmd_list", n, iters, elapsed, allocations - allocs);
+}
+
+static void bench_search_cmd(cmd_node *list, size_t n) {
+  // Names are generated before timing, so only the search is measured
+  const int names_len = 64;
+  string names[64] = {0};
+  for (int i=0; i<names_len; i++) {
+    str_append(&names[i], "cmd-");
+    str_append_int(&names[i], next_rand() % n);
+  }
+
+  long iters = 0, start = now_ns(), elapsed = 0;
+  unsigned long allocs = allocations;
+  do {
+    if (!search_cmd(list, names[iters % names_len].str)) ERROR("Command not found");
+    iters++;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS && iters < BENCH_MAX_ITERS);
+
+  report("search_cmd", n, iters, elapsed, allocations - allocs);
+  for (int i=0; i<names_len; i++) str_free(&names[i]);
+}
+
+static void bench_search_profiles_app(cmd_node *list, size_t n) {
+  long iters = 0, start = now_ns(), elapsed = 0;
+  unsigned long allocs = allocations;
+  do {
+    // Apps outside of the config are included (they only get generic profiles)
+    const char *app = (iters % 4 == 3) ? "unknown-app" : apps[next_rand() % APPS_LEN];
+    cmd_node *availables = search_profiles_app(list, (char *) app);
+    free_cmd_list(&availables);
+    iters++;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS && iters < BENCH_MAX_ITERS);
+
+  report("search_profiles_app", n, iters, elapsed, allocations - allocs);
+}
+
+static void bench_print_instructions(cmd_node *list, size_t n) {
+  // Discard the output
+  fflush(stdout);
+  const int stdout_fd = dup(STDOUT_FILENO);
+  const int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  close(null_fd);
+
+  long iters = 0, start = now_ns(), elapsed = 0;
+  unsigned long allocs = allocations;
+  do {
+    print_instructions(list, "wakit");
+    iters++;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS && iters < BENCH_MAX_ITERS);
+  fflush(stdout);
+  allocs = allocations - allocs;
+
+  dup2(stdout_fd, STDOUT_FILENO);
+  close(stdout_fd);
+  report("print_instructions", n, iters, elapsed, allocs);
+}
+
+// The size is the length of the strings used
+static void bench_strings(size_t n) {
+  long iters, start, elapsed;
+  unsigned long allocs;
+  string s = {0};
+
+  iters = 0; start = now_ns(); allocs = allocations;
+  do {
+    for (size_t i=0; i<n; i++) str_append_char(&s, 'a' + i % 26);
+    str_free(&s);
+    iters++;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS && iters < BENCH_MAX_ITERS);
+  report("str_append_char", n, iters, elapsed, allocations - allocs);
+
+  iters = 0; start = now_ns(); allocs = allocations;
+  do {
+    for (size_t i=0; i<n; i+=8) str_append(&s, "abcdefgh");
+    str_free(&s);
+    iters++;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS && iters < BENCH_MAX_ITERS);
+  report("str_append", n, iters, elapsed, allocations - allocs);
+
+  iters = 0; start = now_ns(); allocs = allocations;
+  do {
+    for (size_t i=0; i<n; i+=8) str_append_int(&s, 12345678);
+    str_free(&s);
+    iters++;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS && iters < BENCH_MAX_ITERS);
+  report("str_append_int", n, iters, elapsed, allocations - allocs);
+
+  string src = {0};
+  for (size_t i=0; i<n; i++) str_append_char(&src, (i % 16 == 0) ? '"' : 'a' + i % 26);
+
+  iters = 0; start = now_ns(); allocs = allocations;
+  do {
+    str_replace(&s, src.str);
+    iters++;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS && iters < BENCH_MAX_ITERS);
+  report("str_replace", n, iters, elapsed, allocations - allocs);
+
+  iters = 0; start = now_ns(); allocs = allocations;
+  do {
+    str_replace(&s, src.str);
+    str_insert_at(&s, s.str_len / 2, "inserted");
+    iters++;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS && iters < BENCH_MAX_ITERS);
+  report("str_insert_at", n, iters, elapsed, allocations - allocs);
+
+  iters = 0; start = now_ns(); allocs = allocations;
+  do {
+    str_replace(&s, src.str);
+    str_search_and_replace(&s, "\"", "\\\"");
+    iters++;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS && iters < BENCH_MAX_ITERS);
+  report("str_search_and_replace", n, iters, elapsed, allocations - allocs);
+
+  str_free(&s);
+  str_free(&src);
+}
+
+/// Stress test ///
+
+typedef struct {
+  long loads;
+  long torn;        // Loads that failed
+  long regressions; // Loads older than the previous one (fewer commands or a lower generation)
+} reader_result;
+
+// The children only report through their exit code or the results pipe
+static void silence_output() {
+  const int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (null_fd == -1) return;
+  fflush(stdout);
+  dup2(null_fd, STDOUT_FILENO);
+  close(null_fd);
+}
+
+static void stress_editor(int editor, int updates) {
+  silence_output();
+  for (int i=0; i<updates; i++) {
+    char name[64], command[64];
+    snprintf(name, sizeof(name), "stress_%d_%d", editor, i);
+    snprintf(command, sizeof(command), "echo %d %d", editor, i);
+    if (wakit_main(5, (char*[]){"wakit", "-a", name, command, "action", NULL}) != 0) _exit(1);
+  }
+  _exit(0);
+}
+
+// Loads the list until the stop pipe is closed
+static void stress_reader(int stop_fd, int result_fd) {
+  silence_output();
+  reader_result r = {0};
+  size_t last_len = 0;
+  uint64_t last_generation = 0;
+
+  char byte;
+  while (read(stop_fd, &byte, 1) == -1) {
+    cmd_node *list = NULL;
+    r.loads++;
+    if (load_cmd_list_fields(&list, WithoutBodies) != 0) {
+      r.torn++;
+    } else {
+      size_t len = 0;
+      for (cmd_node *aux = list; aux; aux = aux->next) len++;
+      const uint64_t generation = loaded_config_generation();
+      if (len < last_len || generation < last_generation) r.regressions++;
+      last_len = len;
+      last_generation = generation;
+    }
+    free_cmd_list(&list);
+  }
+
+  if (write(result_fd, &r, sizeof(r)) != sizeof(r)) _exit(1);
+  _exit(0);
+}
+
+static int stress(int editors, int readers, int updates) {
+  uint64_t initial_generation;
+  int stop[2], results[2];
+  if (pipe(stop) || pipe(results)) {
+    ERROR("Unable to create the pipes of the stress test");
+    return 1;
+  }
+  fcntl(stop[0], F_SETFL, O_NONBLOCK);
+
+  // The list exists before the readers start (each update is a generation
+  // after this one)
+  if (!save_cmd_list(NULL) || !read_config_generation(&initial_generation)) {
+    ERROR("Unable to create the list of the stress test");
+    return 1;
+  }
+
+  const long start = now_ns();
+  for (int i=0; i<readers; i++) {
+    if (fork() == 0) {
+      close(stop[1]);
+      stress_reader(stop[0], results[1]);
+    }
+  }
+  pid_t *pids = calloc(editors, sizeof(pid_t));
+  for (int i=0; i<editors; i++) {
+    if ((pids[i] = fork()) == 0) stress_editor(i, updates);
+  }
+
+  int failed_editors = 0;
+  for (int i=0; i<editors; i++) {
+    int status;
+    waitpid(pids[i], &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) failed_editors++;
+  }
+  const long elapsed = now_ns() - start;
+  free(pids);
+
+  // The readers finish when the pipe is closed (EOF)
+  close(stop[1]);
+  close(results[1]);
+  reader_result total = {0}, r;
+  while (read(results[0], &r, sizeof(r)) == sizeof(r)) {
+    total.loads += r.loads;
+    total.torn += r.torn;
+    total.regressions += r.regressions;
+  }
+  close(results[0]);
+  close(stop[0]);
+  while (wait(NULL) > 0);
+
+  // Every update should be in the list, and each one should be a generation
+  cmd_node *list = NULL;
+  long found = 0;
+  if (load_cmd_list(&list) != 0) ERROR("Unable to load the list of the stress test");
+  for (cmd_node *aux = list; aux; aux = aux->next) {
+    if (!strncmp(aux->info.name.str, "stress_", 7)) found++;
+  }
+  free_cmd_list(&list);
+
+  const long expected = (long) editors * updates;
+  printf("{\"bench\":\"stress\",\"editors\":%d,\"readers\":%d,\"updates\":%ld,\"lost\":%ld,"
+         "\"generation\":%llu,\"failed_editors\":%d,\"loads\":%ld,\"torn_reads\":%ld,"
+         "\"regressions\":%ld,\"ms\":%.1f}\n",
+         editors, readers, expected, expected - found, (unsigned long long) (loaded_config_generation() - initial_generation),
+         failed_editors, total.loads, total.torn, total.regressions, elapsed / 1e6);
+  fflush(stdout);
+
+  return (found == expected && loaded_config_generation() - initial_generation == (uint64_t) expected && !failed_editors
+          && !total.torn && !total.regressions) ? 0 : 1;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  remove(path);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  // The config is saved inside a temporary home, so the user's one is untouched
+  char home[] = "/tmp/wakit_bench.XXXXXX";
+  if (!mkdtemp(home)) {
+    ERROR("Unable to create the temporary home");
+    return 1;
+  }
+  string config_dir = {0};
+  str_append(&config_dir, home);
+  str_append(&config_dir, "/.local");
+  mkdir(config_dir.str, 0700);
+  str_append(&config_dir, "/share");
+  mkdir(config_dir.str, 0700);
+  setenv("HOME", home, 1);
+
+  const bool stress_mode = (argc > 1 && !strcmp(argv[1], "--stress"));
+  int ret = 0;
+  if (stress_mode) {
+    ret = stress((argc > 2) ? atoi(argv[2]) : STRESS_EDITORS,
+                 (argc > 3) ? atoi(argv[3]) : STRESS_READERS,
+                 (argc > 4) ? atoi(argv[4]) : STRESS_UPDATES);
+  }
+
+  // Optional limit of the size (e.g. 'wakit_bench 10000' skips the biggest config)
+  const size_t max_size = (argc > 1 && !stress_mode) ? strtoul(argv[1], NULL, 10) : 0;
+
+  for (size_t i=0; !stress_mode && i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+    const size_t n = sizes[i];
+    if (max_size && n > max_size) break;
+
+    cmd_node *list = generate_list(n);
+    bench_save(list, n);
+    bench_load(n);
+    bench_load_without_bodies(n);
+    bench_search_cmd(list, n);
+    bench_search_profiles_app(list, n);
+    bench_print_instructions(list, n);
+    bench_strings(n);
+
+    // Sanity check: the generated list should be complete
+    if (!nth_node(list, n-1)) ERROR("The generated list is incomplete");
+    free_cmd_list(&list);
+  }
+
+  // Everything written inside the temporary home (list, lock, usage, caches...)
+  nftw(home, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  str_free(&config_dir);
+  return ret;
+}
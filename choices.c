@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "choices.h"
+#include "cli_io.h"
+#include "wakit.h"
+
+// FNV-1a
+static uint64_t hash_app(const char *app) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *app; app++) {
+    hash ^= (unsigned char) *app;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+void choices_init(choice_store *store, long ttl_s) {
+  *store = (choice_store) {0};
+  store->ttl_s = ttl_s;
+}
+
+void choices_free(choice_store *store) {
+  for (size_t i=0; i<store->capacity; i++) {
+    str_free(&store->slots[i].app);
+    str_free(&store->slots[i].profile);
+  }
+  free(store->slots);
+  store->slots = NULL;
+  store->capacity = store->len = 0;
+}
+
+static bool expired(choice_store *store, profile_choice *choice, time_t now) {
+  return store->ttl_s && now - choice->chosen_at > store->ttl_s;
+}
+
+// The slot of the app, or the free slot where it should be inserted
+static profile_choice *find_slot(profile_choice *slots, size_t capacity, const char *app) {
+  size_t i = hash_app(app) & (capacity - 1);
+  while (slots[i].app.str && strcmp(slots[i].app.str, app)) i = (i + 1) & (capacity - 1);
+  return &slots[i];
+}
+
+// The capacity is always a power of 2 and the table is kept under 3/4 full
+static bool grow(choice_store *store) {
+  const size_t capacity = (store->capacity) ? store->capacity * 2 : CHOICES_INITIAL_CAPACITY;
+  profile_choice *slots = calloc(capacity, sizeof(profile_choice));
+  if (!slots) return false;
+
+  for (size_t i=0; i<store->capacity; i++) {
+    if (store->slots[i].app.str) *find_slot(slots, capacity, store->slots[i].app.str) = store->slots[i];
+  }
+
+  free(store->slots);
+  store->slots = slots;
+  store->capacity = capacity;
+  return true;
+}
+
+// The profile chosen for the app (NULL if there isn't one or it expired)
+const char *choices_get(choice_store *store, const char *app) {
+  if (!store->len) return NULL;
+
+  profile_choice *choice = find_slot(store->slots, store->capacity, app);
+  if (!choice->app.str || expired(store, choice, time(NULL))) return NULL;
+
+  return choice->profile.str;
+}
+
+static bool set_choice(choice_store *store, const char *app, const char *profile, time_t chosen_at) {
+  if ((store->len + 1) * 4 > store->capacity * 3 && !grow(store)) return false;
+
+  profile_choice *choice = find_slot(store->slots, store->capacity, app);
+  if (!choice->app.str) {
+    if (!str_append(&choice->app, app)) return false;
+    store->len++;
+  }
+
+  choice->chosen_at = chosen_at;
+  return str_replace(&choice->profile, (char *) profile);
+}
+
+bool choices_set(choice_store *store, const char *app, const char *profile) {
+  return set_choice(store, app, profile, time(NULL));
+}
+
+static bool get_choices_path(string *path) {
+  const char *home = getenv("HOME");
+  if (!home) return false;
+
+  str_append(path, home);
+  str_append(path, "/.local/share/" CHOICES_FILE_NAME);
+  return true;
+}
+
+// File format (for each choice): app, profile and the time it was chosen.
+// The expired choices are skipped
+bool choices_load(choice_store *store) {
+  string path = {0};
+  if (!get_choices_path(&path)) return false;
+
+  FILE *f = fopen(path.str, "r");
+  str_free(&path);
+  if (!f) return true; // Nothing saved yet
+
+  const time_t now = time(NULL);
+  string app = {0}, profile = {0};
+  profile_choice choice;
+  bool ok = true;
+  while (str_read_from_bfile(&app, f)) {
+    if (!str_read_from_bfile(&profile, f)
+        || !fread(&choice.chosen_at, sizeof(time_t), 1, f)
+        || !app.str || !profile.str
+    ) {
+      ERROR("The file of the profile choices is corrupted. Ignoring the rest of it...");
+      ok = false;
+      break;
+    }
+
+    if (!expired(store, &choice, now)) set_choice(store, app.str, profile.str, choice.chosen_at);
+  }
+
+  fclose(f);
+  str_free(&app);
+  str_free(&profile);
+  return ok;
+}
+
+// The file is replaced atomically (rename). The temporary file has a unique
+// name, so two processes saving at once don't write into the same one
+bool choices_save(choice_store *store) {
+  string path = {0}, tmp_path = {0};
+  if (!get_choices_path(&path)) return false;
+
+  FILE *f = open_temporary(path.str, &tmp_path);
+  bool ok = (f != NULL);
+  const time_t now = time(NULL);
+  for (size_t i=0; ok && i<store->capacity; i++) {
+    profile_choice *choice = &store->slots[i];
+    if (!choice->app.str || expired(store, choice, now)) continue;
+
+    ok = str_write_to_file(choice->app, f)
+         && str_write_to_file(choice->profile, f)
+         && fwrite(&choice->chosen_at, sizeof(time_t), 1, f);
+  }
+  if (f && fclose(f)) ok = false;
+  if (ok && rename(tmp_path.str, path.str)) ok = false;
+
+  if (!ok) {
+    ERROR("Unable to save the profile choices");
+    if (f) remove(tmp_path.str);
+  }
+  str_free(&path);
+  str_free(&tmp_path);
+  return ok;
+}
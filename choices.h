@@ -0,0 +1,37 @@
+#ifndef CHOICES_H
+#define CHOICES_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "dynamic_string.h"
+
+// Saved in ~/.local/share (next to the list of commands)
+#define CHOICES_FILE_NAME "wakit_choices"
+#define CHOICES_INITIAL_CAPACITY 64
+
+// The profile that the user chose for an app, when it had more than one
+typedef struct {
+  string app;     // Empty if the slot is free
+  string profile;
+  time_t chosen_at;
+} profile_choice;
+
+// Hash table (open addressing) of the choices by app name
+typedef struct {
+  profile_choice *slots;
+  size_t capacity;
+  size_t len;
+
+  long ttl_s; // The choices older than this are forgotten (0 to keep them forever)
+} choice_store;
+
+void choices_init(choice_store *store, long ttl_s);
+void choices_free(choice_store *store);
+const char *choices_get(choice_store *store, const char *app);
+bool choices_set(choice_store *store, const char *app, const char *profile);
+
+bool choices_load(choice_store *store);
+bool choices_save(choice_store *store);
+
+#endif // CHOICES_H
@@ -1,3 +1,12 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include "cli_io.h"
 
 void error(const char *msg, char *filename, int line) {
@@ -21,25 +30,79 @@ bool question_yn(char *msg) {
          : false;
 }
 
+// Runs 'sh -c <cmd>' like popen(), but with an empty signal mask and the
+// default handlers: the daemon blocks its signals in every thread (see
+// watch_signals()), and the command would inherit them blocked. The stdin of
+// the command is written (mode "w") or its stdout is read (mode "r"), or
+// neither with a NULL mode. Returns the pid (-1 on error)
+static pid_t spawn_command(char *cmd, const char *mode, FILE **pipe_end) {
+  int fds[2] = {-1, -1};
+  if (mode && pipe2(fds, O_CLOEXEC)) return -1;
+  const bool writes = (mode && *mode == 'w');
+
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_init(&attr);
+  posix_spawn_file_actions_init(&actions);
+
+  sigset_t empty, defaults;
+  sigemptyset(&empty);
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGCHLD);
+  posix_spawnattr_setsigmask(&attr, &empty);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  if (mode) posix_spawn_file_actions_adddup2(&actions, fds[(writes) ? 0 : 1], (writes) ? STDIN_FILENO : STDOUT_FILENO);
+
+  pid_t pid;
+  char *argv[] = { "sh", "-c", cmd, NULL };
+  if (posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ)) pid = -1;
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (!mode) return pid;
+
+  // The end of the command is closed, so the other one sees its EOF
+  close(fds[(writes) ? 0 : 1]);
+  const int own = fds[(writes) ? 1 : 0];
+  if (pid == -1 || !(*pipe_end = fdopen(own, mode))) {
+    close(own);
+    if (pid != -1) waitpid(pid, NULL, 0);
+    return -1;
+  }
+  return pid;
+}
+
+// The status of the command, as given by waitpid() (-1 on error)
+static int wait_command(pid_t pid) {
+  int status;
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR) return -1;
+  }
+  return status;
+}
+
 int console_input(char *cmd, const char *input) {
   if (!cmd || !input) return 1;
 
-  FILE *pipe = popen(cmd, "w");
-  if (!pipe) {
+  FILE *pipe = NULL;
+  const pid_t pid = spawn_command(cmd, "w", &pipe);
+  if (pid == -1) {
     ERROR("popen() failed!");
     return 1;
   }
 
   fprintf(pipe, "%s", input);
-  return WEXITSTATUS(pclose(pipe));
+  fclose(pipe);
+  return WEXITSTATUS(wait_command(pid));
 }
 
 int console_output(char *cmd, string *output) {
   if (!cmd || !output) return 1;
   if (output->str) str_free(output);
 
-  FILE* pipe = popen(cmd, "r");
-  if (!pipe) {
+  FILE *pipe = NULL;
+  const pid_t pid = spawn_command(cmd, "r", &pipe);
+  if (pid == -1) {
     ERROR("popen() failed!");
     return 1;
   }
@@ -47,16 +110,18 @@ int console_output(char *cmd, string *output) {
   char buffer[256];
   while (fgets(buffer, sizeof(buffer), pipe) != NULL)
     str_append(output, buffer);
+  fclose(pipe);
 
   // Removes the line break at the end of the line
   if (output->str_len != 0)
     output->str[output->str_len-1] = '\0';
 
-  return WEXITSTATUS(pclose(pipe));
+  return WEXITSTATUS(wait_command(pid));
 }
 
 int console_silent(char *cmd) {
   if (!cmd) return 1;
 
-  return system(cmd);
+  const pid_t pid = spawn_command(cmd, NULL, NULL);
+  return (pid == -1) ? -1 : wait_command(pid);
 }
@@ -0,0 +1,1482 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "wakit.h"
+#include "cli_io.h"
+#include "gui_io.h"
+#include "dynamic_string.h"
+#include "window_manager.h"
+#include "status.h"
+#include "plan.h"
+#include "tablet.h"
+#include "process.h"
+#include "queue.h"
+#include "choices.h"
+#include "matcher.h"
+#include "pid_cache.h"
+#include "usage.h"
+#include "trace.h"
+#include "macro.h"
+
+// Time between checks of the focused window, when it can't be watched
+// through the X connection (ms)
+#define DAEMON_POLL_MS 250
+// Time that the focus must stay on an app before applying its profile (ms)
+#define DEFAULT_SETTLE_MS 300
+// Time between checks of the screen while it's idle, to know when it's back
+// (DPMS doesn't send events) (ms)
+#define IDLE_RECHECK_MS 2000
+// Time without new input devices before applying the profiles again, after a
+// device is plugged (its nodes are created one by one) (ms)
+#define HOTPLUG_SETTLE_MS 50
+// If the devices aren't ready yet (the profile fails), it's applied again
+// after HOTPLUG_RETRY_MS, doubling the wait each time (up to HOTPLUG_RETRIES
+// times)
+#define HOTPLUG_RETRY_MS 100
+#define HOTPLUG_RETRIES 5
+
+const char *decision_type_name(decision_type type) {
+  switch (type) {
+    case NoProfile:         return "none";
+    case DefaultProfile:    return "default";
+    case SingleProfile:     return "single";
+    case RememberedProfile: return "remembered";
+    case WindowProfile:     return "window";
+    case SelectedProfile:   return "selected";
+  }
+  return "unknown";
+}
+
+void engine_init(daemon_engine *engine, cmd_node *list, ask_profile_fn ask, void *ask_data) {
+  engine->list = list;
+  choices_init(&engine->own_choices, 0);
+  engine->choices = &engine->own_choices;
+  engine->choices_lock = NULL;
+  engine->per_window = false;
+  engine->windows = (window_lru) {0};
+  engine->last_window = 0;
+  engine->last_app = (string) {0};
+  engine->ask = ask;
+  engine->ask_data = ask_data;
+}
+
+void engine_free(daemon_engine *engine) {
+  choices_free(&engine->own_choices);
+  window_lru_free(&engine->windows);
+  str_free(&engine->last_app);
+}
+
+// The engine uses the choices of the store (owned by the caller) instead of
+// its own ones. The lock is held while they're used
+void engine_share_choices(daemon_engine *engine, choice_store *choices, pthread_mutex_t *lock) {
+  engine->choices = choices;
+  engine->choices_lock = lock;
+}
+
+static void lock_choices(daemon_engine *engine) {
+  if (engine->choices_lock) pthread_mutex_lock(engine->choices_lock);
+}
+
+static void unlock_choices(daemon_engine *engine) {
+  if (engine->choices_lock) pthread_mutex_unlock(engine->choices_lock);
+}
+
+void free_decision(daemon_decision *decision) {
+  str_free(&decision->previous_app);
+  free_cmd_list(&decision->available_profiles);
+  decision->profile = NULL;
+}
+
+// Remembers the profile of each window (up to 'capacity' windows), instead
+// of only one profile for each app
+bool engine_track_windows(daemon_engine *engine, int capacity) {
+  engine->per_window = window_lru_init(&engine->windows, capacity);
+  return engine->per_window;
+}
+
+// When the window is destroyed
+void engine_forget_window(daemon_engine *engine, unsigned long window) {
+  window_lru_remove(&engine->windows, window);
+  if (engine->last_window == window) engine->last_window = 0;
+}
+
+// The profile remembered, if it's still one of the profiles of the app
+static cmd_node *remembered_profile(daemon_engine *engine, const char *app, const char *name) {
+  cmd_node *profile = search_cmd(engine->list, (char *) name);
+  if (!profile || profile->info.type != Profile) return NULL;
+  if (strcmp(profile->info.app.str, app) && strcmp(profile->info.app.str, "generic")) return NULL;
+
+  cmd_node *n = malloc(sizeof(cmd_node));
+  n->next = NULL;
+  n->info = duplicate_cmd(profile->info);
+  return n;
+}
+
+// Returns false if the focused app (or window, if they're tracked) didn't
+// change (nothing to do). Otherwise, the decision is filled and it should be
+// freed with free_decision(). The window is 0 if it's unknown
+bool engine_focus(daemon_engine *engine, const char *app, unsigned long window, daemon_decision *decision) {
+  *decision = (daemon_decision) {0};
+  const bool by_window = engine->per_window && window;
+  if (by_window) {
+    if (window == engine->last_window) return false;
+  } else if (engine->last_app.str && !strcmp(app, engine->last_app.str)) {
+    return false;
+  }
+  engine->last_window = window;
+
+  // A window keeps its own profile. A new window starts with the choice for
+  // the app, so the user is only asked if there isn't one
+  cmd_node *available_profiles = NULL;
+  if (by_window) {
+    decision->type = WindowProfile;
+    available_profiles = remembered_profile(engine, app, window_lru_get(&engine->windows, window));
+  }
+  if (!available_profiles) {
+    decision->type = RememberedProfile;
+    lock_choices(engine);
+    available_profiles = remembered_profile(engine, app, choices_get(engine->choices, app));
+    unlock_choices(engine);
+  }
+
+  if (!available_profiles) {
+    available_profiles = search_profiles_app(engine->list, (char *) app);
+
+    if (!available_profiles) decision->type = NoProfile;
+    else if (available_profiles->info.default_for_app) decision->type = DefaultProfile;
+    else decision->type = SingleProfile;
+  }
+
+  cmd_node *profile = NULL;
+  if (available_profiles && available_profiles->next) { // More than one profile
+    decision->type = SelectedProfile;
+    while (!profile) profile = engine->ask(available_profiles, engine->ask_data);
+
+    // Remember the selection (custom or generic), so the user isn't asked
+    // again when focusing in the app
+    if (strcmp(app, "generic")) {
+      lock_choices(engine);
+      choices_set(engine->choices, app, profile->info.name.str);
+      unlock_choices(engine);
+    }
+
+  } else {
+    profile = available_profiles;
+  }
+
+  // Switching back to the window applies the profile without searching it
+  if (by_window && profile) window_lru_put(&engine->windows, window, profile->info.name.str);
+
+  decision->available_profiles = available_profiles;
+  decision->profile = profile;
+  str_append(&decision->previous_app, engine->last_app.str);
+  str_replace(&engine->last_app, (char *) app);
+  return true;
+}
+
+static void report_command(int ret, string *output) {
+  string debug_msg = {0};
+  if (output->str_len) {
+    str_append(&debug_msg, "Command output: ");
+    str_append(&debug_msg, output->str);
+    DEBUG(debug_msg.str);
+  }
+
+  if (ret) {
+    str_replace(&debug_msg, "The command failed with exit code ");
+    str_append_int(&debug_msg, ret);
+  } else {
+    str_replace(&debug_msg, "The command was executed successfully");
+  }
+  DEBUG(debug_msg.str);
+  str_free(&debug_msg);
+}
+
+// The profile that is being applied and the next one, that will be applied
+// when it finishes (only the last one is kept)
+typedef struct {
+  const char *display; // Where the profiles run (NULL for the one of the environment)
+  command_run *running;
+  string running_name;
+  cmd next;
+  bool has_next;
+
+  // The last profile applied. If it has steps that follow the focused window
+  // (see plan.h), they run again when the window is in another output
+  string output; // Of the focused window (empty if it isn't known)
+  cmd current;
+  bool has_current;
+  bool follows;
+  bool output_changed;
+
+  // A device was plugged: the parameters it had were reset by the driver
+  bool reset_devices; // The next profile starts without the devices and parameters known
+  bool reapplying;    // The profile running is the first one after that
+  int retries;
+  long retry_at_ms;   // Monotonic time to apply the profile again (0 for never)
+
+  trace_span span; // Of the profile being applied
+} profile_application;
+
+static void free_profile(cmd *profile) {
+  str_free(&profile->name);
+  str_free(&profile->cmd);
+  str_free(&profile->app);
+}
+
+static void start_profile(profile_application *a, cmd profile, bool only_following) {
+  const run_target target = { .display = a->display, .output = a->output.str, .only_following = only_following };
+  str_replace(&a->running_name, profile.name.str);
+  a->output_changed = false;
+
+  // The devices are discovered again, and every parameter is set
+  a->reapplying = a->reset_devices && !only_following;
+  if (a->reapplying) {
+    invalidate_tablet_devices(a->display);
+    clear_applied_state(a->display);
+    a->reset_devices = false;
+  }
+
+  a->span = trace_begin((only_following) ? "follow_output" : (a->reapplying) ? "reapply_profile" : "apply_profile");
+  if ( !(a->running = start_command(profile.cmd.str, &target)) ) ERROR("Unable to apply the profile");
+}
+
+static void apply_profile(profile_application *a, cmd profile) {
+  if (a->running) {
+    if (a->has_next) free_profile(&a->next);
+    a->next = duplicate_cmd(profile);
+    a->has_next = true;
+    return;
+  }
+
+  // The profile can be the current one (see reapply_profile())
+  cmd current = duplicate_cmd(profile);
+  if (a->has_current) free_profile(&a->current);
+  a->current = current;
+  a->has_current = true;
+
+  start_profile(a, a->current, false);
+  a->follows = a->running && command_follows_window(a->running);
+}
+
+// After a device is plugged, the current profile is applied again (now or
+// after the profile being applied). A profile waiting to be applied is
+// applied from scratch instead
+static void reapply_profile(profile_application *a) {
+  a->retry_at_ms = 0;
+  a->reset_devices = true;
+  if (a->has_current && !a->has_next) apply_profile(a, a->current);
+}
+
+// Runs the steps that follow the window again (now or after the profile
+// being applied)
+static void follow_output(profile_application *a, const char *output) {
+  if (a->output.str && !strcmp(a->output.str, output)) return;
+
+  str_replace(&a->output, (char *) output);
+  a->output_changed = true;
+  if (!a->running && a->has_current && a->follows) start_profile(a, a->current, true);
+}
+
+// Reports the profile that finished and starts the next one
+static void update_application(profile_application *a) {
+  if (!a->running || !update_command(a->running)) return;
+
+  string output = {0};
+  const int ret = finish_command(a->running, &output);
+  a->running = NULL;
+  trace_end(&a->span);
+
+  string debug_msg = {0};
+  str_append(&debug_msg, "Profile applied: ");
+  str_append(&debug_msg, a->running_name.str);
+  if (a->display) {
+    str_append(&debug_msg, " (display ");
+    str_append(&debug_msg, a->display);
+    str_append_char(&debug_msg, ')');
+  }
+  DEBUG(debug_msg.str);
+  str_free(&debug_msg);
+  report_command(ret, &output);
+  str_free(&output);
+
+  // The devices plugged may not be ready yet
+  if (a->reapplying && ret && a->retries < HOTPLUG_RETRIES) {
+    a->retry_at_ms = monotonic_ms() + (HOTPLUG_RETRY_MS << a->retries++);
+    DEBUG("The devices may not be ready yet. The profile will be applied again...");
+  } else if (!ret) {
+    a->retry_at_ms = 0;
+  }
+  a->reapplying = false;
+
+  if (a->has_next) {
+    a->has_next = false;
+    apply_profile(a, a->next);
+    free_profile(&a->next);
+  } else if (a->output_changed && a->has_current && a->follows) {
+    start_profile(a, a->current, true);
+  }
+}
+
+static void free_application(profile_application *a) {
+  str_free(&a->running_name);
+  str_free(&a->output);
+  if (a->has_current) free_profile(&a->current);
+  a->has_current = false;
+}
+
+/// Pipeline ///
+
+// The daemon is split in stages, each one in its own thread and connected by
+// single-producer/single-consumer queues:
+//
+//   watcher (main thread) --> resolver --> executor
+//      ^                         |
+//      '------- status ----------'
+//
+// - Watcher: follows the focus (debounce), the status socket, the config file
+//   and the signals. It never blocks on the other stages, so the focus
+//   changes are noticed at the same speed however slow the profiles are.
+// - Resolver: decides the profile of the focused app (the user may be asked).
+// - Executor: runs the profiles. A profile that is queued but not started is
+//   superseded by a newer one. When a device is plugged, it applies the
+//   current profile again.
+// - The changes of the state are published by the watcher, as it owns the
+//   status socket.
+//
+// The daemon can serve several X displays ('--display'). Each one is a seat:
+// its own X connection, focus, status socket and running file, its own
+// resolver (so a prompt open in a display doesn't delay the others) and its
+// own queues. The watcher and the executor serve every seat, and the list of
+// commands, the rules and the choices are shared.
+typedef enum {
+  FocusMessage,  // Watcher --> resolver: the app settled
+  ForgetMessage, // Watcher --> resolver: the window was destroyed
+  ApplyMessage,  // Resolver --> executor: the profile to apply
+  OutputMessage, // Resolver --> executor: the output of the focused window changed
+  ReapplyMessage, // Watcher --> resolver --> executor: a device was plugged
+  StatusMessage, // Resolver --> watcher: the app and the profile to publish
+  StopMessage
+} message_type;
+
+typedef struct {
+  message_type type;
+  string app;          // Focus and status
+  unsigned long window; // Focus and forget (0 if it's unknown)
+  string output;       // Focus and output (empty if it's unknown)
+  string profile_name; // Status (empty if there isn't a profile)
+  bool has_profile;    // Apply
+  cmd profile;
+} daemon_message;
+
+static daemon_message *new_message(message_type type, const char *app, cmd *profile) {
+  daemon_message *m = calloc(1, sizeof(daemon_message));
+  if (!m) return NULL;
+
+  m->type = type;
+  if (app) str_append(&m->app, app);
+  if (profile) {
+    m->has_profile = true;
+    m->profile = duplicate_cmd(*profile);
+  }
+  return m;
+}
+
+static void free_message(daemon_message *m) {
+  if (!m) return;
+
+  str_free(&m->app);
+  str_free(&m->output);
+  str_free(&m->profile_name);
+  if (m->has_profile) {
+    str_free(&m->profile.name);
+    str_free(&m->profile.cmd);
+    str_free(&m->profile.app);
+  }
+  free(m);
+}
+
+// The messages are dropped if the consumer is too far behind (except the stop
+// message, that is retried)
+static void send_message(spsc_queue *q, daemon_message *m) {
+  if (!m) {
+    ERROR("Unable to allocate a message of the daemon");
+    return;
+  }
+
+  while (!queue_push(q, m)) {
+    if (m->type != StopMessage) {
+      DEBUG("A stage of the daemon is too far behind. Dropping a message...");
+      free_message(m);
+      return;
+    }
+    usleep(1000);
+  }
+}
+
+// The events of the epoll instances carry the source and the seat
+typedef enum {
+  FocusSource,
+  PollSource,
+  StatusSource,
+  ConfigSource,
+  SettleSource,
+  SignalSource,
+  IdleSource,
+  InputSource,
+  HotplugSource,
+  StatusQueueSource,
+  ExecutorQueueSource,
+  DeadlineSource,
+  SupervisorSource
+} event_source;
+
+#define EVENT_SOURCE(data) ((event_source) ((data) & 0xffff))
+#define EVENT_SEAT(data) ((int) ((data) >> 16))
+
+// The list of commands is shared by the resolvers. When it's reloaded, the
+// previous one is freed once no resolver is using it
+typedef struct {
+  cmd_node *list;
+  int users;
+} shared_list;
+
+typedef struct daemon_state daemon_state;
+
+typedef struct {
+  daemon_state *d;
+  const char *display; // NULL for the one of the environment
+
+  // Watcher
+  status_publisher status;
+  focus_watcher *watcher; // NULL if the focus is polled
+  int poll_timer;
+  string pending_app;
+  unsigned long pending_window;
+  string pending_output;
+  int settle_timer;
+  bool suspended; // While the screen is locked, blanked or off
+  int idle_timer;
+
+  // Resolver
+  daemon_engine engine;
+  pthread_t resolver;
+  string last_output;
+
+  // Executor
+  profile_application application;
+
+  spsc_queue to_resolver;
+  spsc_queue to_executor;
+  spsc_queue to_watcher;
+} daemon_seat;
+
+struct daemon_state {
+  daemon_seat seats[DAEMON_MAX_DISPLAYS];
+  int seats_len;
+
+  // Watcher
+  rule_matcher rules;
+  bool has_rules;
+  pid_cache processes;
+  long settle_ms;
+  bool per_window;
+
+  // Resolvers
+  shared_list *list;
+  pthread_mutex_t list_lock;
+  choice_store choices;
+  pthread_mutex_t choices_lock;
+  FILE *record;
+  bool persist_choices;
+};
+
+static bool watch_fd(int epoll_fd, int fd, event_source source, int seat) {
+  if (fd == -1) return false;
+
+  struct epoll_event event = { .events = EPOLLIN, .data.u32 = (uint32_t) source | ((uint32_t) seat << 16) };
+  return !epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Arms the timer to expire in ms (or at the monotonic time in ms if it's
+// absolute). A time of 0 disarms it
+static void arm_timer(int fd, long ms, bool absolute) {
+  struct itimerspec spec = {0};
+  spec.it_value.tv_sec = ms / 1000;
+  spec.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  if (!ms && !absolute) spec.it_value.tv_nsec = 1; // Expire now
+  timerfd_settime(fd, (absolute) ? TFD_TIMER_ABSTIME : 0, &spec, NULL);
+}
+
+static void drain_fd(int fd) {
+  char buffer[256];
+  while (read(fd, buffer, sizeof(buffer)) > 0);
+}
+
+static shared_list *acquire_list(daemon_state *d) {
+  pthread_mutex_lock(&d->list_lock);
+  shared_list *l = d->list;
+  l->users++;
+  pthread_mutex_unlock(&d->list_lock);
+  return l;
+}
+
+static void release_list(daemon_state *d, shared_list *l) {
+  pthread_mutex_lock(&d->list_lock);
+  const bool unused = (--l->users == 0);
+  pthread_mutex_unlock(&d->list_lock);
+
+  if (unused) {
+    free_cmd_list(&l->list);
+    free(l);
+  }
+}
+
+// The list becomes the current one (the daemon holds a reference to it)
+static bool replace_list(daemon_state *d, cmd_node *list) {
+  shared_list *l = malloc(sizeof(shared_list));
+  if (!l) return false;
+  *l = (shared_list) { .list = list, .users = 1 };
+
+  pthread_mutex_lock(&d->list_lock);
+  shared_list *previous = d->list;
+  d->list = l;
+  pthread_mutex_unlock(&d->list_lock);
+
+  if (previous) release_list(d, previous);
+  return true;
+}
+
+// The profiles are ordered by their frecency (the usage is read each time,
+// because it's also recorded by other wakits). The prompt is shown in the
+// display of the seat
+static cmd_node *ask_with_rofi(cmd_node *available_profiles, void *data) {
+  daemon_seat *s = data;
+  usage_store usage;
+  usage_init(&usage);
+  usage_load(&usage);
+
+  string input = {0}, name = {0};
+  cmd_node *selected = NULL;
+  if (frecency_menu(available_profiles, &usage, &input) && ask_for_name(input.str, s->display, &name))
+    selected = search_cmd(available_profiles, name.str);
+
+  usage_free(&usage);
+  str_free(&input);
+  str_free(&name);
+  return selected;
+}
+
+/// Resolver ///
+
+// Decides the profile of the app and sends it to the executor. The output
+// goes first, so the profile (or the one applied before) follows the window
+static void resolve_focus(daemon_seat *s, const char *app, unsigned long window, const char *output) {
+  trace_span span = trace_begin("resolve_focus");
+  daemon_state *d = s->d;
+  if (output && (!s->last_output.str || strcmp(output, s->last_output.str))) {
+    str_replace(&s->last_output, (char *) output);
+    daemon_message *m = new_message(OutputMessage, NULL, NULL);
+    if (m) str_append(&m->output, output);
+    send_message(&s->to_executor, m);
+  }
+
+  shared_list *list = acquire_list(d);
+  s->engine.list = list->list;
+
+  daemon_decision decision;
+  if (!engine_focus(&s->engine, app, window, &decision)) {
+    s->engine.list = NULL;
+    release_list(d, list);
+    trace_end(&span);
+    return;
+  }
+
+  cmd_node *profile = decision.profile;
+  if (decision.type == SelectedProfile && d->persist_choices) {
+    pthread_mutex_lock(&d->choices_lock);
+    choices_save(&d->choices);
+    pthread_mutex_unlock(&d->choices_lock);
+  }
+
+  // Save the event, so it can be replayed (see replay_trace()). The file is
+  // locked, as the resolvers of other displays write to it too
+  if (d->record) {
+    flockfile(d->record);
+    fprintf(d->record, "%s", app);
+    if (decision.type == SelectedProfile) fprintf(d->record, "\t%s", profile->info.name.str);
+    fputc('\n', d->record);
+    fflush(d->record);
+    funlockfile(d->record);
+  }
+
+  // Debug information
+  DEBUG("----------------------------------------");
+  if (!strcmp(app, "generic")) DEBUG("Unable to get the active window's app name. Defaulting to generic...");
+  string debug_msg = {0};
+  str_append(&debug_msg, "The window focused has changed");
+  if (s->display) {
+    str_append(&debug_msg, " in ");
+    str_append(&debug_msg, s->display);
+  }
+  str_append(&debug_msg, ": ");
+  if (decision.previous_app.str) str_append(&debug_msg, decision.previous_app.str);
+  else str_append(&debug_msg, "[empty]");
+  str_append(&debug_msg, " --> ");
+  str_append(&debug_msg, app);
+  DEBUG(debug_msg.str);
+  cmd_node *aux = decision.available_profiles;
+  if (aux && aux->info.default_for_app) { // Found a default profile
+    str_replace(&debug_msg, "Found a default profile: ");
+    str_append(&debug_msg, aux->info.name.str);
+  } else {
+    str_replace(&debug_msg, "Available profiles for the app: ");
+    while (aux) {
+      str_append(&debug_msg, aux->info.name.str);
+      if (aux->next) str_append(&debug_msg, ", ");
+      aux = aux->next;
+    }
+  }
+  DEBUG(debug_msg.str);
+  str_replace(&debug_msg, "Profile selected: ");
+  if (profile) str_append(&debug_msg, profile->info.name.str);
+  else str_append(&debug_msg, "No profile was found");
+  DEBUG(debug_msg.str);
+
+  // Update running file and the subscribers
+  daemon_message *status = new_message(StatusMessage, app, NULL);
+  if (status && profile) str_append(&status->profile_name, profile->info.name.str);
+  send_message(&s->to_watcher, status);
+
+  // Apply profile
+  if (profile) {
+    send_message(&s->to_executor, new_message(ApplyMessage, NULL, &profile->info));
+    record_command_use(profile->info.name.str);
+  }
+
+  str_free(&debug_msg);
+  free_decision(&decision);
+  s->engine.list = NULL;
+  release_list(d, list);
+  trace_end(&span);
+}
+
+static void *resolver_stage(void *data) {
+  daemon_seat *s = data;
+  trace_thread_name("resolver");
+
+  bool running = true;
+  while (running) {
+    queue_wait(&s->to_resolver);
+
+    // Only the last focus is resolved (the previous ones were superseded)
+    daemon_message *m, *focus = NULL;
+    while ((m = queue_pop(&s->to_resolver))) {
+      switch (m->type) {
+        case FocusMessage:
+          free_message(focus);
+          focus = m;
+          continue;
+
+        case ForgetMessage:
+          engine_forget_window(&s->engine, m->window);
+          break;
+
+        case ReapplyMessage:
+          send_message(&s->to_executor, new_message(ReapplyMessage, NULL, NULL));
+          break;
+
+        case StopMessage:
+          running = false;
+          break;
+
+        default:
+          break;
+      }
+      free_message(m);
+    }
+
+    if (focus && running) resolve_focus(s, focus->app.str, focus->window, focus->output.str);
+    free_message(focus);
+  }
+
+  send_message(&s->to_executor, new_message(StopMessage, NULL, NULL));
+  return NULL;
+}
+
+// Reloads the list of commands after it was saved (by another wakit). It
+// isn't parsed again if it's the same generation that was loaded. It's
+// reloaded by the watcher, as the resolvers of every display share it
+static void reload_config(daemon_state *d) {
+  uint64_t generation;
+  if (read_config_generation(&generation) && generation && generation == loaded_config_generation()) {
+    DEBUG("The list of commands didn't change");
+    return;
+  }
+
+  cmd_node *list = NULL;
+  if (load_cmd_list(&list) != 0 || !resolve_references(list)) {
+    ERROR("Unable to reload the list of commands. The previous one is kept");
+    free_cmd_list(&list);
+    return;
+  }
+
+  if (!replace_list(d, list)) {
+    ERROR("Unable to reload the list of commands. The previous one is kept");
+    free_cmd_list(&list);
+    return;
+  }
+  DEBUG("The list of commands was reloaded");
+}
+
+/// Executor ///
+
+static bool applying_profiles(daemon_state *d) {
+  for (int i=0; i<d->seats_len; i++) {
+    if (d->seats[i].application.running) return true;
+  }
+  return false;
+}
+
+// The next timeout of the commands being run or retry of a profile (0 if
+// there isn't one)
+static long next_deadline(daemon_state *d) {
+  long next = supervisor_next_deadline();
+  for (int i=0; i<d->seats_len; i++) {
+    const long retry = d->seats[i].application.retry_at_ms;
+    if (retry && (!next || retry < next)) next = retry;
+  }
+  return next;
+}
+
+static void *executor_stage(void *data) {
+  daemon_state *d = data;
+  trace_thread_name("executor");
+
+  const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  const int deadline_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epoll_fd == -1 || deadline_timer == -1) {
+    ERROR("Unable to create the event loop of the executor");
+    return NULL;
+  }
+  for (int i=0; i<d->seats_len; i++) watch_fd(epoll_fd, queue_fd(&d->seats[i].to_executor), ExecutorQueueSource, i);
+  watch_fd(epoll_fd, deadline_timer, DeadlineSource, 0);
+  watch_fd(epoll_fd, supervisor_fd(), SupervisorSource, 0);
+
+  // After the stop message of every seat, it waits for the profiles being
+  // applied
+  int running = d->seats_len;
+  while (running || applying_profiles(d)) {
+    struct epoll_event events[8];
+    const int len = epoll_wait(epoll_fd, events, 8, -1);
+
+    for (int i=0; i<len; i++) {
+      daemon_seat *s = &d->seats[EVENT_SEAT(events[i].data.u32)];
+      switch (EVENT_SOURCE(events[i].data.u32)) {
+        case ExecutorQueueSource: {
+          queue_clear_wakeup(&s->to_executor);
+
+          // A newer profile (or output) supersedes the ones queued before it
+          daemon_message *m, *apply = NULL, *output = NULL;
+          bool reapply = false;
+          while ((m = queue_pop(&s->to_executor))) {
+            if (m->type == ApplyMessage) {
+              free_message(apply);
+              apply = m;
+              continue;
+            }
+            if (m->type == OutputMessage) {
+              free_message(output);
+              output = m;
+              continue;
+            }
+            if (m->type == ReapplyMessage) reapply = true;
+            if (m->type == StopMessage) running--;
+            free_message(m);
+          }
+
+          // The new profile is applied in the new output (and from scratch,
+          // if a device was plugged)
+          if (output && apply) str_replace(&s->application.output, output->output.str);
+          else if (output) follow_output(&s->application, output->output.str);
+          if (reapply) {
+            s->application.retries = 0;
+            s->application.reset_devices = true;
+          }
+          if (apply) apply_profile(&s->application, apply->profile);
+          else if (reapply) reapply_profile(&s->application);
+          free_message(apply);
+          free_message(output);
+          break;
+        }
+
+        case DeadlineSource:
+          drain_fd(deadline_timer);
+          // fallthrough
+        case SupervisorSource:
+          supervisor_wait(0);
+          for (int j=0; j<d->seats_len; j++) update_application(&d->seats[j].application);
+
+          // The profiles that failed after a device was plugged
+          const long now = monotonic_ms();
+          for (int j=0; j<d->seats_len; j++) {
+            profile_application *a = &d->seats[j].application;
+            if (a->retry_at_ms && a->retry_at_ms <= now) reapply_profile(a);
+          }
+          break;
+
+        default:
+          break;
+      }
+    }
+
+    // The timeouts of the commands being run and the retries
+    arm_timer(deadline_timer, next_deadline(d), true);
+  }
+  for (int i=0; i<d->seats_len; i++) free_application(&d->seats[i].application);
+
+  close(deadline_timer);
+  close(epoll_fd);
+  return NULL;
+}
+
+/// Watcher ///
+
+// The name of the app of the window: the app of the first rule that matches
+// it or the process name
+static bool identify_app(daemon_seat *s, unsigned long window, unsigned long pid, string *app) {
+  daemon_state *d = s->d;
+  process_entry *process = pid_cache_get(&d->processes, pid, d->has_rules && (d->rules.fields & WINDOW_EXE));
+  if (!process) return false;
+
+  if (d->has_rules) {
+    window_properties props = {0};
+    focus_watch_properties(s->watcher, window, d->rules.fields, &props);
+    if (process->exe.str) str_append(&props.exe, process->exe.str);
+    const bool matched = matcher_match(&d->rules, &props, app);
+    free_window_properties(&props);
+    if (matched) return true;
+  }
+
+  return str_replace(app, process->name.str);
+}
+
+// Debounce: the profile is applied once the focus stays in the app for
+// settle_ms. If the focus moves before that, the pending app is replaced
+// (so the apps that were only crossed while switching are never applied)
+static void check_focus(daemon_seat *s) {
+  trace_span span = trace_begin("check_focus");
+  string app = {0}, output = {0};
+  unsigned long window = 0, pid = 0;
+  const bool found = (s->watcher)
+    ? focus_watch_window(s->watcher, &window, &pid) && identify_app(s, window, pid, &app)
+    : get_active_window(&app);
+
+  // If it's unable to get the active window's app name, default to generic...
+  if (!found) str_replace(&app, "generic");
+
+  // The monitor of the window (for the profiles that follow it)
+  if (s->watcher && window) focus_watch_output(s->watcher, window, &output);
+  const bool output_changed = output.str && (!s->pending_output.str || strcmp(output.str, s->pending_output.str));
+
+  if (!s->pending_app.str || strcmp(app.str, s->pending_app.str) || (s->d->per_window && window != s->pending_window) || output_changed) {
+    str_replace(&s->pending_app, app.str);
+    s->pending_window = window;
+    if (output.str) str_replace(&s->pending_output, output.str);
+    arm_timer(s->settle_timer, s->d->settle_ms, false);
+
+    // To forget its profile when it's destroyed
+    if (s->d->per_window && window) focus_watch_track(s->watcher, window);
+  }
+  str_free(&app);
+  str_free(&output);
+  trace_end(&span);
+}
+
+// While the screen is idle (see focus_watch_idle()), the focus isn't tracked,
+// so the flips between the locker and the apps don't apply profiles. When
+// it's back, the focus is checked once. Returns if it's suspended
+static bool update_suspension(daemon_seat *s) {
+  if (!s->watcher) return false;
+
+  const bool idle = focus_watch_idle(s->watcher);
+  if (idle && !s->suspended) {
+    DEBUG("The screen is idle. Suspending the daemon...");
+    arm_timer(s->settle_timer, 0, true); // The pending app isn't applied
+    const struct itimerspec interval = {
+      .it_interval = { .tv_sec = IDLE_RECHECK_MS / 1000, .tv_nsec = (IDLE_RECHECK_MS % 1000) * 1000000L },
+      .it_value = { .tv_sec = IDLE_RECHECK_MS / 1000, .tv_nsec = (IDLE_RECHECK_MS % 1000) * 1000000L }
+    };
+    timerfd_settime(s->idle_timer, 0, &interval, NULL);
+
+  } else if (!idle && s->suspended) {
+    DEBUG("The screen is back. Resuming the daemon...");
+    arm_timer(s->idle_timer, 0, true);
+    check_focus(s);
+  }
+
+  s->suspended = idle;
+  return idle;
+}
+
+static void window_destroyed(unsigned long window, void *data) {
+  daemon_seat *s = data;
+  daemon_message *m = new_message(ForgetMessage, NULL, NULL);
+  if (m) m->window = window;
+  send_message(&s->to_resolver, m);
+}
+
+static void publish_status(daemon_seat *s) {
+  queue_clear_wakeup(&s->to_watcher);
+
+  daemon_message *m;
+  while ((m = queue_pop(&s->to_watcher))) {
+    status_publish(&s->status, m->app.str, m->profile_name.str);
+    free_message(m);
+  }
+}
+
+// The rules are only used with the X connection (they need the properties of
+// the window)
+static void load_rules(daemon_state *d) {
+  bool watched = false;
+  for (int i=0; i<d->seats_len; i++) {
+    if (d->seats[i].watcher) watched = true;
+  }
+
+  if (d->has_rules) matcher_free(&d->rules);
+  d->has_rules = (watched && matcher_load(&d->rules));
+  if (d->has_rules) {
+    string debug_msg = {0};
+    str_append(&debug_msg, "Rules to identify the apps: ");
+    str_append_int(&debug_msg, d->rules.rules_len);
+    DEBUG(debug_msg.str);
+    str_free(&debug_msg);
+  }
+}
+
+#define CONFIG_CHANGED 1
+#define RULES_CHANGED  2
+
+// Returns the files that were written or replaced (CONFIG_CHANGED and
+// RULES_CHANGED)
+static int config_changed(int inotify_fd) {
+  int changed = 0;
+
+  char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+    for (char *ptr = buffer; ptr < buffer + len; ) {
+      const struct inotify_event *event = (const struct inotify_event *) ptr;
+      if (!event->len) {} // The directory
+      else if (!strcmp(event->name, CONFIG_FILE_NAME)) changed |= CONFIG_CHANGED;
+      else if (!strcmp(event->name, RULES_FILE_NAME)) changed |= RULES_CHANGED;
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  return changed;
+}
+
+static int watch_config() {
+  string path = {0};
+  if (!get_config_path(&path)) return -1;
+
+  // The directory is watched, so the file is found even if it's replaced
+  char *name = strrchr(path.str, '/');
+  *name = '\0';
+
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd != -1 && inotify_add_watch(fd, path.str, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) == -1) {
+    close(fd);
+    fd = -1;
+  }
+
+  str_free(&path);
+  return fd;
+}
+
+// The new input devices, so the profiles are applied again when a device is
+// plugged (the driver resets its parameters)
+static int watch_input_devices() {
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd != -1 && inotify_add_watch(fd, INPUT_DEVICES_DIR, IN_CREATE) == -1) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+// SIGINT and SIGTERM are received through a file descriptor, so the daemon
+// closes properly. SIGUSR1 writes the trace (see trace.h). They're blocked
+// before creating the other stages, so only the watcher receives them
+static int watch_signals() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &signals, NULL)) return -1;
+
+  return signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+static void free_queue(spsc_queue *q) {
+  daemon_message *m;
+  while ((m = queue_pop(q))) free_message(m);
+  queue_close(q);
+}
+
+// Connects to the display of the seat, or polls the focus if it's the one of
+// the environment and it can't connect. Returns false on error
+static bool open_seat(daemon_state *d, daemon_seat *s, int index, int epoll_fd) {
+  s->d = d;
+  s->poll_timer = -1;
+  s->settle_timer = -1;
+  s->idle_timer = -1;
+  s->application.display = s->display;
+  s->to_resolver.event_fd = s->to_executor.event_fd = s->to_watcher.event_fd = -1;
+
+  engine_init(&s->engine, NULL, ask_with_rofi, s);
+  engine_share_choices(&s->engine, &d->choices, &d->choices_lock);
+  if (d->per_window && !engine_track_windows(&s->engine, WINDOW_LRU_CAPACITY)) {
+    ERROR("Unable to remember the profiles of the windows. Continuing by app...");
+    d->per_window = false;
+  }
+
+  if (!queue_init(&s->to_resolver) || !queue_init(&s->to_executor) || !queue_init(&s->to_watcher)) {
+    ERROR("Unable to create the queues of the daemon");
+    return false;
+  }
+
+  if ( (s->watcher = focus_watch_open(s->display)) ) {
+    watch_fd(epoll_fd, focus_watch_fd(s->watcher), FocusSource, index);
+  } else if (s->display) {
+    string err = {0};
+    str_append(&err, "Unable to connect to the display ");
+    str_append(&err, s->display);
+    ERROR(err.str);
+    str_free(&err);
+    return false;
+  } else {
+    DEBUG("Unable to connect to the X server. The focused window will be polled...");
+    s->poll_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    const struct itimerspec interval = {
+      .it_interval = { .tv_sec = 0, .tv_nsec = DAEMON_POLL_MS * 1000000L },
+      .it_value = { .tv_sec = 0, .tv_nsec = DAEMON_POLL_MS * 1000000L }
+    };
+    timerfd_settime(s->poll_timer, 0, &interval, NULL);
+    watch_fd(epoll_fd, s->poll_timer, PollSource, index);
+  }
+
+  if (!status_init(&s->status, s->display)) DEBUG("Continuing without the status socket ('wakit --watch')...");
+  watch_fd(epoll_fd, s->status.events_fd, StatusSource, index);
+  watch_fd(epoll_fd, queue_fd(&s->to_watcher), StatusQueueSource, index);
+
+  s->settle_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  watch_fd(epoll_fd, s->settle_timer, SettleSource, index);
+
+  s->idle_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  watch_fd(epoll_fd, s->idle_timer, IdleSource, index);
+  return true;
+}
+
+static void close_seat(daemon_seat *s) {
+  status_close(&s->status);
+  focus_watch_close(s->watcher);
+  if (s->poll_timer != -1) close(s->poll_timer);
+  if (s->settle_timer != -1) close(s->settle_timer);
+  if (s->idle_timer != -1) close(s->idle_timer);
+  free_queue(&s->to_resolver);
+  free_queue(&s->to_executor);
+  free_queue(&s->to_watcher);
+  str_free(&s->pending_app);
+  str_free(&s->pending_output);
+  str_free(&s->last_output);
+  engine_free(&s->engine);
+}
+
+// Adds the display served (the repeated ones are ignored)
+static bool add_seat(daemon_state *d, const char *display) {
+  for (int i=0; i<d->seats_len; i++) {
+    if (d->seats[i].display && !strcmp(d->seats[i].display, display)) return true;
+  }
+
+  if (d->seats_len == DAEMON_MAX_DISPLAYS) {
+    ERROR("Too many displays for the daemon");
+    return false;
+  }
+  d->seats[d->seats_len++].display = display;
+  return true;
+}
+
+// Stops the daemons of the displays given with '--display' (or the one of
+// $DISPLAY). Returns false if none of them was running
+bool stop_daemon(int argc, char *argv[]) {
+  bool stopped = false, given = false;
+  for (int i=0; i+1<argc; i++) {
+    if (strcmp(argv[i], "--display")) continue;
+
+    given = true;
+    if (request_daemon_stop(argv[++i])) stopped = true;
+  }
+
+  if (!given) stopped = request_daemon_stop(NULL);
+  return stopped;
+}
+
+int start_daemon(int argc, char *argv[]) {
+  daemon_state d = {0};
+  d.settle_ms = DEFAULT_SETTLE_MS;
+  long remember_hours = -1;
+
+  // Options
+  for (int i=0; i<argc; i++) {
+    if (!strcmp(argv[i], "--settle") && i+1 < argc) {
+      char *end = NULL;
+      d.settle_ms = strtol(argv[++i], &end, 10);
+      if (end == argv[i] || *end || d.settle_ms < 0) {
+        ERROR("The settle time should be a positive number of milliseconds");
+        if (d.record) fclose(d.record);
+        return 1;
+      }
+
+    } else if (!strcmp(argv[i], "--remember") && i+1 < argc) {
+      char *end = NULL;
+      remember_hours = strtol(argv[++i], &end, 10);
+      if (end == argv[i] || *end || remember_hours < 0) {
+        ERROR("The time to remember the choices should be a positive number of hours");
+        if (d.record) fclose(d.record);
+        return 1;
+      }
+
+    } else if (!strcmp(argv[i], "--per-window")) {
+      d.per_window = true;
+
+    } else if (!strcmp(argv[i], "--display") && i+1 < argc) {
+      if (!add_seat(&d, argv[++i])) {
+        if (d.record) fclose(d.record);
+        return 1;
+      }
+
+    } else if (!strcmp(argv[i], "--record") && i+1 < argc) {
+      if (d.record) fclose(d.record);
+      if ( !(d.record = fopen(argv[++i], "a")) ) {
+        ERROR("Unable to open the trace file to record");
+        return 1;
+      }
+
+    } else {
+      string err = {0};
+      str_append(&err, "Unrecognized option for 'daemon' mode: ");
+      str_append(&err, argv[i]);
+      ERROR(err.str);
+      str_free(&err);
+      if (d.record) fclose(d.record);
+      return 1;
+    }
+  }
+
+  // Without '--display', the display of the environment
+  if (!d.seats_len) d.seats_len = 1;
+
+  // The composed commands are flattened once, until the list is reloaded
+  cmd_node *list = NULL;
+  if (load_cmd_list(&list) != 0 || !resolve_references(list)) {
+    free_cmd_list(&list);
+    if (d.record) fclose(d.record);
+    return 1;
+  }
+
+  if (!list) {
+    DEBUG("Empty list.");
+    if (d.record) fclose(d.record);
+    return 0;
+  }
+
+  pthread_mutex_init(&d.list_lock, NULL);
+  pthread_mutex_init(&d.choices_lock, NULL);
+  choices_init(&d.choices, 0);
+
+  // The profiles chosen in the previous sessions (0 hours to never forget them)
+  if (remember_hours != -1) {
+    d.persist_choices = true;
+    d.choices.ttl_s = remember_hours * 3600;
+    choices_load(&d.choices);
+  }
+
+  const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  bool opened = (epoll_fd != -1 && replace_list(&d, list));
+  if (!opened) {
+    ERROR("Unable to create the event loop of the daemon");
+    if (!d.list) free_cmd_list(&list);
+  }
+  int seats_opened = 0;
+  while (opened && seats_opened < d.seats_len) {
+    opened = open_seat(&d, &d.seats[seats_opened], seats_opened, epoll_fd);
+    seats_opened++;
+  }
+
+  if (!opened) {
+    for (int i=0; i<seats_opened; i++) close_seat(&d.seats[i]);
+    if (d.list) release_list(&d, d.list);
+    if (epoll_fd != -1) close(epoll_fd);
+    choices_free(&d.choices);
+    pthread_mutex_destroy(&d.list_lock);
+    pthread_mutex_destroy(&d.choices_lock);
+    if (d.record) fclose(d.record);
+    return 1;
+  }
+
+  load_rules(&d);
+  pid_cache_init(&d.processes);
+
+  const int config_fd = watch_config();
+  if (!watch_fd(epoll_fd, config_fd, ConfigSource, 0)) DEBUG("Unable to watch the config file. It won't be reloaded when it changes");
+
+  const int input_fd = watch_input_devices();
+  const int hotplug_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (!watch_fd(epoll_fd, input_fd, InputSource, 0)) DEBUG("Unable to watch the input devices. The profiles won't be applied again when a device is plugged");
+  watch_fd(epoll_fd, hotplug_timer, HotplugSource, 0);
+
+  const int signal_fd = watch_signals();
+  watch_fd(epoll_fd, signal_fd, SignalSource, 0);
+
+  // If a thread can't start, the ones that did are stopped. The executor
+  // waits for the stop of every resolver, so it's only started with all of
+  // them
+  pthread_t executor;
+  int resolvers = 0;
+  while (resolvers < d.seats_len
+         && !pthread_create(&d.seats[resolvers].resolver, NULL, resolver_stage, &d.seats[resolvers]))
+    resolvers++;
+  const bool has_executor = (resolvers == d.seats_len) && !pthread_create(&executor, NULL, executor_stage, &d);
+
+  trace_thread_name("watcher");
+  if (has_executor) {
+    DEBUG("Daemon running...");
+    for (int i=0; i<d.seats_len; i++) {
+      if (!update_suspension(&d.seats[i])) check_focus(&d.seats[i]);
+    }
+  } else {
+    ERROR("Unable to start the threads of the daemon");
+  }
+
+  bool running = has_executor;
+  while (running) {
+    struct epoll_event events[16];
+    const int len = epoll_wait(epoll_fd, events, 16, -1);
+    if (len == -1 && errno != EINTR) {
+      ERROR("epoll_wait() failed in the daemon");
+      break;
+    }
+
+    for (int i=0; i<len; i++) {
+      daemon_seat *s = &d.seats[EVENT_SEAT(events[i].data.u32)];
+      switch (EVENT_SOURCE(events[i].data.u32)) {
+        case FocusSource:
+          if (focus_watch_changed(s->watcher, window_destroyed, s)) {
+            const bool was_suspended = s->suspended;
+            if (!update_suspension(s) && !was_suspended) check_focus(s);
+          }
+          break;
+
+        case IdleSource:
+          drain_fd(s->idle_timer);
+          update_suspension(s);
+          break;
+
+        case PollSource:
+          drain_fd(s->poll_timer);
+          check_focus(s);
+          break;
+
+        case StatusSource:
+          if (status_handle_events(&s->status) == StopRequest) running = false;
+          break;
+
+        case ConfigSource: {
+          const int changed = config_changed(config_fd);
+          if (changed & CONFIG_CHANGED) reload_config(&d);
+          if (changed & RULES_CHANGED) load_rules(&d);
+          break;
+        }
+
+        case SettleSource: {
+          drain_fd(s->settle_timer);
+          daemon_message *m = new_message(FocusMessage, s->pending_app.str, NULL);
+          if (m) m->window = s->pending_window;
+          if (m && s->pending_output.str) str_append(&m->output, s->pending_output.str);
+          send_message(&s->to_resolver, m);
+          break;
+        }
+
+        case StatusQueueSource:
+          publish_status(s);
+          break;
+
+        // Debounce (the device may create several nodes)
+        case InputSource:
+          drain_fd(input_fd);
+          arm_timer(hotplug_timer, HOTPLUG_SETTLE_MS, false);
+          break;
+
+        // Also in the seats that are suspended, as the screen doesn't matter
+        // to the devices
+        case HotplugSource:
+          drain_fd(hotplug_timer);
+          DEBUG("An input device was plugged. Applying the profiles again...");
+          for (int j=0; j<d.seats_len; j++) send_message(&d.seats[j].to_resolver, new_message(ReapplyMessage, NULL, NULL));
+          break;
+
+        case SignalSource: {
+          struct signalfd_siginfo info;
+          while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            if (info.ssi_signo != SIGUSR1) running = false;
+            else if (trace_write()) DEBUG("The trace was written");
+          }
+          break;
+        }
+
+        default:
+          break;
+      }
+    }
+  }
+
+  // The stop goes through the pipeline, so the profiles being applied finish
+  for (int i=0; i<resolvers; i++) send_message(&d.seats[i].to_resolver, new_message(StopMessage, NULL, NULL));
+  for (int i=0; i<resolvers; i++) pthread_join(d.seats[i].resolver, NULL);
+  if (has_executor) pthread_join(executor, NULL);
+  for (int i=0; i<d.seats_len; i++) publish_status(&d.seats[i]);
+  DEBUG("Daemon closed...");
+
+  for (int i=0; i<d.seats_len; i++) close_seat(&d.seats[i]);
+  if (d.has_rules) matcher_free(&d.rules);
+  pid_cache_free(&d.processes);
+  if (config_fd != -1) close(config_fd);
+  if (input_fd != -1) close(input_fd);
+  if (hotplug_timer != -1) close(hotplug_timer);
+  if (signal_fd != -1) close(signal_fd);
+  close(epoll_fd);
+  if (d.record) fclose(d.record);
+  release_list(&d, d.list);
+  choices_free(&d.choices);
+  pthread_mutex_destroy(&d.list_lock);
+  pthread_mutex_destroy(&d.choices_lock);
+  return (has_executor) ? 0 : 1;
+}
+
+/// Replay ///
+
+// Reads a whole line without the line break. Returns false on EOF
+static bool read_line(FILE *f, string *line) {
+  str_free(line);
+
+  char buffer[256];
+  while (fgets(buffer, sizeof(buffer), f)) {
+    str_append(line, buffer);
+    if (line->str[line->str_len-1] == '\n') {
+      line->str[--line->str_len] = '\0';
+      return true;
+    }
+  }
+
+  return (line->str != NULL);
+}
+
+// The profile chosen in the trace for the event (or NULL)
+static cmd_node *ask_from_trace(cmd_node *available_profiles, void *data) {
+  const char *choice = data;
+  cmd_node *selected = (choice) ? search_cmd(available_profiles, (char *) choice) : NULL;
+
+  // Without a (valid) choice, the first profile is selected
+  return (selected) ? selected : available_profiles;
+}
+
+static long elapsed_ns(struct timespec from, struct timespec to) {
+  return (to.tv_sec - from.tv_sec) * 1000000000L + (to.tv_nsec - from.tv_nsec);
+}
+
+// Feeds the engine with the focus events of a trace, without X and without
+// executing the profiles. Each line of the trace is an event:
+//   <app name>[\t<profile selected if the user is asked>]
+// Empty lines and lines starting with '#' are ignored. If the path is "-" the
+// trace is read from the standard input.
+//
+// One line is printed for each event (tab separated):
+//   <event number> <app> <decision> <profile> <time in ns>
+// Followed by the totals in a comment line
+int replay_trace(char *path) {
+  if (!path) return 1;
+
+  FILE *trace = (!strcmp(path, "-")) ? stdin : fopen(path, "r");
+  if (!trace) {
+    ERROR("Unable to open the trace file");
+    return 1;
+  }
+
+  cmd_node *list = NULL;
+  if (load_cmd_list(&list) != 0) {
+    if (trace != stdin) fclose(trace);
+    return 1;
+  }
+
+  daemon_engine engine;
+  engine_init(&engine, list, ask_from_trace, NULL);
+
+  long events = 0, changes = 0, total_ns = 0, max_ns = 0;
+  string line = {0};
+  while (read_line(trace, &line)) {
+    if (!line.str_len || line.str[0] == '#') continue;
+
+    // Split the app name and the choice
+    char *choice = strchr(line.str, '\t');
+    if (choice) *(choice++) = '\0';
+    engine.ask_data = choice;
+
+    struct timespec start, end;
+    daemon_decision decision;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const bool changed = engine_focus(&engine, line.str, 0, &decision);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    const long ns = elapsed_ns(start, end);
+    events++;
+    total_ns += ns;
+    if (ns > max_ns) max_ns = ns;
+
+    printf("%ld\t%s\t%s\t%s\t%ld\n",
+           events,
+           line.str,
+           (changed) ? decision_type_name(decision.type) : "unchanged",
+           (changed && decision.profile) ? decision.profile->info.name.str : "-",
+           ns);
+
+    if (changed) {
+      changes++;
+      free_decision(&decision);
+    }
+  }
+
+  printf("# events: %ld, changes: %ld, total: %ld ns, mean: %.1f ns/event, max: %ld ns\n",
+         events, changes, total_ns, (events) ? (double) total_ns / events : 0.0, max_ns);
+
+  if (trace != stdin) fclose(trace);
+  str_free(&line);
+  engine_free(&engine);
+  free_cmd_list(&list);
+  return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <pthread.h>
+
+#include "wakit.h"
+#include "dynamic_string.h"
+#include "choices.h"
+#include "window_lru.h"
+
+// Each display has its own running file (see display.h)
+#define RUNNING_DAEMON_PREFIX "/tmp/running"
+#define RUNNING_DAEMON_SUFFIX ".wakit"
+// Displays that a daemon can serve at the same time ('--display')
+#define DAEMON_MAX_DISPLAYS 8
+
+// Asks the user to select one of the available profiles
+typedef cmd_node *(*ask_profile_fn)(cmd_node *available_profiles, void *data);
+
+// Decision logic of the daemon. It receives the name of the focused app and
+// decides the profile to apply. It doesn't execute anything, so it can be
+// feeded without X (see replay_trace())
+typedef struct {
+  cmd_node *list;
+
+  // The profiles selected by the user, by app. They can be shared by the
+  // engines of several displays (see engine_share_choices())
+  choice_store *choices;
+  choice_store own_choices;
+  pthread_mutex_t *choices_lock; // NULL if they aren't shared
+
+  // The profile of each window (only if per_window)
+  bool per_window;
+  window_lru windows;
+  unsigned long last_window;
+
+  string last_app;
+
+  ask_profile_fn ask;
+  void *ask_data;
+} daemon_engine;
+
+typedef enum {
+  NoProfile,         // There aren't profiles for the app
+  DefaultProfile,    // Default profile of the app
+  SingleProfile,     // Only one profile is available
+  RememberedProfile, // Profile selected before for the app
+  WindowProfile,     // Profile applied before in the window
+  SelectedProfile    // The user was asked for the profile
+} decision_type;
+
+typedef struct {
+  decision_type type;
+  string previous_app;
+  cmd_node *available_profiles;
+  cmd_node *profile; // Node of available_profiles (or NULL)
+} daemon_decision;
+
+void engine_init(daemon_engine *engine, cmd_node *list, ask_profile_fn ask, void *ask_data);
+void engine_free(daemon_engine *engine);
+void engine_share_choices(daemon_engine *engine, choice_store *choices, pthread_mutex_t *lock);
+bool engine_track_windows(daemon_engine *engine, int capacity);
+void engine_forget_window(daemon_engine *engine, unsigned long window);
+bool engine_focus(daemon_engine *engine, const char *app, unsigned long window, daemon_decision *decision);
+void free_decision(daemon_decision *decision);
+const char *decision_type_name(decision_type type);
+
+int start_daemon(int argc, char *argv[]);
+bool stop_daemon(int argc, char *argv[]);
+int replay_trace(char *path);
+
+#endif // DAEMON_H
@@ -0,0 +1,93 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "display.h"
+#include "dynamic_string.h"
+
+// The display given or the one of the environment (NULL if there isn't one)
+const char *display_name(const char *display) {
+  if (display && *display) return display;
+
+  const char *env = getenv("DISPLAY");
+  return (env && *env) ? env : NULL;
+}
+
+// <prefix><display><suffix>. The characters of the display that shouldn't be
+// in a file name are replaced ('/' of the launchd displays, spaces...)
+void display_path(string *path, const char *prefix, const char *display, const char *suffix) {
+  str_replace(path, (char *) prefix);
+
+  const char *name = display_name(display);
+  for (; name && *name; name++) {
+    const bool allowed = isalnum((unsigned char) *name) || *name == ':' || *name == '.' || *name == '-';
+    str_append_char(path, (allowed) ? *name : '_');
+  }
+
+  str_append(path, suffix);
+}
+
+static bool make_dir(const char *path) {
+  return !mkdir(path, 0700) || errno == EEXIST;
+}
+
+// The directory of the private files (see display.h). It's created only for
+// the user, and it isn't used if it's a link, it's of someone else or others
+// can get in
+static bool private_dir(string *dir) {
+  str_free(dir);
+
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  const char *home = getenv("HOME");
+  if (runtime && *runtime == '/') {
+    str_append(dir, runtime);
+  } else if (home && *home) {
+    str_append(dir, home);
+    str_append(dir, "/.cache");
+    if (!make_dir(dir->str)) return false;
+  } else {
+    return false;
+  }
+
+  str_append(dir, "/" PRIVATE_DIR_NAME);
+  if (!make_dir(dir->str)) return false;
+
+  struct stat st;
+  return !lstat(dir->str, &st) && S_ISDIR(st.st_mode)
+         && st.st_uid == getuid() && !(st.st_mode & 077);
+}
+
+// <private dir>/<name><display><suffix>. Returns false if there isn't a
+// private directory
+bool private_display_path(string *path, const char *name, const char *display, const char *suffix) {
+  string prefix = {0};
+  if (!private_dir(&prefix)) {
+    str_free(&prefix);
+    return false;
+  }
+
+  str_append_char(&prefix, '/');
+  str_append(&prefix, name);
+  display_path(path, prefix.str, display, suffix);
+  str_free(&prefix);
+  return true;
+}
+
+// The body is run by the shell in the display. With a NULL display, it's run
+// in the display of the environment
+void display_command(string *command, const char *display, const char *body) {
+  str_free(command);
+
+  if (display && *display) {
+    str_append(command, "export DISPLAY='");
+    for (; *display; display++) {
+      if (*display == '\'') str_append(command, "'\\''");
+      else str_append_char(command, *display);
+    }
+    str_append(command, "'; ");
+  }
+
+  str_append(command, body);
+}
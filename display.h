@@ -0,0 +1,22 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include <stdbool.h>
+
+#include "dynamic_string.h"
+
+// A daemon can serve several X displays (see start_daemon()), so the files in
+// /tmp of each display are kept apart: the display is added to their name
+// (/tmp/running.wakit --> /tmp/running:0.wakit). A display of NULL is the one
+// of the environment ($DISPLAY), and without one the names don't change.
+//
+// The files that are trusted when they're read go in a directory of the user
+// instead ($XDG_RUNTIME_DIR/wakit, or ~/.cache/wakit without it)
+#define PRIVATE_DIR_NAME "wakit"
+
+const char *display_name(const char *display);
+void display_path(string *path, const char *prefix, const char *display, const char *suffix);
+bool private_display_path(string *path, const char *name, const char *display, const char *suffix);
+void display_command(string *command, const char *display, const char *body);
+
+#endif // DISPLAY_H
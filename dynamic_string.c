@@ -218,3 +218,12 @@ bool str_read_from_bfile(string *s, FILE *f) {
   s->str_len = str_len;
   return true;
 }
+
+// Moves past a string written by str_write_to_file() without reading it
+bool str_skip_in_bfile(FILE *f) {
+  if (!f) return false;
+
+  size_t str_len;
+  if (!fread(&str_len, sizeof(size_t), 1, f)) return false;
+  return str_len == 0 || !fseek(f, str_len+1, SEEK_CUR);
+}
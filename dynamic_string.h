@@ -22,6 +22,7 @@ bool str_search_and_replace(string *s, const char *search, const char *replace);
 
 bool str_write_to_file(string s, FILE *f );
 bool str_read_from_bfile(string *s, FILE *f);
+bool str_skip_in_bfile(FILE *f);
 
 // DEBUG
 void str_inspect(string s);
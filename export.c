@@ -0,0 +1,643 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "export.h"
+#include "wakit.h"
+#include "cli_io.h"
+#include "dynamic_string.h"
+#include "macro.h"
+
+// '--format=<jsonl|tsv>'
+bool parse_export_format(const char *option, export_format *format) {
+  if (strncmp(option, "--format=", 9)) return false;
+
+  option += 9;
+  if (!strcmp(option, "jsonl")) *format = JsonlFormat;
+  else if (!strcmp(option, "tsv")) *format = TsvFormat;
+  else return false;
+  return true;
+}
+
+/// Writer ///
+
+// The records are escaped directly into the buffer, which is written when
+// it's full
+typedef struct {
+  int fd;
+  char buffer[EXPORT_BUFFER_SIZE];
+  size_t len;
+  bool failed;
+} record_writer;
+
+static void writer_flush(record_writer *w) {
+  size_t written = 0;
+  while (!w->failed && written < w->len) {
+    const ssize_t n = write(w->fd, w->buffer + written, w->len - written);
+    if (n <= 0) w->failed = true;
+    else written += n;
+  }
+  w->len = 0;
+}
+
+static void writer_put(record_writer *w, const char *s, size_t len) {
+  while (len) {
+    if (w->len == EXPORT_BUFFER_SIZE) writer_flush(w);
+
+    size_t n = EXPORT_BUFFER_SIZE - w->len;
+    if (n > len) n = len;
+    memcpy(w->buffer + w->len, s, n);
+    w->len += n;
+    s += n;
+    len -= n;
+  }
+}
+
+static void writer_char(record_writer *w, char c) {
+  if (w->len == EXPORT_BUFFER_SIZE) writer_flush(w);
+  w->buffer[w->len++] = c;
+}
+
+#define WRITER_LITERAL(w, s) writer_put(w, s, sizeof(s) - 1)
+
+static void write_json_string(record_writer *w, const char *s) {
+  if (!s) {
+    WRITER_LITERAL(w, "null");
+    return;
+  }
+
+  writer_char(w, '"');
+  for (; *s; s++) {
+    switch (*s) {
+      case '"':  WRITER_LITERAL(w, "\\\""); break;
+      case '\\': WRITER_LITERAL(w, "\\\\"); break;
+      case '\n': WRITER_LITERAL(w, "\\n");  break;
+      case '\t': WRITER_LITERAL(w, "\\t");  break;
+      case '\r': WRITER_LITERAL(w, "\\r");  break;
+      default:
+        if ((unsigned char) *s < 0x20) {
+          char code[8];
+          snprintf(code, sizeof(code), "\\u%04x", *s);
+          writer_put(w, code, 6);
+        } else {
+          writer_char(w, *s);
+        }
+    }
+  }
+  writer_char(w, '"');
+}
+
+static void write_tsv_field(record_writer *w, const char *s) {
+  for (; s && *s; s++) {
+    switch (*s) {
+      case '\\': WRITER_LITERAL(w, "\\\\"); break;
+      case '\t': WRITER_LITERAL(w, "\\t");  break;
+      case '\n': WRITER_LITERAL(w, "\\n");  break;
+      default:   writer_char(w, *s);
+    }
+  }
+}
+
+// The flattened form is only written for composed commands (see macro.h)
+static void write_record(record_writer *w, export_format format, cmd *c, const char *flattened) {
+  if (format == JsonlFormat) {
+    WRITER_LITERAL(w, "{\"name\":");
+    write_json_string(w, c->name.str);
+    WRITER_LITERAL(w, ",\"command\":");
+    write_json_string(w, (c->cmd.str) ? c->cmd.str : "");
+    WRITER_LITERAL(w, ",\"type\":");
+    write_json_string(w, (c->type == Profile) ? "profile" : "action");
+    WRITER_LITERAL(w, ",\"app\":");
+    write_json_string(w, (c->type == Profile) ? c->app.str : NULL);
+    if (flattened) {
+      WRITER_LITERAL(w, ",\"flattened\":");
+      write_json_string(w, flattened);
+    }
+    if (c->default_for_app) WRITER_LITERAL(w, ",\"default\":true}\n");
+    else WRITER_LITERAL(w, ",\"default\":false}\n");
+    return;
+  }
+
+  write_tsv_field(w, c->name.str);
+  writer_char(w, '\t');
+  write_tsv_field(w, c->cmd.str);
+  if (c->type == Profile) WRITER_LITERAL(w, "\tprofile\t");
+  else WRITER_LITERAL(w, "\taction\t");
+  if (c->type == Profile) write_tsv_field(w, c->app.str);
+  if (c->default_for_app) WRITER_LITERAL(w, "\tyes");
+  else WRITER_LITERAL(w, "\tno");
+  if (flattened) {
+    writer_char(w, '\t');
+    write_tsv_field(w, flattened);
+  }
+  writer_char(w, '\n');
+}
+
+static void free_cmd_strings(cmd *c) {
+  str_free(&c->name);
+  str_free(&c->cmd);
+  str_free(&c->app);
+}
+
+static FILE *open_config(const char *mode) {
+  string path = {0};
+  if (!get_config_path(&path)) {
+    ERROR("Get yourself a home");
+    return NULL;
+  }
+
+  // The file opened is a snapshot (saves replace it), so it's only locked
+  // while opening it
+  if (!lock_config(false)) {
+    str_free(&path);
+    return NULL;
+  }
+  FILE *f = fopen(path.str, mode);
+  unlock_config();
+  str_free(&path);
+  return f;
+}
+
+// Prints the list to stdout
+int export_list(export_format format) {
+  FILE *f = open_config("rb");
+  if (!f) return 0; // Nothing saved yet
+
+  static record_writer w;
+  w.fd = STDOUT_FILENO;
+  w.len = 0;
+  w.failed = false;
+
+  // Without them, the commands are exported as they are
+  flattened_set flattened;
+  if (!cached_flattened(&flattened)) free_flattened(&flattened);
+
+  cmd c;
+  INIT_CMD(c);
+  uint64_t generation;
+  int ret = (read_config_header(f, &generation)) ? 0 : -1;
+  while (ret == 0 && (ret = read_cmd_from_file(f, &c)) == 0) {
+    write_record(&w, format, &c, search_flattened(&flattened, c.name.str));
+    free_cmd_strings(&c);
+  }
+  free_cmd_strings(&c);
+  free_flattened(&flattened);
+  fclose(f);
+
+  writer_flush(&w);
+  if (w.failed) ERROR("Unable to write the export");
+  return (ret == 1 && !w.failed) ? 0 : 1;
+}
+
+/// Import ///
+
+// Set of hashes (of the names and of the apps with a default profile). Only
+// the hash is kept, so a hit is confirmed by searching the file
+typedef struct {
+  uint64_t *slots; // 0 is a free slot
+  size_t capacity;
+  size_t len;
+} hash_set;
+
+static uint64_t hash_string(const char *s) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *s; s++) {
+    hash ^= (unsigned char) *s;
+    hash *= 1099511628211ULL;
+  }
+  return (hash) ? hash : 1;
+}
+
+static bool set_contains(hash_set *set, uint64_t hash) {
+  if (!set->capacity) return false;
+
+  for (size_t i = hash & (set->capacity - 1); set->slots[i]; i = (i + 1) & (set->capacity - 1)) {
+    if (set->slots[i] == hash) return true;
+  }
+  return false;
+}
+
+static bool set_add(hash_set *set, uint64_t hash) {
+  if ((set->len + 1) * 2 > set->capacity) {
+    hash_set bigger = { .capacity = (set->capacity) ? set->capacity * 2 : 1024 };
+    if ( !(bigger.slots = calloc(bigger.capacity, sizeof(uint64_t))) ) return false;
+    for (size_t i=0; i<set->capacity; i++) {
+      if (set->slots[i]) set_add(&bigger, set->slots[i]);
+    }
+    free(set->slots);
+    *set = bigger;
+  }
+
+  size_t i = hash & (set->capacity - 1);
+  while (set->slots[i] && set->slots[i] != hash) i = (i + 1) & (set->capacity - 1);
+  if (!set->slots[i]) set->len++;
+  set->slots[i] = hash;
+  return true;
+}
+
+typedef struct {
+  FILE *out;
+  string tmp_path;
+  hash_set names;
+  hash_set defaults;
+  bool references; // An imported record uses other commands
+} import_state;
+
+// Searches the records written until now (only when the hash matched)
+static bool written_before(import_state *s, cmd *c, bool by_default_app) {
+  fflush(s->out);
+  FILE *f = fopen(s->tmp_path.str, "rb");
+  if (!f) return true; // Can't confirm it
+
+  uint64_t generation;
+  bool found = !read_config_header(f, &generation);
+  cmd aux;
+  INIT_CMD(aux);
+  while (!found && read_cmd_from_file(f, &aux) == 0) {
+    found = (by_default_app)
+      ? aux.default_for_app && !strcmp(aux.app.str, c->app.str)
+      : !strcmp(aux.name.str, c->name.str);
+    free_cmd_strings(&aux);
+  }
+  free_cmd_strings(&aux);
+  fclose(f);
+  return found;
+}
+
+static bool import_error(long line, const char *msg) {
+  string err = {0};
+  if (line) {
+    str_append(&err, "Line ");
+    str_append_int(&err, line);
+    str_append(&err, " of the import: ");
+  }
+  str_append(&err, msg);
+  ERROR(err.str);
+  str_free(&err);
+  return false;
+}
+
+// Writes the record if its name is unique (and it's the only default profile
+// of its app)
+static bool import_record(import_state *s, cmd *c, long line) {
+  const uint64_t name_hash = hash_string(c->name.str);
+  if (set_contains(&s->names, name_hash) && written_before(s, c, false))
+    return import_error(line, "the command name is already registered");
+
+  const uint64_t app_hash = (c->default_for_app) ? hash_string(c->app.str) : 0;
+  if (c->default_for_app && set_contains(&s->defaults, app_hash) && written_before(s, c, true))
+    return import_error(line, "there's already a default profile for the app");
+
+  if (!set_add(&s->names, name_hash) || (c->default_for_app && !set_add(&s->defaults, app_hash)))
+    return import_error(line, "no free space");
+
+  return write_cmd_to_file(s->out, *c) || import_error(line, "unable to write the list");
+}
+
+// Unescapes the TSV field in place
+static void unescape_field(char *field) {
+  char *to = field;
+  for (char *from = field; *from; from++) {
+    if (*from == '\\' && from[1]) {
+      from++;
+      *to++ = (*from == 't') ? '\t' : (*from == 'n') ? '\n' : *from;
+    } else {
+      *to++ = *from;
+    }
+  }
+  *to = '\0';
+}
+
+// The sixth field (the flattened command) is optional and ignored
+static bool parse_tsv(char *line, cmd *c) {
+  char *fields[6];
+  int len = 0;
+  for (char *field = line; len < 6; len++) {
+    fields[len] = field;
+    char *tab = strchr(field, '\t');
+    if (!tab) {
+      len++;
+      break;
+    }
+    *tab = '\0';
+    field = tab + 1;
+  }
+  if (len != 5 && len != 6) return false;
+  for (int i=0; i<5; i++) unescape_field(fields[i]);
+
+  str_append(&c->name, fields[0]);
+  str_append(&c->cmd, fields[1]);
+  if (!strcmp(fields[2], "profile")) {
+    c->type = Profile;
+    str_append(&c->app, fields[3]);
+  } else if (!strcmp(fields[2], "action")) {
+    c->type = Action;
+  } else {
+    return false;
+  }
+
+  if (!strcmp(fields[4], "yes")) c->default_for_app = true;
+  else if (!strcmp(fields[4], "no")) c->default_for_app = false;
+  else return false;
+  return true;
+}
+
+static const char *skip_spaces(const char *s) {
+  while (*s == ' ' || *s == '\t' || *s == '\r') s++;
+  return s;
+}
+
+static void append_utf8(string *s, unsigned long code) {
+  if (code < 0x80) {
+    str_append_char(s, code);
+  } else if (code < 0x800) {
+    str_append_char(s, 0xC0 | (code >> 6));
+    str_append_char(s, 0x80 | (code & 0x3F));
+  } else if (code < 0x10000) {
+    str_append_char(s, 0xE0 | (code >> 12));
+    str_append_char(s, 0x80 | ((code >> 6) & 0x3F));
+    str_append_char(s, 0x80 | (code & 0x3F));
+  } else {
+    str_append_char(s, 0xF0 | (code >> 18));
+    str_append_char(s, 0x80 | ((code >> 12) & 0x3F));
+    str_append_char(s, 0x80 | ((code >> 6) & 0x3F));
+    str_append_char(s, 0x80 | (code & 0x3F));
+  }
+}
+
+static bool parse_hex4(const char *s, unsigned long *code) {
+  char hex[5] = {0};
+  for (int i=0; i<4; i++) {
+    if (!isxdigit((unsigned char) s[i])) return false;
+    hex[i] = s[i];
+  }
+  char *end = NULL;
+  *code = strtoul(hex, &end, 16);
+  return !*end;
+}
+
+// Parses a JSON string (s points to the opening quote). Returns the character
+// after it or NULL
+static const char *parse_json_string(const char *s, string *out) {
+  if (*s != '"') return NULL;
+
+  str_free(out);
+  str_append(out, ""); // Empty strings aren't NULL
+  for (s++; *s && *s != '"'; s++) {
+    if (*s != '\\') {
+      str_append_char(out, *s);
+      continue;
+    }
+
+    s++;
+    unsigned long code;
+    switch (*s) {
+      case '"': case '\\': case '/': str_append_char(out, *s); break;
+      case 'b': str_append_char(out, '\b'); break;
+      case 'f': str_append_char(out, '\f'); break;
+      case 'n': str_append_char(out, '\n'); break;
+      case 'r': str_append_char(out, '\r'); break;
+      case 't': str_append_char(out, '\t'); break;
+      case 'u':
+        // A NUL would cut the field short
+        if (!parse_hex4(s + 1, &code) || !code) return NULL;
+        s += 4;
+        // Surrogates are only valid in pairs (high, then low)
+        if (code >= 0xDC00 && code <= 0xDFFF) return NULL;
+        if (code >= 0xD800 && code <= 0xDBFF) {
+          unsigned long low;
+          if (s[1] != '\\' || s[2] != 'u' || !parse_hex4(s + 3, &low)
+              || low < 0xDC00 || low > 0xDFFF) return NULL;
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          s += 6;
+        }
+        append_utf8(out, code);
+        break;
+      default:
+        return NULL;
+    }
+  }
+
+  return (*s == '"') ? s + 1 : NULL;
+}
+
+static bool parse_jsonl(const char *line, cmd *c) {
+  const char *s = skip_spaces(line);
+  if (*s++ != '{') return false;
+
+  bool has_name = false, has_command = false, has_type = false;
+  string key = {0}, value = {0};
+  bool ok = true;
+  s = skip_spaces(s);
+  while (ok && *s != '}') {
+    if ( !(s = parse_json_string(s, &key)) ) break;
+    s = skip_spaces(s);
+    if (*s++ != ':') {
+      ok = false;
+      break;
+    }
+    s = skip_spaces(s);
+
+    // Value
+    bool is_null = false, boolean = false, is_bool = false;
+    if (*s == '"') {
+      if ( !(s = parse_json_string(s, &value)) ) break;
+    } else if (!strncmp(s, "null", 4)) {
+      is_null = true;
+      s += 4;
+    } else if (!strncmp(s, "true", 4)) {
+      is_bool = boolean = true;
+      s += 4;
+    } else if (!strncmp(s, "false", 5)) {
+      is_bool = true;
+      s += 5;
+    } else {
+      ok = false;
+      break;
+    }
+
+    if (!strcmp(key.str, "name") && !is_null && !is_bool) {
+      str_replace(&c->name, value.str);
+      has_name = true;
+    } else if (!strcmp(key.str, "command") && !is_null && !is_bool) {
+      str_replace(&c->cmd, value.str);
+      has_command = true;
+    } else if (!strcmp(key.str, "type") && !is_null && !is_bool) {
+      if (!strcmp(value.str, "profile")) c->type = Profile;
+      else if (!strcmp(value.str, "action")) c->type = Action;
+      else ok = false;
+      has_type = true;
+    } else if (!strcmp(key.str, "app") && !is_bool) {
+      if (is_null) str_free(&c->app);
+      else str_replace(&c->app, value.str);
+    } else if (!strcmp(key.str, "default") && is_bool) {
+      c->default_for_app = boolean;
+    } else if (!strcmp(key.str, "flattened") && !is_bool) {
+      // Derived from the command (see macro.h)
+    } else {
+      ok = false;
+    }
+
+    s = skip_spaces(s);
+    if (*s == ',') s = skip_spaces(s + 1);
+    else if (*s != '}') ok = false;
+  }
+
+  str_free(&key);
+  str_free(&value);
+  return ok && s && *s == '}' && *skip_spaces(s + 1) == '\0'
+         && has_name && has_command && has_type;
+}
+
+// The record should be a valid command
+static bool valid_record(cmd *c, long line) {
+  if (!c->name.str_len) return import_error(line, "the name can't be empty");
+  if (!valid_command(c->cmd.str)) return import_error(line, "invalid multi-step command");
+
+  if (c->type == Action) {
+    str_free(&c->app);
+    c->default_for_app = false;
+    return true;
+  }
+
+  if (!c->app.str_len) str_replace(&c->app, "generic");
+  if (c->default_for_app && !strcmp(c->app.str, "generic"))
+    return import_error(line, "generic profiles can't be default");
+  return true;
+}
+
+// The commands used by the imported records exist and they don't have
+// cycles. The new list is only loaded for this if a record uses other
+// commands
+static bool valid_imported_references(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return import_error(0, "unable to read the new list");
+
+  cmd_node *list = NULL, *tail = NULL;
+  cmd c;
+  INIT_CMD(c);
+  uint64_t generation;
+  int ret = (read_config_header(f, &generation)) ? 0 : -1;
+  while (ret == 0 && (ret = read_cmd_from_file(f, &c)) == 0) {
+    if (!add_command((tail) ? &tail->next : &list, c)) {
+      free_cmd_strings(&c);
+      ret = -1;
+    }
+    tail = (tail) ? tail->next : list;
+    INIT_CMD(c);
+  }
+  free_cmd_strings(&c);
+  fclose(f);
+
+  const bool ok = (ret == 1) && valid_list_references(list);
+  free_cmd_list(&list);
+  return ok || import_error(0, "the references to other commands can't be resolved");
+}
+
+// The input is copied to a temporary file if it isn't a regular file (stdin,
+// pipes), so the list isn't locked while the other end is still writing
+static FILE *spool_input(FILE *in) {
+  struct stat st;
+  if (fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode)) return in;
+
+  FILE *spool = tmpfile();
+  if (!spool) return NULL;
+  char buf[4096];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+    if (fwrite(buf, 1, len, spool) != len) break;
+  }
+  if (ferror(in) || ferror(spool) || fseek(spool, 0, SEEK_SET)) {
+    fclose(spool);
+    return NULL;
+  }
+  return spool;
+}
+
+// Appends the records of the file (or stdin if it's NULL or "-") to the list.
+// The list is written to a new file while the records are read and it
+// replaces the old one at the end, so nothing is changed if a record fails
+int import_list(export_format format, const char *path) {
+  if (format == ShellFormat) return import_error(0, "the format of the import should be jsonl or tsv");
+
+  FILE *opened = (!path || !strcmp(path, "-")) ? stdin : fopen(path, "r");
+  if (!opened) return import_error(0, "unable to open the file to import");
+  FILE *in = spool_input(opened);
+  if (in != opened && opened != stdin) fclose(opened);
+  if (!in) return import_error(0, "unable to read the file to import");
+
+  import_state s = {0};
+  string config_path = {0};
+  const bool locked = get_config_path(&config_path) && lock_config(true);
+  bool ok = locked;
+  FILE *current = (ok) ? fopen(config_path.str, "rb") : NULL;
+  uint64_t generation = 0;
+  if (current && !read_config_header(current, &generation)) ok = false;
+  if (ok) {
+    str_append(&s.tmp_path, config_path.str);
+    str_append(&s.tmp_path, ".tmp");
+    if ( !(s.out = fopen(s.tmp_path.str, "wb")) || !write_config_header(s.out, generation + 1) )
+      ok = import_error(0, "unable to write the list");
+  }
+
+  // The current list goes first
+  cmd c;
+  INIT_CMD(c);
+  if (ok && current) {
+    int ret = 0;
+    while (ok && (ret = read_cmd_from_file(current, &c)) == 0) {
+      ok = import_record(&s, &c, 0);
+      free_cmd_strings(&c);
+    }
+    if (ret == -1) ok = false;
+  }
+  if (current) fclose(current);
+
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  long line_number = 0, imported = 0;
+  while (ok && (len = getline(&line, &line_size, in)) != -1) {
+    line_number++;
+    if (len && line[len-1] == '\n') line[--len] = '\0';
+    if (!len) continue;
+
+    INIT_CMD(c);
+    c.type = Action;
+    c.default_for_app = false;
+    const bool parsed = (format == JsonlFormat) ? parse_jsonl(line, &c) : parse_tsv(line, &c);
+    if (!parsed) ok = import_error(line_number, "invalid record");
+    else ok = valid_record(&c, line_number) && import_record(&s, &c, line_number);
+    if (ok) imported++;
+    if (ok && has_references(c.cmd.str)) s.references = true;
+    free_cmd_strings(&c);
+  }
+  free(line);
+  if (in != stdin) fclose(in);
+
+  if (s.out && fclose(s.out)) ok = import_error(0, "unable to write the list");
+  if (ok && s.references) ok = valid_imported_references(s.tmp_path.str);
+  if (ok && rename(s.tmp_path.str, config_path.str)) ok = import_error(0, "unable to replace the list");
+
+  if (ok) {
+    string msg = {0};
+    str_append_int(&msg, imported);
+    str_append(&msg, " commands imported");
+    DEBUG(msg.str);
+    str_free(&msg);
+  } else {
+    if (s.tmp_path.str) remove(s.tmp_path.str);
+    ERROR("Nothing was changed");
+  }
+
+  if (locked) unlock_config();
+  free(s.names.slots);
+  free(s.defaults.slots);
+  str_free(&s.tmp_path);
+  str_free(&config_path);
+  return (ok) ? 0 : 1;
+}
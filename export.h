@@ -0,0 +1,30 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdbool.h>
+
+// Machine-readable formats of the list, one command per line:
+//   jsonl --> {"name":"...","command":"...","type":"profile","app":"generic","default":false}
+//             (the app is null for actions)
+//   tsv   --> <name>\t<command>\t<action|profile>\t<app>\t<yes|no>
+//             (backslashes, tabs and line breaks are escaped: \\, \t, \n)
+//
+// The composed commands (see macro.h) also have their flattened form: a
+// "flattened" key in jsonl and a sixth field in tsv. It's ignored when
+// importing them.
+//
+// The commands are streamed one by one from/to the save file, so the list is
+// never loaded whole
+#define EXPORT_BUFFER_SIZE (64 * 1024)
+
+typedef enum {
+  ShellFormat, // 'wakit -a' instructions (see print_instructions())
+  JsonlFormat,
+  TsvFormat
+} export_format;
+
+bool parse_export_format(const char *option, export_format *format);
+int export_list(export_format format);
+int import_list(export_format format, const char *path);
+
+#endif // EXPORT_H
@@ -3,6 +3,7 @@
 
 #include "wakit.h"
 
+bool ask_for_name(const char *input, const char *display, string *selected);
 cmd_node *ask_for_cmd(cmd_node *list);
 
 #endif // GUI_IO_H
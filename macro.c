@@ -0,0 +1,518 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "macro.h"
+#include "plan.h"
+#include "usage.h"
+#include "cli_io.h"
+
+static void macro_error(const char *msg, const char *detail) {
+  string err = {0};
+  str_append(&err, msg);
+  str_append(&err, detail);
+  ERROR(err.str);
+  str_free(&err);
+}
+
+static const char *skip_blanks(const char *s) {
+  while (*s == ' ' || *s == '\t') s++;
+  return s;
+}
+
+// If the command (or one of its steps) is a reference to another command
+bool has_references(const char *command) {
+  if (!command) return false;
+  if (*command == REFERENCE_PREFIX) return true;
+  if (!is_multi_step(command)) return false;
+
+  for (const char *line = strchr(command, '\n'); line; line = strchr(line, '\n')) {
+    line = skip_blanks(line + 1);
+    if (*line == '#') continue;
+
+    const size_t name_len = strcspn(line, ":\n");
+    if (line[name_len] == ':' && *skip_blanks(line + name_len + 1) == REFERENCE_PREFIX) return true;
+  }
+  return false;
+}
+
+/// Flattening ///
+
+// The commands whose references are being resolved (to find the cycles)
+typedef struct {
+  cmd_node *list;
+  const char *stack[MACRO_MAX_DEPTH];
+  int depth;
+} resolver;
+
+// A step of the flattened command
+typedef struct {
+  string name;
+  string after;       // Already named as in the flattened command
+  string outer_after; // Steps of the command being flattened (see expand_deps())
+  long timeout_ms;
+  string body;
+} flat_step;
+
+// A step of the command being flattened and the steps it became
+typedef struct {
+  string name;
+  string expansion; // Separated by commas
+} expanded_step;
+
+static bool flatten_body(resolver *r, const char *command, string *flattened);
+
+static bool resolve(resolver *r, const char *name, string *flattened) {
+  for (int i=0; i<r->depth; i++) {
+    if (!strcmp(r->stack[i], name)) {
+      macro_error("The references to other commands have a cycle, at: ", name);
+      return false;
+    }
+  }
+  if (r->depth == MACRO_MAX_DEPTH) {
+    macro_error("Too many nested references, at: ", name);
+    return false;
+  }
+
+  cmd_node *node = search_cmd(r->list, (char *) name);
+  if (!node) {
+    macro_error("Unknown command referenced: ", name);
+    return false;
+  }
+  if (!load_cmd_body(&node->info)) return false;
+
+  r->stack[r->depth++] = node->info.name.str;
+  const bool ok = flatten_body(r, node->info.cmd.str, flattened);
+  r->depth--;
+  return ok;
+}
+
+// The name of the referenced command (without the prefix and the blanks)
+static bool resolve_reference(resolver *r, const char *reference, string *flattened) {
+  string name = {0};
+  str_append(&name, skip_blanks(reference + 1));
+  while (name.str_len && strchr(" \t\n", name.str[name.str_len-1])) name.str[--name.str_len] = '\0';
+
+  const bool ok = name.str_len && resolve(r, name.str, flattened);
+  if (!name.str_len) macro_error("Missing the name of the command referenced: ", reference);
+  str_free(&name);
+  return ok;
+}
+
+static void append_name(string *names, const char *prefix, const char *name) {
+  if (names->str_len) str_append_char(names, ',');
+  if (prefix) {
+    str_append(names, prefix);
+    str_append_char(names, '/');
+  }
+  str_append(names, name);
+}
+
+// Each of the names of the dependencies, trimmed
+static void append_deps(string *names, const char *prefix, const char *deps) {
+  string copy = {0};
+  str_append(&copy, deps);
+  for (char *dep = strtok(copy.str, ","); dep; dep = strtok(NULL, ",")) {
+    dep = (char *) skip_blanks(dep);
+    char *end = dep + strlen(dep);
+    while (end > dep && (end[-1] == ' ' || end[-1] == '\t')) *(--end) = '\0';
+    append_name(names, prefix, dep);
+  }
+  str_free(&copy);
+}
+
+// The dependencies on the steps of the command being flattened become
+// dependencies on the steps they became (the unknown ones are kept, so
+// parse_plan() reports them)
+static void expand_deps(string *names, const char *deps, expanded_step *expanded, int expanded_len) {
+  string copy = {0};
+  str_append(&copy, deps);
+  for (char *dep = strtok(copy.str, ","); dep; dep = strtok(NULL, ",")) {
+    dep = (char *) skip_blanks(dep);
+    char *end = dep + strlen(dep);
+    while (end > dep && (end[-1] == ' ' || end[-1] == '\t')) *(--end) = '\0';
+
+    const char *expansion = dep;
+    for (int i=0; i<expanded_len; i++) {
+      if (!strcmp(expanded[i].name.str, dep)) expansion = expanded[i].expansion.str;
+    }
+    append_name(names, NULL, expansion);
+  }
+  str_free(&copy);
+}
+
+static flat_step *add_step(flat_step **steps, int *len) {
+  flat_step *new_steps = realloc(*steps, sizeof(flat_step) * (*len+1));
+  if (!new_steps) return NULL;
+  *steps = new_steps;
+  new_steps[*len] = (flat_step) {0};
+  return &new_steps[(*len)++];
+}
+
+// Adds the steps of the flattened command referenced by the step
+static bool add_referenced_steps(step_line *step, const char *referenced, flat_step **steps, int *len, string *expansion) {
+  if (!is_multi_step(referenced)) {
+    if (strchr(referenced, '\n')) {
+      macro_error("A command with several lines can't be a step: ", step->body);
+      return false;
+    }
+    flat_step *s = add_step(steps, len);
+    if (!s) return false;
+    str_append(&s->name, step->name);
+    if (step->after) str_append(&s->outer_after, step->after);
+    s->timeout_ms = step->timeout_ms;
+    str_append(&s->body, referenced);
+    append_name(expansion, NULL, step->name);
+    return true;
+  }
+
+  char *text = strdup(referenced + strlen(STEPS_HEADER));
+  if (!text) return false;
+
+  bool ok = true;
+  char *line = text;
+  while (ok && line) {
+    char *next = strchr(line, '\n');
+    if (next) *(next++) = '\0';
+
+    step_line sub;
+    const int kind = split_step_line(line, &sub);
+    line = next;
+    if (kind == 0) continue;
+    if (kind == -1 || !add_step(steps, len)) {
+      ok = false;
+      break;
+    }
+
+    flat_step *s = &(*steps)[*len-1];
+    append_name(&s->name, step->name, sub.name);
+    if (sub.after) append_deps(&s->after, step->name, sub.after);
+    else if (step->after) str_append(&s->outer_after, step->after);
+    s->timeout_ms = (sub.timeout_ms) ? sub.timeout_ms : step->timeout_ms;
+    str_append(&s->body, sub.body);
+    append_name(expansion, NULL, s->name.str);
+  }
+
+  free(text);
+  return ok;
+}
+
+static void write_steps(flat_step *steps, int len, expanded_step *expanded, int expanded_len, string *flattened) {
+  str_append(flattened, STEPS_HEADER);
+  string after = {0};
+  for (int i=0; i<len; i++) {
+    str_append_char(flattened, '\n');
+    str_append(flattened, steps[i].name.str);
+
+    str_replace(&after, (steps[i].after.str) ? steps[i].after.str : "");
+    if (steps[i].outer_after.str) expand_deps(&after, steps[i].outer_after.str, expanded, expanded_len);
+    if (after.str_len) {
+      str_append(flattened, " after ");
+      str_append(flattened, after.str);
+    }
+
+    if (steps[i].timeout_ms) {
+      str_append(flattened, " timeout ");
+      str_append_int(flattened, steps[i].timeout_ms);
+    }
+    str_append(flattened, ": ");
+    str_append(flattened, steps[i].body.str);
+  }
+  str_free(&after);
+}
+
+static bool flatten_steps(resolver *r, const char *command, string *flattened) {
+  char *text = strdup(command + strlen(STEPS_HEADER));
+  if (!text) return false;
+
+  flat_step *steps = NULL;
+  int len = 0;
+  expanded_step *expanded = NULL;
+  int expanded_len = 0;
+
+  bool ok = true;
+  char *line = text;
+  string referenced = {0};
+  while (ok && line) {
+    char *next = strchr(line, '\n');
+    if (next) *(next++) = '\0';
+
+    step_line step;
+    const int kind = split_step_line(line, &step);
+    line = next;
+    if (kind == 0) continue;
+
+    expanded_step *new_expanded = NULL;
+    if (kind == -1 || !(new_expanded = realloc(expanded, sizeof(expanded_step) * (expanded_len+1)))) {
+      ok = false;
+      break;
+    }
+    expanded = new_expanded;
+    expanded_step *e = &expanded[expanded_len++];
+    *e = (expanded_step) {0};
+    str_append(&e->name, step.name);
+
+    if (*step.body != REFERENCE_PREFIX) {
+      flat_step *s = add_step(&steps, &len);
+      if (!s) {
+        ok = false;
+        break;
+      }
+      str_append(&s->name, step.name);
+      if (step.after) str_append(&s->outer_after, step.after);
+      s->timeout_ms = step.timeout_ms;
+      str_append(&s->body, step.body);
+      str_append(&e->expansion, step.name);
+      continue;
+    }
+
+    str_free(&referenced);
+    ok = resolve_reference(r, step.body, &referenced)
+         && add_referenced_steps(&step, (referenced.str) ? referenced.str : "", &steps, &len, &e->expansion);
+  }
+
+  if (ok) write_steps(steps, len, expanded, expanded_len, flattened);
+
+  for (int i=0; i<len; i++) {
+    str_free(&steps[i].name);
+    str_free(&steps[i].after);
+    str_free(&steps[i].outer_after);
+    str_free(&steps[i].body);
+  }
+  for (int i=0; i<expanded_len; i++) {
+    str_free(&expanded[i].name);
+    str_free(&expanded[i].expansion);
+  }
+  free(steps);
+  free(expanded);
+  str_free(&referenced);
+  free(text);
+  return ok;
+}
+
+static bool flatten_body(resolver *r, const char *command, string *flattened) {
+  if (!command) command = "";
+  if (*command == REFERENCE_PREFIX) return resolve_reference(r, command, flattened);
+  if (is_multi_step(command)) return flatten_steps(r, command, flattened);
+
+  str_append(flattened, command);
+  return true;
+}
+
+// Resolves the references of the command (see the top of macro.h). The
+// referenced commands loaded without their bodies are read from the save file
+bool flatten_command(cmd_node *list, const char *name, string *flattened) {
+  resolver r = { .list = list, .depth = 0 };
+  return resolve(&r, name, flattened);
+}
+
+// The references of the command can be resolved: the commands exist and
+// they don't have cycles (the errors are reported)
+bool valid_references(cmd_node *list, const char *name) {
+  cmd_node *node = search_cmd(list, (char *) name);
+  if (!node || !has_references(node->info.cmd.str)) return true;
+
+  string flattened = {0};
+  const bool ok = flatten_command(list, name, &flattened);
+  str_free(&flattened);
+  return ok;
+}
+
+// Every command of the list can resolve its references (the errors are
+// reported). Checked before saving a list that lost or renamed commands
+bool valid_list_references(cmd_node *list) {
+  for (cmd_node *node = list; node; node = node->next) {
+    if (!load_cmd_body(&node->info) || !has_references(node->info.cmd.str)) continue;
+
+    if (!valid_references(list, node->info.name.str)) {
+      macro_error("Unable to resolve the references of the command: ", node->info.name.str);
+      return false;
+    }
+  }
+  return true;
+}
+
+// If the reference (from the prefix to the end of the line) is to the command
+static bool references_name(const char *reference, const char *name, size_t *len) {
+  const char *start = skip_blanks(reference + 1);
+  const char *end = start + strcspn(start, "\n");
+  *len = end - reference;
+  while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+  return (size_t) (end - start) == strlen(name) && !strncmp(start, name, end - start);
+}
+
+// The references to the command (the whole command or its steps) are
+// changed to its new name
+bool rename_references(cmd_node *list, const char *old_name, const char *new_name) {
+  string renamed = {0};
+  for (cmd_node *node = list; node; node = node->next) {
+    if (!load_cmd_body(&node->info)) return false;
+    const char *command = node->info.cmd.str;
+    if (!has_references(command)) continue;
+
+    size_t len;
+    str_free(&renamed);
+    if (*command == REFERENCE_PREFIX) {
+      if (!references_name(command, old_name, &len)) continue;
+      str_append_char(&renamed, REFERENCE_PREFIX);
+      str_append(&renamed, new_name);
+      str_append(&renamed, command + len);
+    } else {
+      // The body of the steps ('<step>: @<name>')
+      bool changed = false;
+      const char *line = command;
+      while (line) {
+        const char *next = strchr(line, '\n');
+        const char *body = skip_blanks(line);
+        const size_t name_len = strcspn(body, ":\n");
+        body = (*body != '#' && body[name_len] == ':') ? skip_blanks(body + name_len + 1) : NULL;
+
+        if (body && *body == REFERENCE_PREFIX && references_name(body, old_name, &len)) {
+          for (const char *c = line; c < body; c++) str_append_char(&renamed, *c);
+          str_append_char(&renamed, REFERENCE_PREFIX);
+          str_append(&renamed, new_name);
+          changed = true;
+          line = body + len;
+        }
+        for (const char *c = line; *c && (!next || c <= next); c++) str_append_char(&renamed, *c);
+        line = (next) ? next + 1 : NULL;
+      }
+      if (!changed) continue;
+    }
+
+    str_free(&node->info.cmd);
+    node->info.cmd = renamed;
+    renamed = (string) {0};
+  }
+
+  str_free(&renamed);
+  return true;
+}
+
+/// Sets ///
+
+void free_flattened(flattened_set *set) {
+  for (int i=0; i<set->len; i++) {
+    str_free(&set->names[i]);
+    str_free(&set->commands[i]);
+  }
+  free(set->names);
+  free(set->commands);
+  *set = (flattened_set) {0};
+}
+
+static bool add_flattened(flattened_set *set, string name, string command) {
+  string *names = realloc(set->names, sizeof(string) * (set->len+1));
+  if (names) set->names = names;
+  string *commands = realloc(set->commands, sizeof(string) * (set->len+1));
+  if (commands) set->commands = commands;
+  if (!names || !commands) return false;
+
+  set->names[set->len] = name;
+  set->commands[set->len] = command;
+  set->len++;
+  return true;
+}
+
+const char *search_flattened(flattened_set *set, const char *name) {
+  for (int i=0; i<set->len; i++) {
+    if (!strcmp(set->names[i].str, name)) return set->commands[i].str;
+  }
+  return NULL;
+}
+
+// Flattens the composed commands of the list. The ones that can't be
+// resolved are reported and left out
+bool flatten_list(cmd_node *list, flattened_set *set) {
+  *set = (flattened_set) {0};
+  for (cmd_node *node = list; node; node = node->next) {
+    if (!load_cmd_body(&node->info) || !has_references(node->info.cmd.str)) continue;
+
+    string name = {0}, flattened = {0};
+    str_append(&name, node->info.name.str);
+    if (!flatten_command(list, name.str, &flattened)) {
+      macro_error("Unable to resolve the references of the command: ", name.str);
+      str_free(&name);
+      continue;
+    }
+
+    if (!add_flattened(set, name, flattened)) {
+      str_free(&name);
+      str_free(&flattened);
+      free_flattened(set);
+      return false;
+    }
+  }
+  return true;
+}
+
+// The composed commands of the list are replaced by their flattened form
+// (for lists that are only run, like the one of the daemon)
+bool resolve_references(cmd_node *list) {
+  flattened_set set;
+  if (!flatten_list(list, &set)) return false;
+
+  for (int i=0; i<set.len; i++) {
+    cmd_node *node = search_cmd(list, set.names[i].str);
+    str_free(&node->info.cmd);
+    node->info.cmd = set.commands[i];
+    set.commands[i] = (string) {0};
+  }
+  free_flattened(&set);
+  return true;
+}
+
+// The flattened commands of the saved list. They're cached until the list
+// is saved again (by its generation). File format: the generation
+// (uint64_t), the number of commands (uint32_t) and the name and flattened
+// command of each one
+bool cached_flattened(flattened_set *set) {
+  *set = (flattened_set) {0};
+  string path = {0};
+  if (!get_share_path(&path, MACRO_CACHE_FILE_NAME)) return false;
+
+  uint64_t config_generation, cached_generation = 0;
+  uint32_t len = 0;
+  if (read_config_generation(&config_generation) && config_generation) {
+    FILE *f = fopen(path.str, "rb");
+    bool hit = f && fread(&cached_generation, sizeof(uint64_t), 1, f)
+               && fread(&len, sizeof(uint32_t), 1, f)
+               && cached_generation == config_generation;
+    for (uint32_t i=0; hit && i<len; i++) {
+      string name = {0}, command = {0};
+      hit = str_read_from_bfile(&name, f) && str_read_from_bfile(&command, f)
+            && name.str && add_flattened(set, name, command);
+      if (!hit) {
+        str_free(&name);
+        str_free(&command);
+      }
+    }
+    if (f) fclose(f);
+    if (hit) {
+      str_free(&path);
+      return true;
+    }
+    free_flattened(set);
+  }
+
+  // Built again
+  cmd_node *list = NULL;
+  bool ok = load_cmd_list(&list) == 0 && flatten_list(list, set);
+  config_generation = loaded_config_generation();
+  free_cmd_list(&list);
+
+  if (ok && config_generation) {
+    string tmp_path = {0};
+    FILE *f = open_temporary(path.str, &tmp_path);
+    len = set->len;
+    bool saved = f && fwrite(&config_generation, sizeof(uint64_t), 1, f)
+                 && fwrite(&len, sizeof(uint32_t), 1, f);
+    for (int i=0; saved && i<set->len; i++)
+      saved = str_write_to_file(set->names[i], f) && str_write_to_file(set->commands[i], f);
+    if (f && (fclose(f) || !saved || rename(tmp_path.str, path.str))) remove(tmp_path.str);
+    str_free(&tmp_path);
+  }
+
+  str_free(&path);
+  return ok;
+}
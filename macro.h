@@ -0,0 +1,44 @@
+#ifndef MACRO_H
+#define MACRO_H
+
+#include <stdbool.h>
+
+#include "wakit.h"
+#include "dynamic_string.h"
+
+// Composed commands. A command can be another command of the list
+// ('@<name>'), and a step of a multi-step command can run another command
+// ('<step>: @<name>', see plan.h). The references are resolved into one
+// multi-step command (the flattened one), so everything runs in one plan:
+//   - The steps of a referenced multi-step command are named
+//     '<step>/<its step>'. The ones without dependencies run after the
+//     dependencies of the step, and the steps that run after the step wait
+//     for all of them. Their timeout is the one of the step if they don't
+//     have one.
+//   - A referenced command that isn't multi-step is the command of the step.
+// References can be nested, but they can't have cycles.
+//
+// The flattened commands are cached in ~/.local/share (next to the list of
+// commands) until the list is saved again
+#define MACRO_CACHE_FILE_NAME "wakit_macros"
+#define MACRO_MAX_DEPTH 32
+
+typedef struct {
+  string *names;
+  string *commands; // Flattened
+  int len;
+} flattened_set;
+
+bool has_references(const char *command);
+bool flatten_command(cmd_node *list, const char *name, string *flattened);
+bool valid_references(cmd_node *list, const char *name);
+bool valid_list_references(cmd_node *list);
+bool rename_references(cmd_node *list, const char *old_name, const char *new_name);
+
+bool flatten_list(cmd_node *list, flattened_set *set);
+bool resolve_references(cmd_node *list);
+bool cached_flattened(flattened_set *set);
+const char *search_flattened(flattened_set *set, const char *name);
+void free_flattened(flattened_set *set);
+
+#endif // MACRO_H
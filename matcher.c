@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "matcher.h"
+#include "cli_io.h"
+
+#define SET_CHAR(set, c) ((set)[(unsigned char) (c) / 8] |= 1 << ((unsigned char) (c) % 8))
+#define HAS_CHAR(set, c) ((set)[(unsigned char) (c) / 8] & (1 << ((unsigned char) (c) % 8)))
+
+/// Compilation ///
+
+static bool add_position(field_dfa *d, glob_position p) {
+  glob_position *aux = realloc(d->positions, sizeof(glob_position) * (d->positions_len + 1));
+  if (!aux) return false;
+
+  d->positions = aux;
+  d->positions[d->positions_len++] = p;
+  return true;
+}
+
+// Parses '[...]' (the glob points to the '['). Returns the character after it
+// or NULL if it isn't closed
+static const char *parse_class(const char *glob, uint8_t *set) {
+  const char *c = glob + 1;
+  const bool negate = (*c == '!' || *c == '^');
+  if (negate) c++;
+
+  uint8_t chars[32] = {0};
+  bool first = true;
+  for (; *c && (first || *c != ']'); c++, first = false) {
+    if (c[1] == '-' && c[2] && c[2] != ']') {
+      for (int i = (unsigned char) c[0]; i <= (unsigned char) c[2]; i++) SET_CHAR(chars, i);
+      c += 2;
+    } else {
+      SET_CHAR(chars, *c);
+    }
+  }
+  if (*c != ']') return NULL;
+
+  for (int i=0; i<32; i++) set[i] = (negate) ? ~chars[i] : chars[i];
+  return c + 1;
+}
+
+static bool add_glob(field_dfa *d, const char *glob, int rule) {
+  int *starts = realloc(d->starts, sizeof(int) * (d->starts_len + 1));
+  if (!starts) return false;
+  d->starts = starts;
+  d->starts[d->starts_len++] = d->positions_len;
+
+  while (*glob) {
+    glob_position p = { .rule = rule };
+    if (*glob == '*') {
+      p.star = true;
+      glob++;
+    } else if (*glob == '?') {
+      memset(p.set, 0xff, sizeof(p.set));
+      glob++;
+    } else if (*glob == '[' && parse_class(glob, p.set)) {
+      glob = parse_class(glob, p.set);
+    } else {
+      if (*glob == '\\' && glob[1]) glob++;
+      SET_CHAR(p.set, *glob);
+      glob++;
+    }
+    if (!add_position(d, p)) return false;
+  }
+
+  return add_position(d, (glob_position) { .accepting = true, .rule = rule });
+}
+
+static void free_states(field_dfa *d) {
+  for (int i=0; i<d->states_len; i++) free(d->states[i].positions);
+  free(d->states);
+  free(d->table);
+  d->states = NULL;
+  d->table = NULL;
+  d->states_len = d->table_len = 0;
+  d->start = -1;
+}
+
+static void free_field(field_dfa *d) {
+  free_states(d);
+  free(d->positions);
+  free(d->starts);
+  free(d->marks);
+  free(d->set);
+  *d = (field_dfa) {0};
+  d->start = -1;
+}
+
+/// DFA ///
+
+static uint64_t hash_positions(int *positions, int len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i=0; i<len; i++) {
+    hash ^= (uint64_t) positions[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static int compare_int(const void *a, const void *b) {
+  return *(const int *) a - *(const int *) b;
+}
+
+// Adds the position and the ones that are reached without consuming a
+// character (after the stars)
+static void add_closure(field_dfa *d, int position, int *len) {
+  while (!d->marks[position]) {
+    d->marks[position] = true;
+    d->set[(*len)++] = position;
+    if (!d->positions[position].star) break;
+    position++;
+  }
+}
+
+// Returns the index of the state of the set (it's created if it doesn't
+// exist). The set is copied. Returns -1 if there isn't enough memory
+static int get_state(field_dfa *d, int *set, int len) {
+  qsort(set, len, sizeof(int), compare_int);
+  const uint64_t hash = hash_positions(set, len);
+
+  if (d->table_len) {
+    for (int i = hash % d->table_len; d->table[i] != -1; i = (i + 1) % d->table_len) {
+      dfa_state *s = &d->states[d->table[i]];
+      if (s->len == len && !memcmp(s->positions, set, sizeof(int) * len)) return d->table[i];
+    }
+  }
+
+  // The table is kept under half full
+  if ((d->states_len + 1) * 2 > d->table_len) {
+    const int table_len = (d->table_len) ? d->table_len * 2 : 64;
+    int *table = malloc(sizeof(int) * table_len);
+    if (!table) return -1;
+    for (int i=0; i<table_len; i++) table[i] = -1;
+
+    for (int s=0; s<d->states_len; s++) {
+      int i = hash_positions(d->states[s].positions, d->states[s].len) % table_len;
+      while (table[i] != -1) i = (i + 1) % table_len;
+      table[i] = s;
+    }
+    free(d->table);
+    d->table = table;
+    d->table_len = table_len;
+  }
+
+  dfa_state *states = realloc(d->states, sizeof(dfa_state) * (d->states_len + 1));
+  if (!states) return -1;
+  d->states = states;
+
+  dfa_state *s = &d->states[d->states_len];
+  s->positions = malloc(sizeof(int) * ((len) ? len : 1));
+  if (!s->positions) return -1;
+  memcpy(s->positions, set, sizeof(int) * len);
+  s->len = len;
+  s->accept = -1;
+  for (int i=0; i<len; i++) {
+    const glob_position *p = &d->positions[set[i]];
+    if (p->accepting && (s->accept == -1 || p->rule < s->accept)) s->accept = p->rule;
+  }
+  for (int i=0; i<256; i++) s->next[i] = -1;
+
+  int i = hash % d->table_len;
+  while (d->table[i] != -1) i = (i + 1) % d->table_len;
+  d->table[i] = d->states_len;
+  return d->states_len++;
+}
+
+static int start_state(field_dfa *d) {
+  int len = 0;
+  memset(d->marks, 0, sizeof(bool) * d->positions_len);
+  for (int i=0; i<d->starts_len; i++) add_closure(d, d->starts[i], &len);
+  return get_state(d, d->set, len);
+}
+
+// The state after the character (computed the first time)
+static int transition(field_dfa *d, int from, unsigned char c) {
+  if (d->states[from].next[c] != -1) return d->states[from].next[c];
+
+  int len = 0;
+  memset(d->marks, 0, sizeof(bool) * d->positions_len);
+  const dfa_state *s = &d->states[from];
+  for (int i=0; i<s->len; i++) {
+    const int position = s->positions[i];
+    const glob_position *p = &d->positions[position];
+    if (p->accepting) continue;
+
+    if (p->star) add_closure(d, position, &len);
+    else if (HAS_CHAR(p->set, c)) add_closure(d, position + 1, &len);
+  }
+
+  // Too many states: the DFA is built again from here
+  if (d->states_len == MATCHER_MAX_STATES) {
+    free_states(d);
+    return get_state(d, d->set, len);
+  }
+
+  const int to = get_state(d, d->set, len);
+  if (to != -1) d->states[from].next[c] = to;
+  return to;
+}
+
+// The first rule that matches the whole text (-1 if none). Once the states
+// are built, it's a lookup for each character, whatever the number of rules
+static int run_dfa(field_dfa *d, const char *text) {
+  if (!d->starts_len || !text) return -1;
+
+  if (!d->marks) {
+    d->marks = malloc(sizeof(bool) * d->positions_len);
+    d->set = malloc(sizeof(int) * d->positions_len);
+    if (!d->marks || !d->set) return -1;
+  }
+
+  if (d->start == -1) d->start = start_state(d);
+  int state = d->start;
+  for (; state != -1 && *text; text++) state = transition(d, state, *text);
+
+  return (state != -1) ? d->states[state].accept : -1;
+}
+
+/// Rules ///
+
+static bool get_rules_path(string *path) {
+  const char *home = getenv("HOME");
+  if (!home) return false;
+
+  str_append(path, home);
+  str_append(path, "/.local/share/" RULES_FILE_NAME);
+  return true;
+}
+
+static char *trim(char *s) {
+  while (*s == ' ' || *s == '\t') s++;
+  char *end = s + strlen(s);
+  while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r')) end--;
+  *end = '\0';
+  return s;
+}
+
+static bool parse_rule(rule_matcher *m, char *line) {
+  line = trim(line);
+  if (!*line || *line == '#') return true;
+
+  char *glob = line + strcspn(line, " \t");
+  if (*glob) *(glob++) = '\0';
+  glob = trim(glob);
+  char *app = strrchr(glob, ' ');
+  char *app_tab = strrchr(glob, '\t');
+  if (app_tab > app) app = app_tab;
+  if (!app) return false;
+  *(app++) = '\0';
+  glob = trim(glob);
+  if (!*glob || !*app) return false;
+
+  field_dfa *d = NULL;
+  int field = 0;
+  if (!strcmp(line, "class"))      { d = &m->class; field = WINDOW_CLASS; }
+  else if (!strcmp(line, "title")) { d = &m->title; field = WINDOW_TITLE; }
+  else if (!strcmp(line, "exe"))   { d = &m->exe;   field = WINDOW_EXE; }
+  else return false;
+
+  string *apps = realloc(m->apps, sizeof(string) * (m->rules_len + 1));
+  if (!apps) return false;
+  m->apps = apps;
+  m->apps[m->rules_len] = (string) {0};
+  str_append(&m->apps[m->rules_len], app);
+  if (!add_glob(d, glob, m->rules_len)) return false;
+
+  m->rules_len++;
+  m->fields |= field;
+  return true;
+}
+
+// Returns false if there aren't rules
+bool matcher_load(rule_matcher *m) {
+  *m = (rule_matcher) {0};
+  m->class.start = m->title.start = m->exe.start = -1;
+
+  string path = {0};
+  if (!get_rules_path(&path)) return false;
+  FILE *f = fopen(path.str, "r");
+  str_free(&path);
+  if (!f) return false;
+
+  char buffer[1024];
+  int line = 0;
+  while (fgets(buffer, sizeof(buffer), f)) {
+    line++;
+    if (!parse_rule(m, buffer)) {
+      string err = {0};
+      str_append(&err, "Invalid rule in line ");
+      str_append_int(&err, line);
+      str_append(&err, " of " RULES_FILE_NAME ". Ignoring it...");
+      ERROR(err.str);
+      str_free(&err);
+    }
+  }
+  fclose(f);
+
+  if (!m->rules_len) {
+    matcher_free(m);
+    return false;
+  }
+  return true;
+}
+
+void matcher_free(rule_matcher *m) {
+  free_field(&m->class);
+  free_field(&m->title);
+  free_field(&m->exe);
+  for (int i=0; i<m->rules_len; i++) str_free(&m->apps[i]);
+  free(m->apps);
+  *m = (rule_matcher) {0};
+  m->class.start = m->title.start = m->exe.start = -1;
+}
+
+static int first_rule(int a, int b) {
+  if (a == -1) return b;
+  if (b == -1) return a;
+  return (a < b) ? a : b;
+}
+
+// The app of the first rule that matches the window. Returns false if none
+// matches. Only the fields in m->fields need to be read
+bool matcher_match(rule_matcher *m, window_properties *props, string *app) {
+  int rule = -1;
+  rule = first_rule(rule, run_dfa(&m->class, props->instance.str));
+  rule = first_rule(rule, run_dfa(&m->class, props->class.str));
+  rule = first_rule(rule, run_dfa(&m->title, props->title.str));
+  rule = first_rule(rule, run_dfa(&m->exe, props->exe.str));
+  if (rule == -1) return false;
+
+  str_replace(app, m->apps[rule].str);
+  return true;
+}
@@ -0,0 +1,66 @@
+#ifndef MATCHER_H
+#define MATCHER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dynamic_string.h"
+#include "window_manager.h"
+
+// Saved in ~/.local/share (next to the list of commands). Each line is a rule
+// that gives the name of the app to the windows that match it:
+//   <class|title|exe> <glob> <app>
+// The glob is everything between the field and the last word, and it should
+// match the whole property ('*', '?' and '[...]' are supported). The rules
+// are checked in order. Empty lines and lines starting with '#' are ignored.
+//
+// Without a matching rule, the app is the process name ('comm')
+#define RULES_FILE_NAME "wakit_rules"
+// The DFA is built while matching. When it has too many states, it's rebuilt
+#define MATCHER_MAX_STATES 4096
+
+// A position inside the glob of a rule (the last one of each glob accepts)
+typedef struct {
+  bool star;
+  uint8_t set[32]; // Characters matched
+  bool accepting;
+  int rule;
+} glob_position;
+
+typedef struct {
+  int *positions; // Sorted
+  int len;
+  int accept;     // First rule accepted (-1 if none)
+  int next[256];  // -1 if it wasn't computed yet
+} dfa_state;
+
+// All the globs of a field, matched at once
+typedef struct {
+  glob_position *positions;
+  int positions_len;
+  int *starts; // First position of each glob
+  int starts_len;
+
+  dfa_state *states;
+  int states_len;
+  int start; // -1 if it wasn't built yet
+  int *table; // Hash table of the states (indexes, -1 if free)
+  int table_len;
+
+  // Used while building the states
+  bool *marks;
+  int *set;
+} field_dfa;
+
+typedef struct {
+  field_dfa class, title, exe;
+  string *apps; // App of each rule
+  int rules_len;
+  int fields; // Fields used by the rules (WINDOW_CLASS, ...)
+} rule_matcher;
+
+bool matcher_load(rule_matcher *m);
+void matcher_free(rule_matcher *m);
+bool matcher_match(rule_matcher *m, window_properties *props, string *app);
+
+#endif // MATCHER_H
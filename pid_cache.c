@@ -0,0 +1,135 @@
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "pid_cache.h"
+
+void pid_cache_init(pid_cache *c) {
+  memset(c, 0, sizeof(*c));
+}
+
+static void free_entry(process_entry *e) {
+  if (e->pidfd != -1) close(e->pidfd);
+  str_free(&e->name);
+  str_free(&e->exe);
+  memset(e, 0, sizeof(*e));
+  e->pidfd = -1;
+}
+
+void pid_cache_free(pid_cache *c) {
+  for (int i=0; i<c->len; i++) free_entry(&c->entries[i]);
+  c->len = 0;
+}
+
+// Start time of the process (0 if it doesn't exist)
+static unsigned long long read_start_time(unsigned long pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%lu/stat", pid);
+
+  FILE *f = fopen(path, "r");
+  if (!f) return 0;
+  char buffer[1024];
+  const size_t len = fread(buffer, 1, sizeof(buffer)-1, f);
+  fclose(f);
+  buffer[len] = '\0';
+
+  // The name can have spaces and parenthesis, so the fields are counted from
+  // the last ')'. The start time is the 20th field after it
+  char *field = strrchr(buffer, ')');
+  if (!field) return 0;
+  for (int i=0; i<20 && field; i++) field = strchr(field + 1, ' ');
+
+  return (field) ? strtoull(field + 1, NULL, 10) : 0;
+}
+
+// The process name ('comm'), the same that 'ps -o comm=' prints
+static bool read_name(unsigned long pid, string *name) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%lu/comm", pid);
+
+  FILE *f = fopen(path, "r");
+  if (!f) return false;
+
+  char buffer[64];
+  const bool ok = (fgets(buffer, sizeof(buffer), f) != NULL);
+  fclose(f);
+  if (!ok) return false;
+
+  buffer[strcspn(buffer, "\n")] = '\0';
+  str_replace(name, buffer);
+  return true;
+}
+
+static void read_exe(process_entry *e) {
+  char path[64], exe[4096];
+  snprintf(path, sizeof(path), "/proc/%lu/exe", e->pid);
+
+  const ssize_t len = readlink(path, exe, sizeof(exe)-1);
+  if (len > 0) {
+    exe[len] = '\0';
+    str_replace(&e->exe, exe);
+  }
+  e->has_exe = true;
+}
+
+static bool alive(process_entry *e) {
+  if (e->pidfd == -1) return read_start_time(e->pid) == e->start_time;
+
+  struct pollfd pfd = { .fd = e->pidfd, .events = POLLIN };
+  return poll(&pfd, 1, 0) == 0;
+}
+
+// The least recently used entry is replaced when it's full
+static process_entry *free_slot(pid_cache *c) {
+  if (c->len < PID_CACHE_CAPACITY) return &c->entries[c->len++];
+
+  process_entry *oldest = &c->entries[0];
+  for (int i=1; i<c->len; i++) {
+    if (c->entries[i].last_used < oldest->last_used) oldest = &c->entries[i];
+  }
+  free_entry(oldest);
+  return oldest;
+}
+
+static bool fill_entry(process_entry *e, unsigned long pid) {
+  e->pid = pid;
+  e->pidfd = syscall(SYS_pidfd_open, (pid_t) pid, 0); // (close-on-exec)
+
+  // The start time is read after opening the pidfd, so both refer to the same
+  // process
+  if ( !(e->start_time = read_start_time(pid)) ) return false;
+  return read_name(pid, &e->name);
+}
+
+// The process of the pid (NULL if it doesn't exist). It's only read from
+// procfs the first time the process is seen
+process_entry *pid_cache_get(pid_cache *c, unsigned long pid, bool need_exe) {
+  process_entry *e = NULL;
+  for (int i=0; i<c->len; i++) {
+    if (c->entries[i].pid == pid) {
+      e = &c->entries[i];
+      break;
+    }
+  }
+
+  // The process exited (the pid could have been reused)
+  if (e && !alive(e)) {
+    free_entry(e);
+  } else if (e) {
+    e->last_used = ++c->clock;
+    if (need_exe && !e->has_exe) read_exe(e);
+    return e;
+  }
+
+  if (!e) e = free_slot(c);
+  if (!fill_entry(e, pid)) {
+    free_entry(e);
+    return NULL;
+  }
+
+  e->last_used = ++c->clock;
+  if (need_exe) read_exe(e);
+  return e;
+}
@@ -0,0 +1,38 @@
+#ifndef PID_CACHE_H
+#define PID_CACHE_H
+
+#include <stdbool.h>
+
+#include "dynamic_string.h"
+
+#define PID_CACHE_CAPACITY 128
+
+// What is known of a process: its name ('comm') and the path of its
+// executable (read the first time it's needed)
+typedef struct {
+  unsigned long pid;
+  unsigned long long start_time; // Field 22 of /proc/<pid>/stat
+  int pidfd; // Readable once the process exits (-1 if it's not supported)
+
+  string name;
+  string exe;
+  bool has_exe;
+
+  unsigned long last_used;
+} process_entry;
+
+// Cache of the processes of the focused windows. The start time is part of
+// the key, so a pid that is reused isn't confused with the previous process.
+// While the process is alive, it's validated with its pidfd (without reading
+// procfs)
+typedef struct {
+  process_entry entries[PID_CACHE_CAPACITY];
+  int len;
+  unsigned long clock;
+} pid_cache;
+
+void pid_cache_init(pid_cache *c);
+void pid_cache_free(pid_cache *c);
+process_entry *pid_cache_get(pid_cache *c, unsigned long pid, bool need_exe);
+
+#endif // PID_CACHE_H
@@ -0,0 +1,1005 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "plan.h"
+#include "tablet.h"
+#include "process.h"
+#include "cli_io.h"
+#include "display.h"
+#include "dynamic_string.h"
+
+bool is_multi_step(const char *command) {
+  if (!command) return false;
+
+  const size_t header_len = strlen(STEPS_HEADER);
+  return !strncmp(command, STEPS_HEADER, header_len)
+         && (command[header_len] == '\n' || command[header_len] == '\0');
+}
+
+void free_plan(plan *p) {
+  for (int i=0; i<p->len; i++) {
+    str_free(&p->steps[i].name);
+    str_free(&p->steps[i].command);
+    str_free(&p->steps[i].param_key);
+    str_free(&p->steps[i].param_value);
+    free(p->steps[i].deps);
+  }
+  free(p->steps);
+  p->steps = NULL;
+  p->len = 0;
+}
+
+static char *trim(char *s) {
+  while (*s == ' ' || *s == '\t') s++;
+  char *end = s + strlen(s);
+  while (end > s && (end[-1] == ' ' || end[-1] == '\t')) *(--end) = '\0';
+  return s;
+}
+
+static int search_step(plan *p, const char *name) {
+  for (int i=0; i<p->len; i++) {
+    if (!strcmp(p->steps[i].name.str, name)) return i;
+  }
+  return -1;
+}
+
+static void plan_error(const char *msg, const char *detail) {
+  string err = {0};
+  str_append(&err, msg);
+  str_append(&err, detail);
+  ERROR(err.str);
+  str_free(&err);
+}
+
+// Depth first search. Returns true if there's a cycle reachable from the step
+static bool has_cycle(plan *p, int step, char *state /* 0: new, 1: visiting, 2: done */) {
+  if (state[step] == 1) return true;
+  if (state[step] == 2) return false;
+
+  state[step] = 1;
+  for (int i=0; i<p->steps[step].deps_len; i++) {
+    if (has_cycle(p, p->steps[step].deps[i], state)) return true;
+  }
+  state[step] = 2;
+  return false;
+}
+
+// Parameter steps: set[:<target>] <parameter> <value>
+// The command of the step is replaced by the xsetwacom command. Returns false
+// if it's not a parameter step
+static bool parse_param(plan_step *step) {
+  char *body = step->command.str;
+  if (!body || strncmp(body, "set", 3) || (body[3] != ' ' && body[3] != ':')) return false;
+
+  char *target = NULL, *aux = body + 3;
+  if (*aux == ':') {
+    target = ++aux;
+    while (*aux && *aux != ' ' && *aux != '\t') aux++;
+    if (aux == target) return false;
+  }
+  const int target_len = (target) ? aux - target : 0;
+
+  while (*aux == ' ' || *aux == '\t') aux++;
+  char *param = aux;
+  while (*aux && *aux != ' ' && *aux != '\t') aux++;
+  const int param_len = aux - param;
+  while (*aux == ' ' || *aux == '\t') aux++;
+  char *value = aux;
+  if (!param_len || !*value) return false;
+
+  for (int i=0; i<param_len; i++) str_append_char(&step->param_key, param[i]);
+  str_append(&step->param_value, value);
+
+  // Each button is a different parameter ('Button <number> <mapping>')
+  if (param_len == 6 && !strncasecmp(param, "Button", 6)) {
+    str_append_char(&step->param_key, ' ');
+    for (char *number = value; *number && *number != ' ' && *number != '\t'; number++)
+      str_append_char(&step->param_key, *number);
+  }
+
+  // The output is added to the command when the step runs
+  step->follows_window = (param_len == strlen(FOLLOW_PARAM) && !strncasecmp(param, FOLLOW_PARAM, param_len)
+                          && !strcasecmp(value, FOLLOW_VALUE));
+
+  string command = {0};
+  str_append(&command, "xsetwacom set " MODEL_PLACEHOLDER_PREFIX);
+  if (target) {
+    for (int i=0; i<target_len; i++) str_append_char(&command, target[i]);
+  } else {
+    str_append(&command, DEFAULT_TARGET);
+  }
+  str_append(&command, "% ");
+  for (int i=0; i<param_len; i++) str_append_char(&command, param[i]);
+  str_append_char(&command, ' ');
+  if (!step->follows_window) str_append(&command, value);
+
+  str_free(&step->command);
+  step->command = command;
+  return true;
+}
+
+// Splits a line of a multi-step command in place. Returns 1 for a step, 0
+// for the lines that are ignored (empty ones and comments) and -1 if it's
+// invalid (the error is reported)
+int split_step_line(char *line, step_line *step) {
+  *step = (step_line) {0};
+  char *content = trim(line);
+  if (*content == '\0' || *content == '#') return 0;
+
+  char *colon = strchr(content, ':');
+  if (!colon) {
+    plan_error("Invalid step (expected '<name>: <command>'): ", content);
+    return -1;
+  }
+  *colon = '\0';
+
+  char *name = trim(content);
+  char *timeout = strstr(name, " timeout ");
+  if (timeout) {
+    *timeout = '\0';
+    timeout = trim(timeout + strlen(" timeout "));
+    char *end = NULL;
+    step->timeout_ms = strtol(timeout, &end, 10);
+    if (*end || step->timeout_ms <= 0) {
+      plan_error("Invalid timeout (expected milliseconds): ", timeout);
+      return -1;
+    }
+    name = trim(name);
+  }
+
+  char *deps = strstr(name, " after ");
+  if (deps) {
+    *deps = '\0';
+    deps = trim(deps + strlen(" after "));
+    name = trim(name);
+  }
+  if (!*name || strchr(name, ' ') || strchr(name, ',')) {
+    plan_error("Invalid step name: ", name);
+    return -1;
+  }
+
+  step->name = name;
+  step->after = deps;
+  step->body = trim(colon+1);
+  return 1;
+}
+
+// Parses the steps of a multi-step command (see STEPS_HEADER). The plan
+// should be freed with free_plan()
+bool parse_plan(const char *command, plan *p) {
+  *p = (plan) {0};
+  if (!is_multi_step(command)) return false;
+
+  char *text = strdup(command + strlen(STEPS_HEADER));
+  if (!text) return false;
+
+  // The names of the dependencies are resolved once every step is known
+  char **after = NULL;
+
+  bool ok = true;
+  char *line = text;
+  while (ok && line) {
+    char *next = strchr(line, '\n');
+    if (next) *(next++) = '\0';
+
+    step_line parsed;
+    const int kind = split_step_line(line, &parsed);
+    line = next;
+    if (kind == 0) continue;
+    if (kind == -1) {
+      ok = false;
+      break;
+    }
+
+    const char *name = parsed.name;
+    if (search_step(p, name) != -1) {
+      plan_error("Duplicated step: ", name);
+      ok = false;
+      break;
+    }
+    plan_step *steps = realloc(p->steps, sizeof(plan_step) * (p->len+1));
+    char **new_after = realloc(after, sizeof(char *) * (p->len+1));
+    if (!steps || !new_after) {
+      if (steps) p->steps = steps;
+      if (new_after) after = new_after;
+      ok = false;
+      break;
+    }
+    p->steps = steps;
+    after = new_after;
+
+    plan_step *step = &p->steps[p->len];
+    *step = (plan_step) {0};
+    str_append(&step->name, name);
+    str_append(&step->command, parsed.body);
+    step->timeout_ms = parsed.timeout_ms;
+    parse_param(step);
+    after[p->len] = parsed.after;
+    p->len++;
+  }
+
+  // Dependencies
+  for (int i=0; ok && i<p->len; i++) {
+    if (!after[i]) continue;
+
+    char *dep = strtok(after[i], ",");
+    while (ok && dep) {
+      dep = trim(dep);
+      const int index = search_step(p, dep);
+      if (index == -1 || index == i) {
+        plan_error("Unknown dependency: ", dep);
+        ok = false;
+        break;
+      }
+
+      int *deps = realloc(p->steps[i].deps, sizeof(int) * (p->steps[i].deps_len+1));
+      if (!deps) {
+        ok = false;
+        break;
+      }
+      p->steps[i].deps = deps;
+      p->steps[i].deps[p->steps[i].deps_len++] = index;
+
+      dep = strtok(NULL, ",");
+    }
+  }
+
+  if (ok && p->len == 0) {
+    ERROR("The multi-step command doesn't have steps");
+    ok = false;
+  }
+
+  if (ok) {
+    char *state = calloc(p->len, sizeof(char));
+    for (int i=0; ok && i<p->len; i++) {
+      if (has_cycle(p, i, state)) {
+        plan_error("The order of the steps has a cycle, starting at: ", p->steps[i].name.str);
+        ok = false;
+      }
+    }
+    free(state);
+  }
+
+  free(after);
+  free(text);
+  if (!ok) free_plan(p);
+  return ok;
+}
+
+/// Execution ///
+
+typedef enum {
+  StepWaiting,
+  StepRunning,
+  StepDone,
+  StepFailed,
+  StepSkipped
+} step_state;
+
+typedef struct {
+  step_state state;
+  int deps_left;
+  int jobs_left;
+  int ret;
+  bool unchanged; // The parameter already had the value
+  bool timed_out;
+  string out, err;
+} step_status;
+
+// A command of a step (one for each device of its target)
+typedef struct {
+  int step;
+  string command;
+  child *process;
+} job;
+
+struct plan_run {
+  plan *p;
+  int workers;
+  step_status *status;
+  applied_state *applied;
+  run_target target; // Its strings should outlive the run
+
+  job *queue; // Jobs that are ready to run
+  int queue_len, queue_start;
+
+  job *running;
+  int running_len;
+};
+
+static applied_param *search_applied(applied_state *applied, const char *key) {
+  if (!applied) return NULL;
+
+  for (int i=0; i<applied->len; i++) {
+    if (!strcmp(applied->params[i].key.str, key)) return &applied->params[i];
+  }
+  return NULL;
+}
+
+static applied_param *store_applied(applied_state *applied, const char *key, const char *value) {
+  applied_param *param = search_applied(applied, key);
+  if (!param) {
+    applied_param *params = realloc(applied->params, sizeof(applied_param) * (applied->len+1));
+    if (!params) return NULL;
+    applied->params = params;
+    param = &applied->params[applied->len++];
+    *param = (applied_param) {0};
+    str_append(&param->key, key);
+  }
+
+  if (value) str_replace(&param->value, (char *) value);
+  else str_free(&param->value);
+  return param;
+}
+
+// The value is NULL if it's unknown (e.g. setting the parameter failed)
+static void set_applied(applied_state *applied, const char *key, const char *value) {
+  if (!applied) return;
+
+  applied_param *param = store_applied(applied, key, value);
+  if (param) param->changed = true;
+}
+
+static void remove_applied(applied_state *applied, int i) {
+  str_free(&applied->params[i].key);
+  str_free(&applied->params[i].value);
+  applied->params[i] = applied->params[--applied->len];
+}
+
+static void device_key(string *key, const char *device, const char *param) {
+  str_replace(key, (char *) device);
+  str_append_char(key, '\t');
+  if (param) str_append(key, param);
+}
+
+// Every parameter of the device becomes unknown
+static void drop_device(applied_state *applied, const char *device) {
+  string prefix = {0};
+  device_key(&prefix, device, NULL);
+  for (int i=0; i<applied->len; i++) {
+    if (strncmp(applied->params[i].key.str, prefix.str, prefix.str_len)) continue;
+    str_free(&applied->params[i].value);
+    applied->params[i].changed = true;
+  }
+  set_applied(applied, prefix.str, NULL);
+  str_free(&prefix);
+}
+
+static bool enqueue_step(plan_run *r, int step) {
+  plan_step *s = &r->p->steps[step];
+  string command = {0};
+  str_append(&command, s->command.str);
+  if (s->follows_window) {
+    str_append_char(&command, '\'');
+    str_append(&command, r->target.output);
+    str_append_char(&command, '\'');
+  }
+
+  string *commands = NULL;
+  const int len = expand_tablet_placeholders(command.str, r->target.display, &commands);
+  str_free(&command);
+  if (len == -1) return false;
+
+  // The commands run in the display of the plan
+  if (r->target.display) {
+    string body = {0};
+    for (int i=0; i<len; i++) {
+      body = commands[i];
+      commands[i] = (string) {0};
+      display_command(&commands[i], r->target.display, body.str);
+      str_free(&body);
+    }
+  }
+
+  job *queue = realloc(r->queue, sizeof(job) * (r->queue_len+len));
+  if (!queue) {
+    free_commands(&commands, len);
+    return false;
+  }
+  r->queue = queue;
+
+  for (int i=0; i<len; i++) {
+    r->queue[r->queue_len++] = (job) { .step = step, .command = commands[i], .process = NULL };
+  }
+  free(commands); // The strings are moved to the queue
+
+  r->status[step].state = StepRunning;
+  r->status[step].jobs_left = len;
+  return true;
+}
+
+static void skip_dependents(plan_run *r, int step) {
+  for (int i=0; i<r->p->len; i++) {
+    if (r->status[i].state != StepWaiting) continue;
+
+    for (int j=0; j<r->p->steps[i].deps_len; j++) {
+      if (r->p->steps[i].deps[j] != step) continue;
+
+      r->status[i].state = StepSkipped;
+      skip_dependents(r, i);
+      break;
+    }
+  }
+}
+
+static void finish_step(plan_run *r, int step);
+
+// The value of the parameter of the step
+static const char *step_value(plan_run *r, plan_step *s) {
+  return (s->follows_window) ? r->target.output : s->param_value.str;
+}
+
+// If every device of the step already has the value of its parameter
+static bool param_applied(plan_run *r, plan_step *s) {
+  if (!r->applied || !s->param_key.str) return false;
+
+  const char **devices = NULL;
+  const int len = command_device_names(s->command.str, r->target.display, &devices);
+  bool applied = (len > 0);
+  string key = {0};
+  for (int i=0; applied && i<len; i++) {
+    device_key(&key, devices[i], s->param_key.str);
+    applied_param *param = search_applied(r->applied, key.str);
+    applied = param && param->value.str && !strcmp(param->value.str, step_value(r, s));
+  }
+  str_free(&key);
+  free(devices);
+  return applied;
+}
+
+// The parameter of the step is saved for each of its devices (unknown if the
+// step failed). Other commands may change any parameter of the devices they
+// use
+static void update_applied(plan_run *r, plan_step *s, bool failed) {
+  const char **devices = NULL;
+  const int len = command_device_names(s->command.str, r->target.display, &devices);
+  string key = {0};
+  for (int i=0; i<len; i++) {
+    if (!s->param_key.str) {
+      drop_device(r->applied, devices[i]);
+      continue;
+    }
+    device_key(&key, devices[i], s->param_key.str);
+    set_applied(r->applied, key.str, (failed) ? NULL : step_value(r, s));
+  }
+  str_free(&key);
+  free(devices);
+}
+
+// Parameters that already have the value are not set again. The steps that
+// follow the window are skipped if its output isn't known (and, if only
+// those steps run, the other ones are taken as done)
+static void start_step(plan_run *r, int step) {
+  plan_step *s = &r->p->steps[step];
+  if ((s->follows_window && !r->target.output) || (r->target.only_following && !s->follows_window)) {
+    r->status[step].unchanged = true;
+    finish_step(r, step);
+    return;
+  }
+
+  if (param_applied(r, s)) {
+    r->status[step].unchanged = true;
+    finish_step(r, step);
+    return;
+  }
+
+  if (!enqueue_step(r, step)) {
+    r->status[step].ret = 1;
+    finish_step(r, step);
+  }
+}
+
+static void finish_step(plan_run *r, int step) {
+  step_status *status = &r->status[step];
+  status->state = (status->ret) ? StepFailed : StepDone;
+
+  plan_step *s = &r->p->steps[step];
+  if (r->applied && !status->unchanged) update_applied(r, s, status->ret);
+
+  if (status->state == StepFailed) {
+    skip_dependents(r, step);
+    return;
+  }
+
+  for (int i=0; i<r->p->len; i++) {
+    if (r->status[i].state != StepWaiting) continue;
+
+    for (int j=0; j<r->p->steps[i].deps_len; j++) {
+      if (r->p->steps[i].deps[j] == step && --r->status[i].deps_left == 0) start_step(r, i);
+    }
+  }
+}
+
+// Starts the steps without dependencies. The steps run in the background
+// (see process.h): update_plan() should be called after supervisor_wait()
+// until it returns true, and then finish_plan().
+//
+// At most 'workers' commands run at the same time. If 'applied' is given,
+// only the parameters with a different value are set, and 'applied' is
+// updated with the new values. The commands run in the target (see
+// run_target).
+plan_run *start_plan(plan *p, int workers, applied_state *applied, const run_target *target) {
+  if (!p || workers < 1) return NULL;
+
+  plan_run *r = calloc(1, sizeof(plan_run));
+  if (!r) return NULL;
+  *r = (plan_run) {
+    .p = p,
+    .workers = workers,
+    .status = calloc(p->len, sizeof(step_status)),
+    .applied = applied,
+    .target = (target) ? *target : (run_target) {0},
+    .running = calloc(workers, sizeof(job))
+  };
+  if (!r->status || !r->running) {
+    free(r->status);
+    free(r->running);
+    free(r);
+    return NULL;
+  }
+
+  for (int i=0; i<p->len; i++) r->status[i].deps_left = p->steps[i].deps_len;
+  for (int i=0; i<p->len; i++) {
+    if (p->steps[i].deps_len == 0 && r->status[i].state == StepWaiting) start_step(r, i);
+  }
+
+  update_plan(r);
+  return r;
+}
+
+// Collects the jobs that ended and starts the ones that are ready. Returns
+// true when every step has finished
+bool update_plan(plan_run *r) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    // Collect
+    for (int i=r->running_len-1; i>=0; i--) {
+      job *j = &r->running[i];
+      if (!child_done(j->process)) continue;
+
+      step_status *status = &r->status[j->step];
+      str_append(&status->out, j->process->out.str);
+      str_append(&status->err, j->process->err.str);
+      if (j->process->timed_out) status->timed_out = true;
+      if (!status->ret) status->ret = j->process->exit_code;
+
+      const int step = j->step;
+      child_free(j->process);
+      str_free(&j->command);
+      r->running[i] = r->running[--r->running_len];
+
+      if (--status->jobs_left == 0) finish_step(r, step);
+      changed = true;
+    }
+
+    // Start
+    while (r->running_len < r->workers && r->queue_start < r->queue_len) {
+      job j = r->queue[r->queue_start++];
+      const long timeout = r->p->steps[j.step].timeout_ms;
+      if ( !(j.process = child_spawn(j.command.str, (timeout) ? timeout : CHILD_TIMEOUT_MS)) ) {
+        ERROR("Unable to run the command");
+        r->status[j.step].ret = 1;
+        str_free(&j.command);
+        if (--r->status[j.step].jobs_left == 0) finish_step(r, j.step);
+        changed = true;
+        continue;
+      }
+      r->running[r->running_len++] = j;
+    }
+  }
+
+  return (r->running_len == 0 && r->queue_start == r->queue_len);
+}
+
+static void append_trimmed(string *s, string *output) {
+  if (output->str_len && output->str[output->str_len-1] == '\n')
+    output->str[--output->str_len] = '\0';
+  str_append(s, output->str);
+}
+
+// Returns the exit code of the first step that failed (or 0). The output of
+// each step is added to 'output' (one block per step, in the order of the
+// plan). The run is freed
+int finish_plan(plan_run *r, string *output) {
+  if (!r) return 1;
+
+  // The commands that are still running are terminated
+  for (int i=0; i<r->running_len; i++) {
+    child_free(r->running[i].process);
+    str_free(&r->running[i].command);
+    r->status[r->running[i].step].ret = 1;
+  }
+  for (int i=r->queue_start; i<r->queue_len; i++) str_free(&r->queue[i].command);
+
+  if (output && output->str) str_free(output);
+
+  int ret = 0;
+  for (int i=0; i<r->p->len; i++) {
+    step_status *status = &r->status[i];
+    if (status->state == StepFailed && !ret) ret = status->ret;
+    if (!output) {
+      str_free(&status->out);
+      str_free(&status->err);
+      continue;
+    }
+
+    // Single commands only have their output
+    if (r->p->single) {
+      append_trimmed(output, &status->out);
+      if (status->timed_out) {
+        if (output->str_len) str_append_char(output, '\n');
+        str_append(output, "Timed out");
+      }
+      if (status->err.str_len) {
+        if (output->str_len) str_append_char(output, '\n');
+        str_append(output, "stderr: ");
+        append_trimmed(output, &status->err);
+      }
+      str_free(&status->out);
+      str_free(&status->err);
+      continue;
+    }
+
+    str_append(output, "[");
+    str_append(output, r->p->steps[i].name.str);
+    str_append(output, "] ");
+
+    switch (status->state) {
+      case StepSkipped:
+        str_append(output, "Skipped (a previous step failed)");
+        break;
+      case StepFailed:
+        if (status->timed_out) {
+          str_append(output, "Timed out");
+        } else {
+          str_append(output, "Failed with exit code ");
+          str_append_int(output, status->ret);
+        }
+        break;
+      default:
+        str_append(output, (status->unchanged) ? "Unchanged" : "OK");
+    }
+
+    if (status->out.str_len) {
+      str_append(output, ": ");
+      append_trimmed(output, &status->out);
+    }
+    if (status->err.str_len) {
+      str_append(output, "\n[");
+      str_append(output, r->p->steps[i].name.str);
+      str_append(output, "] stderr: ");
+      append_trimmed(output, &status->err);
+    }
+    if (i+1 < r->p->len) str_append_char(output, '\n');
+
+    str_free(&status->out);
+    str_free(&status->err);
+  }
+
+  free(r->status);
+  free(r->queue);
+  free(r->running);
+  free(r);
+  return ret;
+}
+
+// Runs the plan and waits for it (see start_plan())
+int run_plan(plan *p, int workers, applied_state *applied, const run_target *target, string *output) {
+  plan_run *r = start_plan(p, workers, applied, target);
+  if (!r) return 1;
+
+  while (!update_plan(r)) supervisor_wait(-1);
+  return finish_plan(r, output);
+}
+
+/// Commands ///
+
+// The first step that is a reference to another command (or NULL)
+static const char *plan_reference(plan *p) {
+  for (int i=0; i<p->len; i++) {
+    if (*p->steps[i].command.str == REFERENCE_PREFIX) return p->steps[i].command.str;
+  }
+  return NULL;
+}
+
+// A command (single or multi-step) running in the background
+struct command_run {
+  plan p;
+  applied_state applied;
+  plan_run *run;
+  string display, output; // Of the target (see run_target)
+  run_target target;
+};
+
+// A plan with only one step (a command that isn't multi-step)
+static bool single_step_plan(const char *command, plan *p) {
+  *p = (plan) {0};
+  if ( !(p->steps = calloc(1, sizeof(plan_step))) ) return false;
+
+  p->len = 1;
+  p->single = true;
+  str_append(&p->steps[0].name, "command");
+  str_append(&p->steps[0].command, command);
+  return true;
+}
+
+// Starts the command in the background. update_command() should be called
+// after supervisor_wait() until it returns true, and then finish_command().
+// The target is NULL for the display of the environment
+command_run *start_command(const char *command, const run_target *target) {
+  command_run *r = calloc(1, sizeof(command_run));
+  if (!r) return NULL;
+  if (target) {
+    r->target = *target;
+    if (target->display) str_append(&r->display, target->display);
+    if (target->output) str_append(&r->output, target->output);
+    r->target.display = r->display.str;
+    r->target.output = r->output.str;
+  }
+  const char *display = r->target.display;
+
+  // The references are resolved before running the command (see macro.h)
+  if (command && *command == REFERENCE_PREFIX) {
+    plan_error("Unresolved reference to another command: ", command);
+    str_free(&r->display);
+    str_free(&r->output);
+    free(r);
+    return NULL;
+  }
+
+  if (is_multi_step(command)) {
+    const char *reference = NULL;
+    if (parse_plan(command, &r->p)) reference = plan_reference(&r->p);
+    if (reference) {
+      plan_error("Unresolved reference to another command: ", reference);
+      free_plan(&r->p);
+    }
+    if (!r->p.steps) {
+      str_free(&r->display);
+      str_free(&r->output);
+      free(r);
+      return NULL;
+    }
+
+    // Only the parameters that changed are set
+    load_applied_state(&r->applied, display);
+  } else {
+    if (!single_step_plan(command, &r->p)) {
+      str_free(&r->display);
+      str_free(&r->output);
+      free(r);
+      return NULL;
+    }
+
+    // Commands that aren't parameters may change any of them
+    clear_applied_state(display);
+  }
+
+  if ( !(r->run = start_plan(&r->p, PLAN_WORKERS, (r->p.single) ? NULL : &r->applied, &r->target)) ) {
+    free_plan(&r->p);
+    free_applied_state(&r->applied);
+    str_free(&r->display);
+    str_free(&r->output);
+    free(r);
+    return NULL;
+  }
+
+  return r;
+}
+
+// If the command has steps that follow the focused window (see plan.h)
+bool command_follows_window(command_run *r) {
+  for (int i=0; i<r->p.len; i++) {
+    if (r->p.steps[i].follows_window) return true;
+  }
+  return false;
+}
+
+bool update_command(command_run *r) {
+  return update_plan(r->run);
+}
+
+// Returns the exit code of the command. The run is freed
+int finish_command(command_run *r, string *output) {
+  if (!r) return 1;
+
+  const int ret = finish_plan(r->run, output);
+  if (!r->p.single) save_applied_state(&r->applied, r->display.str);
+
+  free_applied_state(&r->applied);
+  free_plan(&r->p);
+  str_free(&r->display);
+  str_free(&r->output);
+  free(r);
+  return ret;
+}
+
+/// Applied state ///
+
+// The parameters set are saved in this file, so every wakit process (the
+// daemon, the menu, ...) knows them. The first line is the modification time
+// of the input devices: when a device is plugged again, its parameters are
+// reset by the driver and the file is no longer valid. Each display has its
+// own file, in the private directory of the user (see display.h).
+//
+// A run loads it when it starts and saves only its changes when it finishes,
+// so the file is rewritten under a lock (on a separate file, as it's
+// replaced) and the runs that finish meanwhile aren't lost
+#define APPLIED_STATE_PREFIX "applied"
+#define APPLIED_STATE_SUFFIX ".wakit"
+
+void free_applied_state(applied_state *applied) {
+  for (int i=0; i<applied->len; i++) {
+    str_free(&applied->params[i].key);
+    str_free(&applied->params[i].value);
+  }
+  free(applied->params);
+  applied->params = NULL;
+  applied->len = 0;
+}
+
+// Returns the file descriptor of the lock (-1 on error)
+static int lock_applied_state(const char *path) {
+  string lock_path = {0};
+  str_append(&lock_path, path);
+  str_append(&lock_path, ".lock");
+  const int fd = open(lock_path.str, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  str_free(&lock_path);
+  if (fd == -1) return -1;
+
+  struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+  while (fcntl(fd, F_OFD_SETLKW, &lock)) {
+    if (errno != EINTR) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+static void read_applied_state(applied_state *applied, const char *path) {
+  *applied = (applied_state) {0};
+
+  // Only a file of the user is trusted
+  const int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1) return;
+  struct stat st;
+  FILE *f = NULL;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != getuid() || !(f = fdopen(fd, "r"))) {
+    close(fd);
+    return;
+  }
+
+  const struct timespec input_mtime = input_devices_mtime();
+  long sec, nsec;
+  if (fscanf(f, "%ld %ld\n", &sec, &nsec) != 2 || sec != input_mtime.tv_sec || nsec != input_mtime.tv_nsec) {
+    fclose(f);
+    return;
+  }
+
+  // <device>\t<parameter>\t<value>
+  string line = {0};
+  char buffer[256];
+  while (fgets(buffer, sizeof(buffer), f)) {
+    str_append(&line, buffer);
+    if (line.str[line.str_len-1] != '\n' && !feof(f)) continue;
+    if (line.str[line.str_len-1] == '\n') line.str[--line.str_len] = '\0';
+
+    char *value = strchr(line.str, '\t');
+    if (value) value = strchr(value+1, '\t');
+    if (value) {
+      *(value++) = '\0';
+      store_applied(applied, line.str, value);
+    }
+    str_free(&line);
+  }
+
+  str_free(&line);
+  fclose(f);
+}
+
+static bool write_applied_state(applied_state *applied, const char *path) {
+  string tmp_path = {0};
+  str_append(&tmp_path, path);
+  str_append(&tmp_path, ".XXXXXX");
+
+  const int fd = mkstemp(tmp_path.str);
+  FILE *f = (fd != -1) ? fdopen(fd, "w") : NULL;
+  if (!f) {
+    if (fd != -1) {
+      close(fd);
+      remove(tmp_path.str);
+    }
+    str_free(&tmp_path);
+    return false;
+  }
+
+  const struct timespec input_mtime = input_devices_mtime();
+  fprintf(f, "%ld %ld\n", (long) input_mtime.tv_sec, (long) input_mtime.tv_nsec);
+  for (int i=0; i<applied->len; i++) {
+    if (applied->params[i].value.str)
+      fprintf(f, "%s\t%s\n", applied->params[i].key.str, applied->params[i].value.str);
+  }
+
+  const bool ok = !fclose(f) && !rename(tmp_path.str, path);
+  if (!ok) remove(tmp_path.str);
+  str_free(&tmp_path);
+  return ok;
+}
+
+void load_applied_state(applied_state *applied, const char *display) {
+  string path = {0};
+  if (private_display_path(&path, APPLIED_STATE_PREFIX, display, APPLIED_STATE_SUFFIX))
+    read_applied_state(applied, path.str);
+  else
+    *applied = (applied_state) {0};
+  str_free(&path);
+}
+
+// Only the changes of the run are saved, on top of the ones saved by the
+// other runs meanwhile: first the devices it dropped, then its parameters
+void save_applied_state(applied_state *applied, const char *display) {
+  bool changed = false;
+  for (int i=0; i<applied->len && !changed; i++) changed = applied->params[i].changed;
+  if (!changed) return;
+
+  string path = {0};
+  int lock_fd = -1;
+  if (!private_display_path(&path, APPLIED_STATE_PREFIX, display, APPLIED_STATE_SUFFIX)
+      || (lock_fd = lock_applied_state(path.str)) == -1
+  ) {
+    str_free(&path);
+    return;
+  }
+
+  applied_state saved;
+  read_applied_state(&saved, path.str);
+
+  for (int i=0; i<applied->len; i++) {
+    applied_param *param = &applied->params[i];
+    if (!param->changed || param->key.str[param->key.str_len-1] != '\t') continue;
+
+    for (int j=0; j<saved.len; ) {
+      if (!strncmp(saved.params[j].key.str, param->key.str, param->key.str_len)) remove_applied(&saved, j);
+      else j++;
+    }
+  }
+
+  for (int i=0; i<applied->len; i++) {
+    applied_param *param = &applied->params[i];
+    if (!param->changed || param->key.str[param->key.str_len-1] == '\t') continue;
+
+    if (param->value.str) {
+      store_applied(&saved, param->key.str, param->value.str);
+    } else {
+      applied_param *old = search_applied(&saved, param->key.str);
+      if (old) remove_applied(&saved, old - saved.params);
+    }
+  }
+
+  write_applied_state(&saved, path.str);
+  close(lock_fd); // Releases the lock
+  free_applied_state(&saved);
+  str_free(&path);
+}
+
+void clear_applied_state(const char *display) {
+  string path = {0};
+  int lock_fd = -1;
+  if (private_display_path(&path, APPLIED_STATE_PREFIX, display, APPLIED_STATE_SUFFIX)
+      && (lock_fd = lock_applied_state(path.str)) != -1
+  ) {
+    remove(path.str);
+    close(lock_fd);
+  }
+  str_free(&path);
+}
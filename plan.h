@@ -0,0 +1,104 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdbool.h>
+
+#include "dynamic_string.h"
+
+// A multi-step command starts with this line, followed by one step per line:
+//   <name>[ after <step>[,<step>...]][ timeout <ms>]: <command>
+// The steps run in parallel (in a bounded pool), unless they're declared to
+// run after other steps. Empty lines and lines starting with '#' are ignored.
+// The commands that take longer than their timeout (CHILD_TIMEOUT_MS by
+// default) are terminated.
+//
+// Steps can set a parameter of the devices instead of running a command:
+//   <name>: set[:<target>] <parameter> <value>
+// It runs 'xsetwacom set' on the devices of the target (the stylus by default).
+// The values set are recorded, so the parameters that already have the value
+// aren't set again when switching between profiles.
+//
+// The area can follow the focused window: 'set MapToOutput follow' maps the
+// devices to the monitor of the window. The daemon runs the step again when
+// the window is in another monitor (it's skipped where the monitor isn't
+// known, e.g. 'wakit -r').
+//
+// A step can be another command of the list: '<name>: @<command>'. The
+// references are resolved before running it (see macro.h).
+#define STEPS_HEADER "#wakit steps"
+#define REFERENCE_PREFIX '@'
+#define FOLLOW_PARAM "MapToOutput"
+#define FOLLOW_VALUE "follow"
+#define PLAN_WORKERS 8
+
+typedef struct {
+  string name;
+  string command;
+  int *deps; // Indexes of the steps that should finish before this one
+  int deps_len;
+  long timeout_ms; // 0 for the default one
+
+  // Only for parameters. The key is the parameter ('Button <number>' for the
+  // buttons), and it's set in every device of the target
+  string param_key;
+  string param_value;
+  bool follows_window; // The value is the output of the focused window
+} plan_step;
+
+// A line of a multi-step command (the strings point inside the line)
+typedef struct {
+  char *name;
+  char *after; // The names of its dependencies, separated by commas (or NULL)
+  long timeout_ms;
+  char *body;
+} step_line;
+
+typedef struct {
+  plan_step *steps;
+  int len;
+  bool single; // A command that isn't multi-step
+} plan;
+
+// Where the commands run. A NULL target is the display of the environment
+typedef struct {
+  const char *display; // NULL for the one of the environment
+  const char *output;  // Of the focused window (NULL if it isn't known)
+  bool only_following; // Only the steps that follow the window run
+} run_target;
+
+typedef struct plan_run plan_run;
+typedef struct command_run command_run;
+
+typedef struct {
+  string key;   // '<device name>\t<parameter>'
+  string value; // NULL if the run removed it
+  bool changed; // By the run (only these are saved)
+} applied_param;
+
+// Parameters set in the devices (see plan_step). A run removes all the
+// parameters of a device with the key '<device name>\t'
+typedef struct {
+  applied_param *params;
+  int len;
+} applied_state;
+
+bool is_multi_step(const char *command);
+int split_step_line(char *line, step_line *step);
+bool parse_plan(const char *command, plan *p);
+void free_plan(plan *p);
+plan_run *start_plan(plan *p, int workers, applied_state *applied, const run_target *target);
+bool update_plan(plan_run *r);
+int finish_plan(plan_run *r, string *output);
+int run_plan(plan *p, int workers, applied_state *applied, const run_target *target, string *output);
+
+command_run *start_command(const char *command, const run_target *target);
+bool command_follows_window(command_run *r);
+bool update_command(command_run *r);
+int finish_command(command_run *r, string *output);
+
+void load_applied_state(applied_state *applied, const char *display);
+void save_applied_state(applied_state *applied, const char *display);
+void clear_applied_state(const char *display);
+void free_applied_state(applied_state *applied);
+
+#endif // PLAN_H
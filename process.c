@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "process.h"
+#include "cli_io.h"
+#include "dynamic_string.h"
+#include "trace.h"
+
+// Children that haven't been freed
+static child *children = NULL;
+
+// SIGCHLD is turned into a byte in this pipe, so it can be waited with the
+// outputs of the children. Everything is waited through one epoll instance.
+static int sigchld_pipe[2] = {-1, -1};
+static int epoll_fd = -1;
+
+long monotonic_ms() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000L + t.tv_nsec / 1000000L;
+}
+
+static void on_sigchld(int sig) {
+  const int saved_errno = errno;
+  if (write(sigchld_pipe[1], "", 1) == -1) {} // If the pipe is full, there's already a byte waiting
+  errno = saved_errno;
+}
+
+static bool supervisor_init() {
+  if (epoll_fd != -1) return true;
+
+  if (pipe2(sigchld_pipe, O_NONBLOCK | O_CLOEXEC)) {
+    ERROR("Unable to create the SIGCHLD pipe");
+    return false;
+  }
+
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    ERROR("Unable to create the epoll instance of the supervisor");
+    return false;
+  }
+  struct epoll_event event = { .events = EPOLLIN, .data.fd = sigchld_pipe[0] };
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sigchld_pipe[0], &event);
+
+  // The children are only reaped by the supervisor (by their pid), so popen()
+  // and system() keep working
+  struct sigaction action = { .sa_handler = on_sigchld, .sa_flags = SA_RESTART | SA_NOCLDSTOP };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGCHLD, &action, NULL);
+  return true;
+}
+
+// The epoll instance of the supervisor (it can be added to another epoll
+// instance). When it's readable, supervisor_wait(0) should be called
+int supervisor_fd() {
+  supervisor_init();
+  return epoll_fd;
+}
+
+// Runs 'sh -c <command>'. The timeout is in ms (0 for no timeout)
+child *child_spawn(const char *command, long timeout_ms) {
+  if (!command || !supervisor_init()) return NULL;
+
+  int out[2], err[2];
+  if (pipe2(out, O_CLOEXEC)) return NULL;
+  if (pipe2(err, O_CLOEXEC)) {
+    close(out[0]);
+    close(out[1]);
+    return NULL;
+  }
+
+  const pid_t pid = fork();
+  if (pid == -1) {
+    ERROR("fork() failed!");
+    close(out[0]); close(out[1]);
+    close(err[0]); close(err[1]);
+    return NULL;
+  }
+
+  if (pid == 0) {
+    // The daemon blocks its signals in every thread (see watch_signals()), and
+    // exec keeps the mask, so the command would ignore the SIGTERM of its
+    // timeout
+    sigset_t empty;
+    sigemptyset(&empty);
+    signal(SIGCHLD, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    // Own process group, so the whole command can be terminated
+    setpgid(0, 0);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+    _exit(127);
+  }
+  setpgid(pid, pid);
+  close(out[1]);
+  close(err[1]);
+
+  child *c = calloc(1, sizeof(child));
+  if (!c) {
+    kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(out[0]);
+    close(err[0]);
+    return NULL;
+  }
+  c->pid = pid;
+  c->stdout_fd = out[0];
+  c->stderr_fd = err[0];
+  c->deadline_ms = (timeout_ms > 0) ? monotonic_ms() + timeout_ms : 0;
+
+  fcntl(c->stdout_fd, F_SETFL, O_NONBLOCK);
+  fcntl(c->stderr_fd, F_SETFL, O_NONBLOCK);
+  struct epoll_event event = { .events = EPOLLIN, .data.fd = c->stdout_fd };
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->stdout_fd, &event);
+  event.data.fd = c->stderr_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->stderr_fd, &event);
+
+  c->next = children;
+  children = c;
+  return c;
+}
+
+static void close_stream(int *fd) {
+  if (*fd == -1) return;
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+  close(*fd);
+  *fd = -1;
+}
+
+// Reads what's available in the stream. The output over the limit is
+// discarded (but read, so the child doesn't block)
+static void read_stream(child *c, int *fd, string *output) {
+  if (*fd == -1) return;
+
+  char buffer[1024];
+  ssize_t len;
+  while ((len = read(*fd, buffer, sizeof(buffer)-1)) > 0) {
+    const size_t room = (output->str_len < CHILD_OUTPUT_LIMIT) ? CHILD_OUTPUT_LIMIT - output->str_len : 0;
+    if ((size_t) len > room) {
+      c->truncated = true;
+      len = room;
+    }
+    buffer[len] = '\0';
+    if (len) str_append(output, buffer);
+  }
+
+  // Closed by the child
+  if (len == 0) close_stream(fd);
+}
+
+static void reap(child *c) {
+  if (c->exited) return;
+
+  int status;
+  if (waitpid(c->pid, &status, WNOHANG) != c->pid) return;
+
+  c->exited = true;
+  if (c->timed_out) c->exit_code = CHILD_TIMEOUT_EXIT_CODE;
+  else if (WIFEXITED(status)) c->exit_code = WEXITSTATUS(status);
+  else c->exit_code = 128 + WTERMSIG(status);
+
+  // The rest of the output. The streams are closed even if a process started
+  // by the command still has them open
+  read_stream(c, &c->stdout_fd, &c->out);
+  read_stream(c, &c->stderr_fd, &c->err);
+  close_stream(&c->stdout_fd);
+  close_stream(&c->stderr_fd);
+}
+
+static void check_timeout(child *c, long now) {
+  if (c->exited || !c->deadline_ms) return;
+
+  if (!c->kill_at_ms && now >= c->deadline_ms) {
+    c->timed_out = true;
+    c->kill_at_ms = now + CHILD_KILL_GRACE_MS;
+    kill(-c->pid, SIGTERM);
+  } else if (c->kill_at_ms && now >= c->kill_at_ms) {
+    kill(-c->pid, SIGKILL);
+    c->kill_at_ms = 0;
+    c->deadline_ms = 0;
+  }
+}
+
+// Monotonic time of the next timeout action (0 if there isn't one)
+long supervisor_next_deadline() {
+  long next = 0;
+  for (child *c = children; c; c = c->next) {
+    if (c->exited) continue;
+
+    const long deadline = (c->kill_at_ms) ? c->kill_at_ms : c->deadline_ms;
+    if (deadline && (!next || deadline < next)) next = deadline;
+  }
+  return next;
+}
+
+// Waits up to timeout_ms (-1 to wait forever) for something to happen to the
+// children: output, exit or timeout
+void supervisor_wait(long timeout_ms) {
+  if (!supervisor_init()) return;
+
+  const long deadline = supervisor_next_deadline();
+  if (deadline) {
+    long until_deadline = deadline - monotonic_ms();
+    if (until_deadline < 0) until_deadline = 0;
+    if (timeout_ms < 0 || until_deadline < timeout_ms) timeout_ms = until_deadline;
+  }
+
+  // Only the waits that can block are traced
+  trace_span span = trace_begin("child_wait");
+  struct epoll_event events[16];
+  const int len = epoll_wait(epoll_fd, events, 16, timeout_ms);
+  if (timeout_ms) trace_end(&span);
+  for (int i=0; i<len; i++) {
+    if (events[i].data.fd == sigchld_pipe[0]) {
+      char buffer[64];
+      while (read(sigchld_pipe[0], buffer, sizeof(buffer)) > 0);
+      continue;
+    }
+
+    for (child *c = children; c; c = c->next) {
+      if (events[i].data.fd == c->stdout_fd) read_stream(c, &c->stdout_fd, &c->out);
+      else if (events[i].data.fd == c->stderr_fd) read_stream(c, &c->stderr_fd, &c->err);
+    }
+  }
+
+  const long now = monotonic_ms();
+  for (child *c = children; c; c = c->next) {
+    reap(c);
+    check_timeout(c, now);
+  }
+}
+
+bool child_done(child *c) {
+  return c->exited;
+}
+
+void child_free(child *c) {
+  if (!c) return;
+
+  // Still running
+  if (!c->exited) {
+    kill(-c->pid, SIGKILL);
+    waitpid(c->pid, NULL, 0);
+  }
+  close_stream(&c->stdout_fd);
+  close_stream(&c->stderr_fd);
+
+  child **aux = &children;
+  while (*aux && *aux != c) aux = &(*aux)->next;
+  if (*aux) *aux = c->next;
+
+  str_free(&c->out);
+  str_free(&c->err);
+  free(c);
+}
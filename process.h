@@ -0,0 +1,47 @@
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "dynamic_string.h"
+
+// Maximum output kept of each stream of a child (the rest is discarded)
+#define CHILD_OUTPUT_LIMIT (64 * 1024)
+// Default time a child can run before being terminated (ms)
+#define CHILD_TIMEOUT_MS 10000
+// Time between SIGTERM and SIGKILL for the children that time out (ms)
+#define CHILD_KILL_GRACE_MS 1000
+// Exit code of the children that time out (as timeout(1))
+#define CHILD_TIMEOUT_EXIT_CODE 124
+
+// A command run by the supervisor ('sh -c <command>'). The supervisor reads
+// its outputs, reaps it and terminates it when it times out. Everything
+// happens inside supervisor_wait(), so the caller never blocks on a child.
+typedef struct child {
+  pid_t pid;
+  int stdout_fd, stderr_fd;
+  string out, err;
+  bool truncated;
+
+  long deadline_ms;  // Monotonic time to send SIGTERM
+  long kill_at_ms;   // Monotonic time to send SIGKILL (0 if SIGTERM wasn't sent)
+  bool timed_out;
+
+  bool exited;
+  int exit_code;
+
+  struct child *next;
+} child;
+
+child *child_spawn(const char *command, long timeout_ms);
+bool child_done(child *c);
+void child_free(child *c);
+
+int supervisor_fd();
+void supervisor_wait(long timeout_ms);
+long supervisor_next_deadline();
+
+long monotonic_ms();
+
+#endif // PROCESS_H
@@ -0,0 +1,66 @@
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "queue.h"
+#include "cli_io.h"
+
+bool queue_init(spsc_queue *q) {
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+
+  if ((q->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+    ERROR("Unable to create the eventfd of a queue");
+    return false;
+  }
+  return true;
+}
+
+void queue_close(spsc_queue *q) {
+  if (q->event_fd != -1) close(q->event_fd);
+  q->event_fd = -1;
+}
+
+// Only from the producer. Returns false if the queue is full
+bool queue_push(spsc_queue *q, void *item) {
+  const size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  const size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  if (tail - head == QUEUE_CAPACITY) return false;
+
+  q->items[tail % QUEUE_CAPACITY] = item;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+  const uint64_t one = 1;
+  if (write(q->event_fd, &one, sizeof(one)) == -1) {} // Only fails if the counter overflows (it's already readable)
+  return true;
+}
+
+// Only from the consumer. Returns NULL if the queue is empty
+void *queue_pop(spsc_queue *q) {
+  const size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  const size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  if (head == tail) return NULL;
+
+  void *item = q->items[head % QUEUE_CAPACITY];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return item;
+}
+
+int queue_fd(spsc_queue *q) {
+  return q->event_fd;
+}
+
+// Should be called by the consumer before popping the items. Otherwise, a
+// wake up of an item pushed after the last pop could be lost
+void queue_clear_wakeup(spsc_queue *q) {
+  uint64_t count;
+  if (read(q->event_fd, &count, sizeof(count)) == -1) {} // Nothing to clear
+}
+
+// Blocks until there's something to pop (and clears the wake up)
+void queue_wait(spsc_queue *q) {
+  struct pollfd pfd = { .fd = q->event_fd, .events = POLLIN };
+  while (poll(&pfd, 1, -1) == -1);
+  queue_clear_wakeup(q);
+}
@@ -0,0 +1,29 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Should be a power of 2
+#define QUEUE_CAPACITY 256
+
+// Lock-free queue of pointers for one producer thread and one consumer
+// thread. The producer wakes up the consumer through an eventfd, so it can be
+// waited with poll()/epoll (queue_fd()) or with queue_wait()
+typedef struct {
+  void *items[QUEUE_CAPACITY];
+  _Atomic size_t head; // Next item to pop (only written by the consumer)
+  _Atomic size_t tail; // Next free slot (only written by the producer)
+  int event_fd;
+} spsc_queue;
+
+bool queue_init(spsc_queue *q);
+void queue_close(spsc_queue *q);
+bool queue_push(spsc_queue *q, void *item);
+void *queue_pop(spsc_queue *q);
+int queue_fd(spsc_queue *q);
+void queue_clear_wakeup(spsc_queue *q);
+void queue_wait(spsc_queue *q);
+
+#endif // QUEUE_H
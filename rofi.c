@@ -2,6 +2,50 @@
 #include "dynamic_string.h"
 #include "wakit.h"
 #include "cli_io.h"
+#include "display.h"
+#include "trace.h"
+
+static bool ask_rofi(const char *input, const char *display, string *selected) {
+  if (!input) return false;
+
+  // The prompts of different displays can be open at the same time
+  string temp_path = {0}, body = {0}, command = {0};
+  display_path(&temp_path, "/tmp/rofi_temp", display, ".wakit");
+  str_append(&body, "rofi -dmenu -i > ");
+  str_append(&body, temp_path.str);
+  display_command(&command, display, body.str);
+  const int ret = console_input(command.str, input);
+  str_free(&body);
+  str_free(&command);
+  if (ret) {
+    str_free(&temp_path);
+    return false;
+  }
+
+  char s[256] = {0};
+  FILE *file_select = fopen(temp_path.str, "r");
+  if (!file_select) {
+    str_free(&temp_path);
+    return false;
+  }
+  str_free(selected);
+  while (fgets(s, 256, file_select)) str_append(selected, s);
+  fclose(file_select);
+  if (remove(temp_path.str)) ERROR("Unable to remove the rofi temp file...");
+  str_free(&temp_path);
+  if (!selected->str_len) return false;
+  selected->str[--selected->str_len] = '\0'; // remove last '\n'
+  return true;
+}
+
+// Shows the lines of the input in the display (NULL for the one of the
+// environment) and returns the one selected
+bool ask_for_name(const char *input, const char *display, string *selected) {
+  trace_span span = trace_begin("rofi");
+  const bool answered = ask_rofi(input, display, selected);
+  trace_end(&span);
+  return answered;
+}
 
 cmd_node *ask_for_cmd(cmd_node *list) {
   if (!list) return NULL;
@@ -17,24 +61,9 @@ cmd_node *ask_for_cmd(cmd_node *list) {
 
     aux = aux->next;
   }
-  str_free(&name);
 
-  if (console_input("rofi -dmenu -i > /tmp/rofi_temp.wakit", input.str)) {
-    str_free(&input);
-    return NULL;
-  }
+  cmd_node *selected = (ask_for_name(input.str, NULL, &name)) ? search_cmd(list, name.str) : NULL;
   str_free(&input);
-
-  string str_select = {0};
-  char s[256] = {0};
-  FILE *file_select = fopen("/tmp/rofi_temp.wakit", "r");
-  if (!file_select) return NULL;
-  while (fgets(s, 256, file_select)) str_append(&str_select, s);
-  fclose(file_select);
-  if (remove("/tmp/rofi_temp.wakit")) ERROR("Unable to remove the rofi temp file...");
-  str_select.str[str_select.str_len-1] = '\0'; // remove last '\n'
-
-  cmd_node *selected = search_cmd(list, str_select.str);
-  str_free(&str_select);
+  str_free(&name);
   return selected;
 }
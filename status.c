@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "status.h"
+#include "wakit.h"
+#include "daemon.h"
+#include "cli_io.h"
+#include "display.h"
+#include "process.h"
+#include "dynamic_string.h"
+
+// Each change is sent as a line with tab separated fields:
+//   <timestamp (ms since epoch)>\t<app>\t<profile (empty if none)>\n
+// Backslashes, tabs and line breaks inside the fields are escaped (\\, \t, \n)
+static void append_escaped(string *s, const char *field) {
+  if (!field) return;
+
+  for (; *field; field++) {
+    switch (*field) {
+      case '\\': str_append(s, "\\\\"); break;
+      case '\t': str_append(s, "\\t");  break;
+      case '\n': str_append(s, "\\n");  break;
+      default:   str_append_char(s, *field);
+    }
+  }
+}
+
+static void unescape(char *field) {
+  char *to = field;
+  for (char *from = field; *from; from++) {
+    if (*from == '\\' && from[1]) {
+      from++;
+      *to++ = (*from == 't') ? '\t' : (*from == 'n') ? '\n' : *from;
+    } else {
+      *to++ = *from;
+    }
+  }
+  *to = '\0';
+}
+
+static void append_json_string(string *s, const char *field) {
+  if (!field) {
+    str_append(s, "null");
+    return;
+  }
+
+  str_append_char(s, '"');
+  for (; *field; field++) {
+    switch (*field) {
+      case '"':  str_append(s, "\\\""); break;
+      case '\\': str_append(s, "\\\\"); break;
+      case '\t': str_append(s, "\\t");  break;
+      case '\n': str_append(s, "\\n");  break;
+      default:
+        if ((unsigned char) *field < 0x20) {
+          char code[8];
+          snprintf(code, sizeof(code), "\\u%04x", *field);
+          str_append(s, code);
+        } else {
+          str_append_char(s, *field);
+        }
+    }
+  }
+  str_append_char(s, '"');
+}
+
+// Returns false if the path doesn't fit in the address
+static bool socket_address(struct sockaddr_un *addr, const char *path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) return false;
+
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+// The events of events_fd carry the slot of the client, or one of these
+#define LISTEN_EVENT STATUS_MAX_CLIENTS
+#define TIMER_EVENT (STATUS_MAX_CLIENTS + 1)
+
+static bool watch_event(status_publisher *p, int op, int fd, uint32_t events, uint32_t data) {
+  struct epoll_event event = { .events = events, .data.u32 = data };
+  return !epoll_ctl(p->events_fd, op, fd, &event);
+}
+
+// The display is NULL for the one of the environment
+bool status_init(status_publisher *p, const char *display) {
+  *p = (status_publisher) {0};
+  p->listen_fd = p->events_fd = p->timer_fd = -1;
+  for (int i=0; i<STATUS_MAX_CLIENTS; i++) p->clients[i].fd = -1;
+  display_path(&p->running_path, RUNNING_DAEMON_PREFIX, display, RUNNING_DAEMON_SUFFIX);
+
+  struct sockaddr_un addr;
+  if (!private_display_path(&p->socket_path, STATUS_SOCKET_PREFIX, display, STATUS_SOCKET_SUFFIX)) {
+    ERROR("Unable to create the directory of the status socket");
+    return false;
+  }
+  if (!socket_address(&addr, p->socket_path.str)) {
+    ERROR("The path of the status socket is too long");
+    return false;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    ERROR("Unable to create the status socket");
+    return false;
+  }
+
+  // The socket of a daemon that didn't close properly is replaced. Only the
+  // user can connect (its directory is also private)
+  unlink(p->socket_path.str);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || chmod(p->socket_path.str, 0600) || listen(fd, 4)) {
+    ERROR("Unable to listen in the status socket");
+    close(fd);
+    return false;
+  }
+  p->listen_fd = fd;
+
+  p->events_fd = epoll_create1(EPOLL_CLOEXEC);
+  p->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (p->events_fd == -1 || p->timer_fd == -1
+      || !watch_event(p, EPOLL_CTL_ADD, p->listen_fd, EPOLLIN, LISTEN_EVENT)
+      || !watch_event(p, EPOLL_CTL_ADD, p->timer_fd, EPOLLIN, TIMER_EVENT)
+  ) {
+    ERROR("Unable to watch the status socket");
+    return false;
+  }
+
+  return true;
+}
+
+static void remove_client(status_client *c) {
+  close(c->fd); // It's also removed from events_fd
+  str_free(&c->pending);
+  *c = (status_client) { .fd = -1 };
+}
+
+// Sends what the socket takes, and keeps the rest until it's writable again.
+// Returns false if the client should be dropped (closed or too slow)
+static bool flush_client(status_publisher *p, status_client *c) {
+  size_t sent = 0;
+  while (sent < c->pending.str_len) {
+    const ssize_t n = send(c->fd, c->pending.str + sent, c->pending.str_len - sent, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (n <= 0) return false;
+    sent += n;
+  }
+
+  if (sent) str_remove(&c->pending, 0, sent-1);
+  if (c->pending.str_len > STATUS_MAX_PENDING) return false;
+
+  // Its writes are only watched while something is pending
+  const uint32_t events = (c->pending.str_len) ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  return watch_event(p, EPOLL_CTL_MOD, c->fd, events, c - p->clients);
+}
+
+static bool send_client(status_publisher *p, status_client *c, const string *line) {
+  str_append(&c->pending, line->str);
+  return flush_client(p, c);
+}
+
+// The timer expires when the first request that is pending is late
+static void arm_request_timer(status_publisher *p) {
+  long deadline = 0;
+  for (int i=0; i<STATUS_MAX_CLIENTS; i++) {
+    const status_client *c = &p->clients[i];
+    if (c->fd != -1 && !c->subscribed && (!deadline || c->request_deadline_ms < deadline))
+      deadline = c->request_deadline_ms;
+  }
+
+  struct itimerspec spec = {0};
+  spec.it_value.tv_sec = deadline / 1000;
+  spec.it_value.tv_nsec = (deadline % 1000) * 1000000L;
+  timerfd_settime(p->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void accept_clients(status_publisher *p) {
+  int fd;
+  while ((fd = accept4(p->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    status_client *c = NULL;
+    for (int i=0; i<STATUS_MAX_CLIENTS && !c; i++) {
+      if (p->clients[i].fd == -1) c = &p->clients[i];
+    }
+    if (!c) {
+      DEBUG("Too many clients in the status socket. Rejecting the new one...");
+      close(fd);
+      continue;
+    }
+
+    *c = (status_client) { .fd = fd, .request_deadline_ms = monotonic_ms() + STATUS_REQUEST_TIMEOUT_MS };
+    if (!watch_event(p, EPOLL_CTL_ADD, fd, EPOLLIN, c - p->clients)) remove_client(c);
+  }
+}
+
+// Reads the request line of the client (the clients send it right after
+// connecting). Returns false if the client should be dropped
+static bool read_request(status_publisher *p, status_client *c, control_request *ret) {
+  while (true) {
+    char *end = c->request + c->request_len;
+    const ssize_t n = recv(c->fd, end, sizeof(c->request) - 1 - c->request_len, 0);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true; // The rest comes later
+    if (n <= 0) return false;
+
+    c->request_len += n;
+    c->request[c->request_len] = '\0';
+    char *line_end = strchr(end, '\n');
+    if (line_end) {
+      *line_end = '\0';
+      break;
+    }
+    if (c->request_len == sizeof(c->request) - 1) {
+      DEBUG("A client of the status socket didn't send a valid request");
+      return false;
+    }
+  }
+
+  if (!strcmp(c->request, STOP_REQUEST)) {
+    *ret = StopRequest;
+    return false;
+  }
+
+  if (strcmp(c->request, WATCH_REQUEST)) {
+    DEBUG("Unknown request in the status socket");
+    return false;
+  }
+
+  // The current state
+  c->subscribed = true;
+  return !p->last_line.str || send_client(p, c, &p->last_line);
+}
+
+// The subscribers don't send anything else, so it's only their end
+static bool read_subscriber(status_client *c) {
+  char buffer[64];
+  ssize_t n;
+  while ((n = recv(c->fd, buffer, sizeof(buffer), 0)) > 0 || (n == -1 && errno == EINTR));
+  return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Handles the events of the socket and its clients (it never blocks). Returns
+// the request of the clients that don't subscribe
+control_request status_handle_events(status_publisher *p) {
+  if (p->events_fd == -1) return NoRequest;
+
+  control_request ret = NoRequest;
+  struct epoll_event events[STATUS_MAX_CLIENTS + 2];
+  const int len = epoll_wait(p->events_fd, events, STATUS_MAX_CLIENTS + 2, 0);
+  for (int i=0; i<len; i++) {
+    const uint32_t data = events[i].data.u32;
+    if (data == LISTEN_EVENT) {
+      accept_clients(p);
+      continue;
+    }
+    if (data == TIMER_EVENT) {
+      uint64_t expirations;
+      while (read(p->timer_fd, &expirations, sizeof(expirations)) > 0);
+
+      const long now = monotonic_ms();
+      for (int j=0; j<STATUS_MAX_CLIENTS; j++) {
+        status_client *c = &p->clients[j];
+        if (c->fd != -1 && !c->subscribed && c->request_deadline_ms <= now) {
+          DEBUG("A client of the status socket didn't send its request in time");
+          remove_client(c);
+        }
+      }
+      continue;
+    }
+
+    status_client *c = &p->clients[data];
+    if (c->fd == -1) continue; // Dropped by a previous event
+
+    bool keep = true;
+    if (events[i].events & EPOLLOUT) keep = flush_client(p, c);
+    if (keep && events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      keep = (c->subscribed) ? read_subscriber(c) : read_request(p, c, &ret);
+    if (!keep) remove_client(c);
+  }
+
+  arm_request_timer(p);
+  return ret;
+}
+
+// The running file is replaced atomically (rename), so the readers never see
+// a partial write. It's in /tmp, so the temporary file has a unique name
+// (mkstemp) that others can't create first
+static void write_running_file(const char *path, const char *app, const char *profile) {
+  string text = {0}, tmp_path = {0};
+  str_append(&text, app);
+  str_append(&text, " | ");
+  str_append(&text, (profile) ? profile : "-no profile-");
+
+  FILE *f = open_temporary(path, &tmp_path);
+  if (!f) {
+    ERROR("Unable to update the running file...");
+    str_free(&text);
+    str_free(&tmp_path);
+    return;
+  }
+  const bool written = fwrite(text.str, text.str_len, 1, f) == 1;
+  str_free(&text);
+
+  if (fclose(f) || !written || rename(tmp_path.str, path)) {
+    ERROR("Unable to update the running file...");
+    remove(tmp_path.str);
+  }
+  str_free(&tmp_path);
+}
+
+// The profile is NULL if there isn't one
+void status_publish(status_publisher *p, const char *app, const char *profile) {
+  write_running_file(p->running_path.str, app, profile);
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  const long long timestamp = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+
+  char timestamp_str[32];
+  snprintf(timestamp_str, sizeof(timestamp_str), "%lld", timestamp);
+  str_replace(&p->last_line, timestamp_str);
+  str_append_char(&p->last_line, '\t');
+  append_escaped(&p->last_line, app);
+  str_append_char(&p->last_line, '\t');
+  append_escaped(&p->last_line, profile);
+  str_append_char(&p->last_line, '\n');
+
+  // The subscribers that are closed or too slow are dropped
+  for (int i=0; i<STATUS_MAX_CLIENTS; i++) {
+    status_client *c = &p->clients[i];
+    if (c->fd != -1 && c->subscribed && !send_client(p, c, &p->last_line)) remove_client(c);
+  }
+}
+
+void status_close(status_publisher *p) {
+  for (int i=0; i<STATUS_MAX_CLIENTS; i++) {
+    if (p->clients[i].fd != -1) remove_client(&p->clients[i]);
+  }
+
+  if (p->listen_fd != -1) {
+    close(p->listen_fd);
+    unlink(p->socket_path.str);
+    p->listen_fd = -1;
+  }
+  if (p->events_fd != -1) close(p->events_fd);
+  if (p->timer_fd != -1) close(p->timer_fd);
+  p->events_fd = p->timer_fd = -1;
+
+  if (p->running_path.str && remove(p->running_path.str) && errno != ENOENT)
+    ERROR("Unable to remove the running file...");
+
+  str_free(&p->last_line);
+  str_free(&p->socket_path);
+  str_free(&p->running_path);
+}
+
+// Connects to the daemon of the display and sends the request. Returns -1 if
+// the daemon isn't running
+static int send_request(const char *display, const char *request) {
+  string path = {0};
+  struct sockaddr_un addr;
+  const bool valid = private_display_path(&path, STATUS_SOCKET_PREFIX, display, STATUS_SOCKET_SUFFIX)
+                     && socket_address(&addr, path.str);
+  str_free(&path);
+  if (!valid) return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) return -1;
+
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+
+  string line = {0};
+  str_append(&line, request);
+  str_append_char(&line, '\n');
+  const bool sent = (send(fd, line.str, line.str_len, MSG_NOSIGNAL) == (ssize_t) line.str_len);
+  str_free(&line);
+  if (!sent) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Returns false if the daemon of the display isn't running
+bool request_daemon_stop(const char *display) {
+  const int fd = send_request(display, STOP_REQUEST);
+  if (fd == -1) return false;
+
+  close(fd);
+  return true;
+}
+
+// Prints a line for each change of the daemon's state until the daemon is
+// closed. The line is tab separated (timestamp, app and profile) or a JSON
+// object with '--json'. The daemon is the one of $DISPLAY, or the one of the
+// display given with '--display <name>'
+int watch_status(int argc, char *argv[]) {
+  bool json = false;
+  const char *display = NULL;
+  for (int i=0; i<argc; i++) {
+    if (!strcmp(argv[i], "--json")) {
+      json = true;
+    } else if (!strcmp(argv[i], "--display") && i+1 < argc) {
+      display = argv[++i];
+    } else {
+      string err = {0};
+      str_append(&err, "Unrecognized option for 'watch' mode: ");
+      str_append(&err, argv[i]);
+      ERROR(err.str);
+      str_free(&err);
+      return 1;
+    }
+  }
+
+  const int fd = send_request(display, WATCH_REQUEST);
+  if (fd == -1) {
+    ERROR("Unable to connect to the daemon. Is it running?");
+    return 1;
+  }
+
+  FILE *f = fdopen(fd, "r");
+  string line = {0}, out = {0};
+  char buffer[256];
+  while (fgets(buffer, sizeof(buffer), f)) {
+    str_append(&line, buffer);
+    if (line.str[line.str_len-1] != '\n') continue; // Incomplete line
+    line.str[--line.str_len] = '\0';
+
+    // The line is printed as it was received (tab separated and escaped)
+    if (!json) {
+      printf("%s\n", line.str);
+      fflush(stdout);
+      str_free(&line);
+      continue;
+    }
+
+    char *app = strchr(line.str, '\t');
+    char *profile = (app) ? strchr(app+1, '\t') : NULL;
+    if (!profile) {
+      str_free(&line);
+      continue;
+    }
+    *(app++) = '\0';
+    *(profile++) = '\0';
+    unescape(app);
+    unescape(profile);
+
+    str_replace(&out, "{\"timestamp\":");
+    str_append(&out, line.str);
+    str_append(&out, ",\"app\":");
+    append_json_string(&out, app);
+    str_append(&out, ",\"profile\":");
+    append_json_string(&out, (*profile) ? profile : NULL);
+    str_append(&out, "}");
+    printf("%s\n", out.str);
+    fflush(stdout);
+    str_free(&line);
+  }
+
+  fclose(f);
+  str_free(&line);
+  str_free(&out);
+  return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <stdbool.h>
+
+#include "dynamic_string.h"
+
+// Each display has its own socket, in the private directory of the user (see
+// display.h)
+#define STATUS_SOCKET_PREFIX "status"
+#define STATUS_SOCKET_SUFFIX ".sock"
+#define STATUS_MAX_CLIENTS 16
+// Time that a new client has to send its request (ms)
+#define STATUS_REQUEST_TIMEOUT_MS 100
+#define STATUS_MAX_REQUEST 32
+// The lines that a subscriber didn't read yet are kept up to this size. After
+// that, it's dropped
+#define STATUS_MAX_PENDING 4096
+
+// The clients of the status socket send one request line after connecting:
+//   watch --> Subscribe to the state changes ('wakit --watch')
+//   stop  --> Close the daemon ('wakit -d' while it's running)
+#define WATCH_REQUEST "watch"
+#define STOP_REQUEST "stop"
+
+typedef enum {
+  NoRequest,
+  StopRequest
+} control_request;
+
+typedef struct {
+  int fd; // -1 if the slot is free
+  bool subscribed;
+
+  // Until the request line is complete
+  char request[STATUS_MAX_REQUEST];
+  int request_len;
+  long request_deadline_ms; // Monotonic
+
+  string pending; // The part of the lines that didn't fit in the socket
+} status_client;
+
+// Publishes the state of the daemon (app and profile) to the running file and
+// to the subscribers connected to the status socket ('wakit --watch') of its
+// display. The clients never block the daemon: the socket and the clients are
+// watched by events_fd (an epoll instance, readable when any of them has
+// something), and status_handle_events() handles them
+typedef struct {
+  string socket_path;
+  string running_path;
+
+  int listen_fd;
+  int events_fd;
+  int timer_fd; // Expires when the request of a client is late
+  status_client clients[STATUS_MAX_CLIENTS];
+
+  string last_line; // Sent to the new subscribers
+} status_publisher;
+
+bool status_init(status_publisher *p, const char *display);
+control_request status_handle_events(status_publisher *p);
+void status_publish(status_publisher *p, const char *app, const char *profile);
+void status_close(status_publisher *p);
+
+bool request_daemon_stop(const char *display);
+int watch_status(int argc, char *argv[]);
+
+#endif // STATUS_H
@@ -0,0 +1,427 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tablet.h"
+#include "cli_io.h"
+#include "display.h"
+#include "dynamic_string.h"
+#include "trace.h"
+
+// The devices are cached in memory and in this file (for the next wakit
+// processes). The cache is valid while /dev/input doesn't change, as its
+// modification time changes every time a device is plugged or unplugged.
+// Each display has its own cache, in the private directory of the user (see
+// display.h), as the names of the devices are put in the commands
+#define DEVICES_CACHE_PREFIX "devices"
+#define DEVICES_CACHE_SUFFIX ".wakit"
+
+static const char *class_names[] = { "stylus", "eraser", "pad", "touch", "cursor", "unknown" };
+
+static struct {
+  tablet_device *devices;
+  int len;
+  bool valid;
+  struct timespec input_mtime;
+  string display; // Of the devices cached
+} cache = {0};
+
+const char *device_class_name(device_class class) {
+  return class_names[class];
+}
+
+static device_class parse_class(const char *name) {
+  for (int i=0; i<UnknownDevice; i++) {
+    if (!strcasecmp(name, class_names[i])) return i;
+  }
+  return UnknownDevice;
+}
+
+static void free_devices() {
+  for (int i=0; i<cache.len; i++) str_free(&cache.devices[i].name);
+  free(cache.devices);
+  cache.devices = NULL;
+  cache.len = 0;
+  cache.valid = false;
+}
+
+void invalidate_tablet_devices(const char *display) {
+  free_devices();
+
+  string path = {0};
+  if (private_display_path(&path, DEVICES_CACHE_PREFIX, display, DEVICES_CACHE_SUFFIX))
+    remove(path.str);
+  str_free(&path);
+}
+
+static bool add_device(const char *name, int id, device_class class) {
+  tablet_device *devices = realloc(cache.devices, sizeof(tablet_device) * (cache.len+1));
+  if (!devices) return false;
+
+  cache.devices = devices;
+  cache.devices[cache.len] = (tablet_device) { .name = {0}, .id = id, .class = class };
+  str_append(&cache.devices[cache.len].name, name);
+  cache.len++;
+  return true;
+}
+
+// Parses the output of 'xsetwacom --list devices'. Each line is:
+//   <name> \tid: <id>\ttype: <class>
+static bool parse_xsetwacom_list(char *output) {
+  char *line = output;
+  while (line && *line) {
+    char *next = strchr(line, '\n');
+    if (next) *(next++) = '\0';
+
+    char *id = strstr(line, "\tid: ");
+    char *type = (id) ? strstr(id, "\ttype: ") : NULL;
+    if (type) {
+      // Trailing spaces of the name and the type
+      for (char *end = id-1; end >= line && *end == ' '; end--) *end = '\0';
+      *id = '\0';
+      id += strlen("\tid: ");
+      *type = '\0';
+      type += strlen("\ttype: ");
+      for (char *end = type+strlen(type)-1; end >= type && *end == ' '; end--) *end = '\0';
+
+      if (!add_device(line, atoi(id), parse_class(type))) return false;
+    }
+
+    line = next;
+  }
+
+  return true;
+}
+
+static bool read_devices_cache(const char *path, struct timespec input_mtime) {
+  // Only a file of the user is trusted
+  const int fd = open(path, O_RDONLY | O_NOFOLLOW);
+  if (fd == -1) return false;
+  struct stat st;
+  FILE *f = NULL;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != getuid() || !(f = fdopen(fd, "r"))) {
+    close(fd);
+    return false;
+  }
+
+  long sec, nsec;
+  if (fscanf(f, "%ld %ld\n", &sec, &nsec) != 2
+      || sec != input_mtime.tv_sec || nsec != input_mtime.tv_nsec
+  ) {
+    fclose(f);
+    return false;
+  }
+
+  // <id>\t<class>\t<name>
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = '\0';
+    char *class = strchr(line, '\t');
+    char *name = (class) ? strchr(class+1, '\t') : NULL;
+    if (!name) continue;
+    *(class++) = '\0';
+    *(name++) = '\0';
+
+    if (!add_device(name, atoi(line), parse_class(class))) {
+      fclose(f);
+      free_devices();
+      return false;
+    }
+  }
+
+  fclose(f);
+  return true;
+}
+
+static void write_devices_cache(const char *path, struct timespec input_mtime) {
+  string tmp_path = {0};
+  str_append(&tmp_path, path);
+  str_append(&tmp_path, ".XXXXXX");
+
+  const int fd = mkstemp(tmp_path.str);
+  FILE *f = (fd != -1) ? fdopen(fd, "w") : NULL;
+  if (!f) {
+    if (fd != -1) {
+      close(fd);
+      remove(tmp_path.str);
+    }
+    str_free(&tmp_path);
+    return;
+  }
+
+  fprintf(f, "%ld %ld\n", (long) input_mtime.tv_sec, (long) input_mtime.tv_nsec);
+  for (int i=0; i<cache.len; i++)
+    fprintf(f, "%d\t%s\t%s\n", cache.devices[i].id, class_names[cache.devices[i].class], cache.devices[i].name.str);
+  if (fclose(f) || rename(tmp_path.str, path)) remove(tmp_path.str);
+  str_free(&tmp_path);
+}
+
+// It changes every time a device is plugged or unplugged
+struct timespec input_devices_mtime() {
+  struct stat input_dir = {0};
+  stat(INPUT_DEVICES_DIR, &input_dir);
+  return input_dir.st_mtim;
+}
+
+// Returns the amount of devices of the display discovered (the array shouldn't
+// be freed). The display is NULL for the one of the environment
+int get_tablet_devices(const char *display, tablet_device **devices) {
+  const struct timespec input_mtime = input_devices_mtime();
+  const char *name = display_name(display);
+  const bool same_display = (!name) ? !cache.display.str : (cache.display.str && !strcmp(cache.display.str, name));
+
+  if (cache.valid
+      && same_display
+      && cache.input_mtime.tv_sec == input_mtime.tv_sec
+      && cache.input_mtime.tv_nsec == input_mtime.tv_nsec
+  ) {
+    *devices = cache.devices;
+    return cache.len;
+  }
+
+  free_devices();
+  string path = {0};
+  const bool has_path = private_display_path(&path, DEVICES_CACHE_PREFIX, display, DEVICES_CACHE_SUFFIX);
+  if (!has_path || !read_devices_cache(path.str, input_mtime)) {
+    string command = {0}, output = {0};
+    display_command(&command, display, "xsetwacom --list devices 2> /dev/null");
+    if (!console_output(command.str, &output) && output.str)
+      parse_xsetwacom_list(output.str);
+    str_free(&command);
+    str_free(&output);
+
+    if (has_path) write_devices_cache(path.str, input_mtime);
+  }
+  str_free(&path);
+
+  str_free(&cache.display);
+  if (name) str_append(&cache.display, name);
+  cache.valid = true;
+  cache.input_mtime = input_mtime;
+  *devices = cache.devices;
+  return cache.len;
+}
+
+static bool device_in_target(tablet_device *device, const char *target) {
+  if (!strcasecmp(target, "all")) return true;
+
+  const device_class class = parse_class(target);
+  if (class != UnknownDevice) return (device->class == class);
+
+  char *end = NULL;
+  const long id = strtol(target, &end, 10);
+  if (*target && !*end) return (device->id == id);
+
+  return !strcmp(device->name.str, target);
+}
+
+// Target of the first placeholder of the command (or NULL if there isn't one).
+// It should be freed
+static char *first_target(const char *command, bool *mixed) {
+  char *target = NULL;
+  *mixed = false;
+
+  const char *aux = command;
+  while ( (aux = strstr(aux, "%TabletID")) ) {
+    char *current = NULL;
+    if (!strncmp(aux, MODEL_PLACEHOLDER, strlen(MODEL_PLACEHOLDER))) {
+      current = strdup(DEFAULT_TARGET);
+      aux += strlen(MODEL_PLACEHOLDER);
+    } else if (!strncmp(aux, MODEL_PLACEHOLDER_PREFIX, strlen(MODEL_PLACEHOLDER_PREFIX))) {
+      aux += strlen(MODEL_PLACEHOLDER_PREFIX);
+      const char *end = strchr(aux, '%');
+      if (!end) break;
+      current = strndup(aux, end-aux);
+      aux = end+1;
+    } else {
+      aux++;
+      continue;
+    }
+
+    if (!target) {
+      target = current;
+    } else {
+      if (strcmp(target, current)) *mixed = true;
+      free(current);
+    }
+  }
+
+  return target;
+}
+
+// Replaces every placeholder of the command. Each placeholder is replaced by
+// 'device' if it's in the target of 'device', otherwise it's replaced by the
+// first device of its target.
+static void replace_placeholders(string *command, tablet_device *devices, int len, tablet_device *device) {
+  string quoted = {0};
+
+  char *aux;
+  while ( (aux = strstr(command->str, "%TabletID")) ) {
+    const int pos = aux - command->str;
+    char *target = NULL;
+    int placeholder_len;
+    if (!strncmp(aux, MODEL_PLACEHOLDER, strlen(MODEL_PLACEHOLDER))) {
+      target = strdup(DEFAULT_TARGET);
+      placeholder_len = strlen(MODEL_PLACEHOLDER);
+    } else {
+      char *start = aux + strlen(MODEL_PLACEHOLDER_PREFIX);
+      char *end = strchr(start, '%');
+      if (strncmp(aux, MODEL_PLACEHOLDER_PREFIX, strlen(MODEL_PLACEHOLDER_PREFIX)) || !end) break;
+      target = strndup(start, end-start);
+      placeholder_len = end+1 - aux;
+    }
+
+    const char *name = NULL;
+    if (device && device_in_target(device, target)) {
+      name = device->name.str;
+    } else {
+      for (int i=0; i<len && !name; i++) {
+        if (device_in_target(&devices[i], target)) name = devices[i].name.str;
+      }
+    }
+    if (!name) name = TABLET_MODEL;
+    free(target);
+
+    // Quoted for the shell, like the display in display_command()
+    str_replace(&quoted, "'");
+    for (const char *c = name; *c; c++) {
+      if (*c == '\'') str_append(&quoted, "'\\''");
+      else str_append_char(&quoted, *c);
+    }
+    str_append(&quoted, "'");
+    str_remove(command, pos, pos+placeholder_len-1);
+    str_insert_at(command, pos, quoted.str);
+  }
+
+  str_free(&quoted);
+}
+
+static int expand_placeholders(const char *command, const char *display, string **commands) {
+  *commands = NULL;
+  if (!command) return -1;
+
+  bool mixed;
+  char *target = first_target(command, &mixed);
+
+  tablet_device *devices = NULL;
+  const int devices_len = (target) ? get_tablet_devices(display, &devices) : 0;
+
+  // Devices of the target
+  int len = 0;
+  if (target && !mixed) {
+    for (int i=0; i<devices_len; i++) {
+      if (device_in_target(&devices[i], target)) len++;
+    }
+  }
+  free(target);
+
+  if (len <= 1) {
+    *commands = calloc(1, sizeof(string));
+    if (!*commands) return -1;
+    str_append(*commands, command);
+    if ((*commands)->str) replace_placeholders(*commands, devices, devices_len, NULL);
+    return 1;
+  }
+
+  *commands = calloc(len, sizeof(string));
+  if (!*commands) return -1;
+  target = first_target(command, &mixed);
+  for (int i=0, j=0; i<devices_len; i++) {
+    if (!device_in_target(&devices[i], target)) continue;
+
+    str_append(&(*commands)[j], command);
+    replace_placeholders(&(*commands)[j], devices, devices_len, &devices[i]);
+    j++;
+  }
+  free(target);
+
+  return len;
+}
+
+static bool add_name(const char ***names, int *len, const char *name) {
+  for (int i=0; i<*len; i++) {
+    if (!strcmp((*names)[i], name)) return true;
+  }
+
+  const char **aux = realloc(*names, sizeof(char *) * (*len+1));
+  if (!aux) return false;
+  *names = aux;
+  (*names)[(*len)++] = name;
+  return true;
+}
+
+// The names of the devices that the placeholders of the command can be
+// replaced by (every device of each target, or TABLET_MODEL if a target
+// doesn't have any). The array should be freed, but not its strings (they're
+// valid until the devices are discovered again).
+//
+// Returns the amount of devices, or -1 on error
+int command_device_names(const char *command, const char *display, const char ***names) {
+  *names = NULL;
+  int len = 0;
+  tablet_device *devices = NULL;
+  int devices_len = -1;
+
+  const char *aux = command;
+  while (aux && (aux = strstr(aux, "%TabletID"))) {
+    char *target = NULL;
+    if (!strncmp(aux, MODEL_PLACEHOLDER, strlen(MODEL_PLACEHOLDER))) {
+      target = strdup(DEFAULT_TARGET);
+      aux += strlen(MODEL_PLACEHOLDER);
+    } else if (!strncmp(aux, MODEL_PLACEHOLDER_PREFIX, strlen(MODEL_PLACEHOLDER_PREFIX))) {
+      aux += strlen(MODEL_PLACEHOLDER_PREFIX);
+      const char *end = strchr(aux, '%');
+      if (!end) break;
+      target = strndup(aux, end-aux);
+      aux = end+1;
+    } else {
+      aux++;
+      continue;
+    }
+    if (!target) break;
+
+    if (devices_len == -1) devices_len = get_tablet_devices(display, &devices);
+    bool found = false, ok = true;
+    for (int i=0; ok && i<devices_len; i++) {
+      if (!device_in_target(&devices[i], target)) continue;
+      found = true;
+      ok = add_name(names, &len, devices[i].name.str);
+    }
+    if (ok && !found) ok = add_name(names, &len, TABLET_MODEL);
+    free(target);
+
+    if (!ok) {
+      free(*names);
+      *names = NULL;
+      return -1;
+    }
+  }
+
+  return len;
+}
+
+// Creates a command for each device of the target of the command, so they can
+// be run in parallel. If the command doesn't use the device, or it mixes
+// different targets, only one command is created. The devices are the ones of
+// the display (NULL for the one of the environment).
+//
+// Returns the amount of commands (they should be freed with free_commands()),
+// or -1 on error
+int expand_tablet_placeholders(const char *command, const char *display, string **commands) {
+  trace_span span = trace_begin("expand_tablet_placeholders");
+  const int len = expand_placeholders(command, display, commands);
+  trace_end(&span);
+  return len;
+}
+
+void free_commands(string **commands, int len) {
+  if (!*commands) return;
+
+  for (int i=0; i<len; i++) str_free(&(*commands)[i]);
+  free(*commands);
+  *commands = NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef TABLET_H
+#define TABLET_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "dynamic_string.h"
+
+// Used when the devices can't be discovered
+#define TABLET_MODEL "Wacom One by Wacom S Pen stylus"
+
+// Placeholders of the device inside the commands:
+//   %TabletID%          --> Every stylus
+//   %TabletID:<target>% --> The devices of the target: 'all', a class ('stylus',
+//                           'eraser', 'pad', 'touch' or 'cursor'), the id of a
+//                           device or its name
+#define MODEL_PLACEHOLDER "%TabletID%"
+#define MODEL_PLACEHOLDER_PREFIX "%TabletID:"
+#define DEFAULT_TARGET "stylus"
+
+// Its modification time changes every time a device is plugged or unplugged
+#define INPUT_DEVICES_DIR "/dev/input"
+
+typedef enum {
+  Stylus,
+  Eraser,
+  Pad,
+  Touch,
+  Cursor,
+  UnknownDevice
+} device_class;
+
+typedef struct {
+  string name;
+  int id;
+  device_class class;
+} tablet_device;
+
+int get_tablet_devices(const char *display, tablet_device **devices);
+void invalidate_tablet_devices(const char *display);
+struct timespec input_devices_mtime();
+const char *device_class_name(device_class class);
+
+int expand_tablet_placeholders(const char *command, const char *display, string **commands);
+int command_device_names(const char *command, const char *display, const char ***names);
+void free_commands(string **commands, int len);
+
+#endif // TABLET_H
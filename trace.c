@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "cli_io.h"
+#include "dynamic_string.h"
+
+bool tracing = false;
+
+// A span, or the name of a thread (metadata)
+typedef struct {
+  const char *name;
+  long long start_ns, end_ns;
+  int tid;
+  bool thread_name;
+  _Atomic bool done; // It can be written (the slot is filled)
+} trace_event;
+
+// The slots are taken with an atomic counter, so the threads never wait for
+// each other
+static trace_event *events = NULL;
+static _Atomic size_t events_len = 0;
+static string trace_path = {0};
+
+static _Thread_local int thread_id = 0;
+
+long long trace_now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int current_tid() {
+  if (!thread_id) thread_id = syscall(SYS_gettid);
+  return thread_id;
+}
+
+static trace_event *take_slot() {
+  const size_t i = atomic_fetch_add_explicit(&events_len, 1, memory_order_relaxed);
+  return (i < TRACE_CAPACITY) ? &events[i] : NULL;
+}
+
+void trace_record(const char *name, long long start_ns, long long end_ns) {
+  trace_event *e = take_slot();
+  if (!e) return;
+
+  e->name = name;
+  e->start_ns = start_ns;
+  e->end_ns = end_ns;
+  e->tid = current_tid();
+  e->thread_name = false;
+  atomic_store_explicit(&e->done, true, memory_order_release);
+}
+
+// Shown instead of the id of the thread
+void trace_thread_name(const char *name) {
+  if (!tracing) return;
+
+  trace_event *e = take_slot();
+  if (!e) return;
+
+  e->name = name;
+  e->tid = current_tid();
+  e->thread_name = true;
+  atomic_store_explicit(&e->done, true, memory_order_release);
+}
+
+static void write_at_exit() {
+  trace_write();
+}
+
+// Enables the tracing if WAKIT_TRACE has the path of the trace
+void trace_init() {
+  const char *path = getenv(TRACE_ENV);
+  if (!path || !*path || tracing) return;
+
+  if ( !(events = calloc(TRACE_CAPACITY, sizeof(trace_event))) ) {
+    ERROR("Unable to allocate the trace buffer. Continuing without tracing...");
+    return;
+  }
+
+  str_append(&trace_path, path);
+  string pid = {0};
+  str_append_int(&pid, getpid());
+  str_search_and_replace(&trace_path, "%p", pid.str);
+  str_free(&pid);
+
+  tracing = true;
+  atexit(write_at_exit);
+}
+
+// Writes every span recorded up to now (the file is replaced). The
+// timestamps are in microseconds
+bool trace_write() {
+  if (!tracing) return false;
+
+  string tmp_path = {0};
+  str_append(&tmp_path, trace_path.str);
+  str_append(&tmp_path, ".tmp");
+
+  FILE *f = fopen(tmp_path.str, "w");
+  if (!f) {
+    ERROR("Unable to write the trace");
+    str_free(&tmp_path);
+    return false;
+  }
+
+  size_t len = atomic_load_explicit(&events_len, memory_order_relaxed);
+  if (len > TRACE_CAPACITY) len = TRACE_CAPACITY;
+
+  const int pid = getpid();
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"wakit\"}}", pid, pid);
+  for (size_t i=0; i<len; i++) {
+    trace_event *e = &events[i];
+    if (!atomic_load_explicit(&e->done, memory_order_acquire)) continue; // Still being filled
+
+    if (e->thread_name) {
+      fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+              pid, e->tid, e->name);
+    } else {
+      fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"wakit\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+              e->name, pid, e->tid, e->start_ns / 1000.0, (e->end_ns - e->start_ns) / 1000.0);
+    }
+  }
+  fprintf(f, "\n]}\n");
+
+  bool ok = !ferror(f);
+  if (fclose(f)) ok = false;
+  if (ok && rename(tmp_path.str, trace_path.str)) ok = false;
+  if (!ok) {
+    ERROR("Unable to write the trace");
+    remove(tmp_path.str);
+  }
+
+  const size_t dropped = atomic_load_explicit(&events_len, memory_order_relaxed);
+  if (dropped > TRACE_CAPACITY) DEBUG("The trace buffer is full. The last spans were dropped");
+
+  str_free(&tmp_path);
+  return ok;
+}
@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+
+// Tracing of the activity of wakit (loading the list, running the commands,
+// the prompts...), to see where the time of a slow switch goes. It's enabled
+// with the path of the trace in WAKIT_TRACE ('%p' is replaced by the pid):
+//   WAKIT_TRACE=/tmp/wakit-%p.json ./wakit -d
+// The spans are kept in memory and written as Chrome Trace Event JSON (it can
+// be opened in Perfetto or chrome://tracing) when wakit exits, or when the
+// daemon receives SIGUSR1.
+//
+// Without WAKIT_TRACE, a span only costs a check of 'tracing'.
+#define TRACE_ENV "WAKIT_TRACE"
+#define TRACE_CAPACITY 65536 // Spans kept (the next ones are dropped)
+
+typedef struct {
+  const char *name; // Static string
+  long long start_ns;
+} trace_span;
+
+extern bool tracing;
+
+long long trace_now_ns();
+void trace_record(const char *name, long long start_ns, long long end_ns);
+
+static inline trace_span trace_begin(const char *name) {
+  trace_span span = { .name = name, .start_ns = 0 };
+  if (tracing) span.start_ns = trace_now_ns();
+  return span;
+}
+
+static inline void trace_end(trace_span *span) {
+  if (span->start_ns) trace_record(span->name, span->start_ns, trace_now_ns());
+}
+
+void trace_init();
+void trace_thread_name(const char *name);
+bool trace_write();
+
+#endif // TRACE_H
@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "usage.h"
+#include "cli_io.h"
+
+// FNV-1a (0 marks the free slots)
+static uint64_t hash_name(const char *name) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *name; name++) {
+    hash ^= (unsigned char) *name;
+    hash *= 1099511628211ULL;
+  }
+  return (hash) ? hash : 1;
+}
+
+void usage_init(usage_store *store) {
+  *store = (usage_store) {0};
+}
+
+void usage_free(usage_store *store) {
+  free(store->slots);
+  *store = (usage_store) {0};
+}
+
+// The slot of the hash, or the free slot where it should be inserted
+static usage_entry *find_slot(usage_entry *slots, size_t capacity, uint64_t hash) {
+  size_t i = hash & (capacity - 1);
+  while (slots[i].name_hash && slots[i].name_hash != hash) i = (i + 1) & (capacity - 1);
+  return &slots[i];
+}
+
+// The capacity is always a power of 2 and the table is kept under 3/4 full
+static bool grow(usage_store *store) {
+  const size_t capacity = (store->capacity) ? store->capacity * 2 : USAGE_INITIAL_CAPACITY;
+  usage_entry *slots = calloc(capacity, sizeof(usage_entry));
+  if (!slots) return false;
+
+  for (size_t i=0; i<store->capacity; i++) {
+    if (store->slots[i].name_hash) *find_slot(slots, capacity, store->slots[i].name_hash) = store->slots[i];
+  }
+
+  free(store->slots);
+  store->slots = slots;
+  store->capacity = capacity;
+  return true;
+}
+
+static bool insert_entry(usage_store *store, usage_entry entry) {
+  if ((store->len + 1) * 4 > store->capacity * 3 && !grow(store)) return false;
+
+  usage_entry *slot = find_slot(store->slots, store->capacity, entry.name_hash);
+  if (!slot->name_hash) store->len++;
+  *slot = entry;
+  return true;
+}
+
+// Counts a use of the command now. The decayed score is increased by 1:
+//   rank = log2(2^(rank - now/H) + 1) + now/H
+bool usage_record(usage_store *store, const char *name) {
+  const uint64_t hash = hash_name(name);
+  const double now = (double) time(NULL) / USAGE_HALF_LIFE_S;
+
+  usage_entry entry = { .name_hash = hash };
+  if (store->len) {
+    usage_entry *slot = find_slot(store->slots, store->capacity, hash);
+    if (slot->name_hash) entry = *slot;
+  }
+
+  const double score = (entry.count) ? exp2(entry.rank - now) : 0;
+  entry.rank = log2(score + 1) + now;
+  entry.count++;
+  entry.last_used = time(NULL);
+  return insert_entry(store, entry);
+}
+
+// -INFINITY for the commands that weren't used
+double usage_rank(usage_store *store, const char *name) {
+  if (!store->len) return -INFINITY;
+
+  usage_entry *slot = find_slot(store->slots, store->capacity, hash_name(name));
+  return (slot->name_hash) ? slot->rank : -INFINITY;
+}
+
+/// Files ///
+
+bool get_share_path(string *path, const char *file_name) {
+  const char *home = getenv("HOME");
+  if (!home) return false;
+
+  str_append(path, home);
+  str_append(path, "/.local/share/");
+  str_append(path, file_name);
+  return true;
+}
+
+// The usage is saved by every wakit that runs a command (the menu, the
+// daemon, ...), so it's loaded and saved under a lock. It's taken on a
+// separate file, as the usage file is replaced on each save. Returns the
+// file descriptor of the lock (-1 on error)
+static int lock_usage() {
+  string path = {0};
+  if (!get_share_path(&path, USAGE_FILE_NAME)) return -1;
+  str_append(&path, ".lock");
+  const int fd = open(path.str, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  str_free(&path);
+  if (fd == -1) return -1;
+
+  struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+  while (fcntl(fd, F_OFD_SETLKW, &lock)) {
+    if (errno != EINTR) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+static bool read_usage_header(FILE *f, uint64_t *generation) {
+  char magic[sizeof(USAGE_MAGIC) - 1];
+  return fread(magic, sizeof(magic), 1, f)
+         && !memcmp(magic, USAGE_MAGIC, sizeof(magic))
+         && fread(generation, sizeof(uint64_t), 1, f);
+}
+
+// File format: USAGE_MAGIC, the generation (uint64_t) and the entries (hash,
+// count, last use and rank)
+bool usage_load(usage_store *store) {
+  string path = {0};
+  if (!get_share_path(&path, USAGE_FILE_NAME)) return false;
+
+  FILE *f = fopen(path.str, "rb");
+  str_free(&path);
+  if (!f) return true; // Nothing saved yet
+
+  usage_entry entry;
+  bool ok = read_usage_header(f, &store->generation);
+  while (ok && fread(&entry.name_hash, sizeof(uint64_t), 1, f)) {
+    if ( !fread(&entry.count, sizeof(uint32_t), 1, f)
+         || !fread(&entry.last_used, sizeof(uint32_t), 1, f)
+         || !fread(&entry.rank, sizeof(double), 1, f)
+         || !entry.name_hash
+    ) {
+      ok = false;
+      break;
+    }
+    insert_entry(store, entry);
+  }
+  if (!ok) ERROR("The file of the usage of the commands is corrupted. Ignoring the rest of it...");
+
+  fclose(f);
+  return ok;
+}
+
+// The file is replaced atomically (rename). The commands that weren't used
+// for a long time are dropped
+bool usage_save(usage_store *store) {
+  string path = {0}, tmp_path = {0};
+  if (!get_share_path(&path, USAGE_FILE_NAME)) return false;
+
+  // The generation of the file may be newer (saved by another wakit)
+  FILE *f = fopen(path.str, "rb");
+  uint64_t generation = 0;
+  if (f) {
+    if (read_usage_header(f, &generation) && generation > store->generation) store->generation = generation;
+    fclose(f);
+  }
+  store->generation++;
+
+  const double now = (double) time(NULL) / USAGE_HALF_LIFE_S;
+  f = open_temporary(path.str, &tmp_path);
+  bool ok = f && fwrite(USAGE_MAGIC, sizeof(USAGE_MAGIC) - 1, 1, f)
+            && fwrite(&store->generation, sizeof(uint64_t), 1, f);
+  for (size_t i=0; ok && i<store->capacity; i++) {
+    usage_entry *entry = &store->slots[i];
+    if (!entry->name_hash || entry->rank - now < USAGE_MIN_LOG_SCORE) continue;
+
+    ok = fwrite(&entry->name_hash, sizeof(uint64_t), 1, f)
+         && fwrite(&entry->count, sizeof(uint32_t), 1, f)
+         && fwrite(&entry->last_used, sizeof(uint32_t), 1, f)
+         && fwrite(&entry->rank, sizeof(double), 1, f);
+  }
+  if (f && fclose(f)) ok = false;
+  if (ok && rename(tmp_path.str, path.str)) ok = false;
+
+  if (!ok) {
+    ERROR("Unable to save the usage of the commands");
+    if (tmp_path.str) remove(tmp_path.str);
+  }
+  str_free(&path);
+  str_free(&tmp_path);
+  return ok;
+}
+
+// Records the use in the file. It's locked from the load to the save, so the
+// uses recorded by other wakits meanwhile aren't lost
+bool record_command_use(const char *name) {
+  const int lock_fd = lock_usage();
+  if (lock_fd == -1) {
+    ERROR("Unable to lock the usage of the commands");
+    return false;
+  }
+
+  usage_store store;
+  usage_init(&store);
+  usage_load(&store);
+  const bool ok = usage_record(&store, name) && usage_save(&store);
+  usage_free(&store);
+  close(lock_fd); // Releases the lock
+  return ok;
+}
+
+/// Menu ///
+
+typedef struct {
+  const char *name;
+  double rank;
+  size_t position; // In the list (the ties keep the order of the list)
+} ranked_cmd;
+
+static int compare_ranked(const void *a, const void *b) {
+  const ranked_cmd *x = a, *y = b;
+  if (x->rank != y->rank) return (x->rank > y->rank) ? -1 : 1;
+  return (x->position > y->position) - (x->position < y->position);
+}
+
+// The names (in the order of the list) ordered by their frecency, one per
+// line
+static bool ranked_names(const char **names, size_t len, usage_store *store, string *input) {
+  str_free(input);
+  if (!len) return true;
+
+  ranked_cmd *ranked = malloc(len * sizeof(ranked_cmd));
+  if (!ranked) return false;
+  for (size_t i=0; i<len; i++) ranked[i] = (ranked_cmd) { names[i], usage_rank(store, names[i]), i };
+  qsort(ranked, len, sizeof(ranked_cmd), compare_ranked);
+
+  string name = {0};
+  bool ok = true;
+  for (size_t i=0; ok && i<len; i++) {
+    str_replace(&name, (char *) ranked[i].name);
+    str_search_and_replace(&name, "\n", "\\n"); // Escape new lines in order to not break rofi's syntax
+    ok = str_append(input, name.str) && (i == len-1 || str_append_char(input, '\n'));
+  }
+  str_free(&name);
+  free(ranked);
+  return ok;
+}
+
+// The names of the commands of the list (the strings belong to the list).
+// NULL if there aren't any or on error
+static const char **list_names(cmd_node *list, size_t *len) {
+  *len = 0;
+  for (cmd_node *aux = list; aux; aux = aux->next) (*len)++;
+  const char **names = (*len) ? malloc(*len * sizeof(char *)) : NULL;
+  if (!names) return NULL;
+
+  size_t i = 0;
+  for (cmd_node *aux = list; aux; aux = aux->next) names[i++] = aux->info.name.str;
+  return names;
+}
+
+// The input of rofi: the names of the commands (one per line) ordered by
+// their frecency
+bool frecency_menu(cmd_node *list, usage_store *store, string *input) {
+  size_t len;
+  const char **names = list_names(list, &len);
+  if (len && !names) return false;
+
+  const bool ok = ranked_names(names, len, store, input);
+  free(names);
+  return ok;
+}
+
+static void free_names(string *names, size_t len) {
+  for (size_t i=0; i<len; i++) str_free(&names[i]);
+  free(names);
+}
+
+// The names cached, in the order of the list
+static bool read_cached_names(FILE *f, string **names, size_t *len) {
+  *names = NULL;
+  *len = 0;
+
+  uint64_t cached_len;
+  if (!fread(&cached_len, sizeof(uint64_t), 1, f)) return false;
+  for (uint64_t i=0; i<cached_len; i++) {
+    string *aux = realloc(*names, sizeof(string) * (*len+1));
+    if (!aux) break;
+    *names = aux;
+    (*names)[*len] = (string) {0};
+    if (!str_read_from_bfile(&(*names)[*len], f) || !(*names)[*len].str) break;
+    (*len)++;
+  }
+
+  if (*len == cached_len) return true;
+  free_names(*names, *len);
+  *names = NULL;
+  *len = 0;
+  return false;
+}
+
+// The menu of all the commands. The names are cached with the generation of
+// the list, so the list is only loaded again when it changes. The usage
+// changes every time the menu is used, so the names are ordered every time.
+// File format: the generation of the list (uint64_t), the amount of names
+// (uint64_t) and the names, in the order of the list
+bool cached_menu(string *input) {
+  string path = {0};
+  if (!get_share_path(&path, MENU_CACHE_FILE_NAME)) return false;
+
+  usage_store store;
+  usage_init(&store);
+  usage_load(&store); // Without the usage, it's in the order of the list
+
+  uint64_t config_generation, cached_config = 0;
+  string *cached = NULL;
+  size_t cached_len = 0;
+  bool hit = false;
+  if (read_config_generation(&config_generation)
+      && config_generation // Without generation (old save file), it can't be known if it changed
+  ) {
+    FILE *f = fopen(path.str, "rb");
+    hit = f && fread(&cached_config, sizeof(uint64_t), 1, f)
+          && cached_config == config_generation
+          && read_cached_names(f, &cached, &cached_len);
+    if (f) fclose(f);
+  }
+
+  bool ok;
+  if (hit) {
+    const char **names = (cached_len) ? malloc(cached_len * sizeof(char *)) : NULL;
+    ok = !cached_len || names;
+    for (size_t i=0; ok && i<cached_len; i++) names[i] = cached[i].str;
+    ok = ok && ranked_names(names, cached_len, &store, input);
+    free(names);
+    free_names(cached, cached_len);
+    usage_free(&store);
+    str_free(&path);
+    return ok;
+  }
+
+  // Built again
+  cmd_node *list = NULL;
+  size_t len = 0;
+  const char **names = NULL;
+  ok = load_cmd_list_fields(&list, WithoutBodies) == 0;
+  if (ok) {
+    names = list_names(list, &len);
+    ok = (!len || names) && ranked_names(names, len, &store, input);
+  }
+  config_generation = loaded_config_generation();
+
+  if (ok && config_generation) {
+    string tmp_path = {0};
+    FILE *f = open_temporary(path.str, &tmp_path);
+    const uint64_t names_len = len;
+    bool saved = f && fwrite(&config_generation, sizeof(uint64_t), 1, f)
+                 && fwrite(&names_len, sizeof(uint64_t), 1, f);
+    string name = {0};
+    for (size_t i=0; saved && i<len; i++) {
+      str_replace(&name, (char *) names[i]);
+      saved = str_write_to_file(name, f);
+    }
+    str_free(&name);
+    if ((f && fclose(f)) || !saved || rename(tmp_path.str, path.str)) {
+      if (tmp_path.str) remove(tmp_path.str);
+    }
+    str_free(&tmp_path);
+  }
+
+  free(names);
+  free_cmd_list(&list);
+  usage_free(&store);
+  str_free(&path);
+  return ok;
+}
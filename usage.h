@@ -0,0 +1,54 @@
+#ifndef USAGE_H
+#define USAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "wakit.h"
+#include "dynamic_string.h"
+
+// Saved in ~/.local/share (next to the list of commands)
+#define USAGE_FILE_NAME "wakit_usage"
+#define MENU_CACHE_FILE_NAME "wakit_menu"
+#define USAGE_MAGIC "wakituse"
+#define USAGE_INITIAL_CAPACITY 64
+
+// Each use of a command counts 1, and it's halved every USAGE_HALF_LIFE_S.
+// The commands are ordered by this score (frecency)
+#define USAGE_HALF_LIFE_S (7 * 24 * 3600)
+// The commands whose score falls under this are forgotten (2^-7: unused for
+// 7 half-lives)
+#define USAGE_MIN_LOG_SCORE -7.0
+
+// The score decays at the same rate for every command, so the commands are
+// ordered by log2(score at t) + t / USAGE_HALF_LIFE_S, which doesn't depend
+// on t. It's the rank, and it only changes when the command is used.
+typedef struct {
+  uint64_t name_hash; // 0 if the slot is free
+  uint32_t count;
+  uint32_t last_used;
+  double rank;
+} usage_entry;
+
+// Hash table (open addressing) of the entries by the hash of the command name
+typedef struct {
+  usage_entry *slots;
+  size_t capacity;
+  size_t len;
+
+  uint64_t generation; // Increased on each save
+} usage_store;
+
+void usage_init(usage_store *store);
+void usage_free(usage_store *store);
+bool usage_load(usage_store *store);
+bool usage_save(usage_store *store);
+bool usage_record(usage_store *store, const char *name);
+double usage_rank(usage_store *store, const char *name);
+bool record_command_use(const char *name);
+bool get_share_path(string *path, const char *file_name);
+
+bool frecency_menu(cmd_node *list, usage_store *store, string *input);
+bool cached_menu(string *input);
+
+#endif // USAGE_H
@@ -1,3 +1,7 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,12 +12,16 @@
 #include "gui_io.h"
 #include "dynamic_string.h"
 #include "window_manager.h"
+#include "daemon.h"
+#include "status.h"
+#include "plan.h"
+#include "process.h"
+#include "batch.h"
+#include "export.h"
+#include "usage.h"
+#include "trace.h"
+#include "macro.h"
 
-#define TABLET_MODEL "Wacom One by Wacom S Pen stylus"
-#define MODEL_PLACEHOLDER "%TabletID%"
-#define STOP_DAEMON_PATH "/tmp/stop.wakit"
-#define RUNNING_DAEMON_PATH "/tmp/running.wakit"
-#define DAEMON_DELAY 1
 
 void print_help(const char *app_path) {
   printf("Wakit is a command manager for xsetwacom that allows per-application configuration.\n");
@@ -22,7 +30,16 @@ void print_help(const char *app_path) {
   printf("\t-h, --help ........................ Show this message\n");
   printf("\t-a [name] [command] [type] ........ Add a new command. Arguments:\n");
   printf("\t                                    - name: Name of the command\n");
-  printf("\t                                    - command: Command to execute\n");
+  printf("\t                                    - command: Command to execute. %%TabletID%% is replaced by each\n");
+  printf("\t                                      stylus and %%TabletID:<target>%% by each device of the target\n");
+  printf("\t                                      ('all', 'stylus', 'eraser', 'pad', 'touch', 'cursor', an id\n");
+  printf("\t                                      or a name). The command is run for every device in parallel\n");
+  printf("\t                                      If the first line is '" STEPS_HEADER "', each line is a step:\n");
+  printf("\t                                        <name>[ after <step>[,<step>...]]: <command>\n");
+  printf("\t                                      The steps run in parallel unless they run after other steps\n");
+  printf("\t                                      A step can be 'set[:<target>] <parameter> <value>', so it's only\n");
+  printf("\t                                      run if the parameter has a different value\n");
+  printf("\t                                      A command or a step can be another command: '@<name>'\n");
   printf("\t                                    - type: 'action' or 'profile'\n");
   printf("\t-l ................................ List all commands\n");
   printf("\t     --filter-by-app .............. Show the commands that are related to an app\n");
@@ -40,10 +57,27 @@ void print_help(const char *app_path) {
   printf("\t                                        - variable type: 'action' or 'profile'\n");
   printf("\t                                        - variable app: if it's a profile, change the app that it's assign to. You should not input a new_value\n");
   printf("\t                                        - variable default: if it's a profile, change if it's the default profile for the app. Values are: yes/no\n");
-  printf("\t-m ................................ Run menu\n");
+  printf("\t-m ................................ Run menu (the commands used more often and more recently go first)\n");
   printf("\t-d ................................ Start/Stop daemon\n");
-  printf("\t--export .......................... Print all the commands as wakit instructions\n");
+  printf("\t     --settle [ms] ................ Time the focus must stay on an app before applying its profile (default: 300)\n");
+  printf("\t     --remember [hours] ........... Save the profiles chosen, so they're remembered after a restart (0: forever)\n");
+  printf("\t     --per-window ................. Remember the profile of each window instead of each app\n");
+  printf("\t     --record [trace] ............. Append the focus changes to a trace file (see --replay)\n");
+  printf("\t     --display [name] ............. Serve this display instead of $DISPLAY (repeat it to serve several)\n");
+  printf("\t--watch ........................... Print the app and profile of the daemon each time they change\n");
+  printf("\t                                    (tab separated: timestamp in ms, app and profile)\n");
+  printf("\t     --json ....................... Print each change as a JSON object\n");
+  printf("\t     --display [name] ............. Watch the daemon of this display instead of the one of $DISPLAY\n");
+  printf("\t--replay [trace] .................. Feed the daemon's decision logic with the focus events of a trace\n");
+  printf("\t                                    (without X and without running the profiles). Use '-' for stdin\n");
+  printf("\t--export .......................... Print all the commands as wakit instructions (and the composed\n");
+  printf("\t                                    ones flattened, as comments)\n");
+  printf("\t     --format=[jsonl|tsv] ......... Print one command per line as JSON or tab separated values instead\n");
+  printf("\t--import [file] ................... Append the commands of the file (or stdin) to the list\n");
+  printf("\t     --format=[jsonl|tsv] ......... Format of the file (default: jsonl)\n");
   printf("\t--move [name] ..................... Move a command inside the list\n");
+  printf("\t--batch [file] .................... Apply the operations of the file (or stdin) and save the list once\n");
+  printf("\t                                    (one per line, tab separated: add, edit, remove or move)\n");
 }
 
 bool add_command(cmd_node **list, cmd c) {
@@ -103,12 +137,16 @@ bool insert_command_node_at(cmd_node **list, cmd_node *node, unsigned int pos) {
 //   1  --> EOF
 //   -1 --> Error
 //   0  --> OK
-int read_cmd_from_file(FILE *f, cmd *c) {
+static int read_cmd_fields(FILE *f, cmd *c, cmd_projection projection) {
+  c->offset = ftell(f);
+  c->lazy_body = (projection == WithoutBodies);
+
   // EOF
   if (!str_read_from_bfile(&c->name, f)) return 1;
 
   // Read
-  if ( !str_read_from_bfile(&c->cmd, f)
+  const bool body_ok = (c->lazy_body) ? str_skip_in_bfile(f) : str_read_from_bfile(&c->cmd, f);
+  if ( !body_ok
        || !fread(&c->type, sizeof(cmd_type), 1, f)
        || !str_read_from_bfile(&c->app, f)
        || !fread(&c->default_for_app, sizeof(bool), 1, f)
@@ -120,49 +158,293 @@ int read_cmd_from_file(FILE *f, cmd *c) {
   return 0;
 }
 
+int read_cmd_from_file(FILE *f, cmd *c) {
+  return read_cmd_fields(f, c, WithBodies);
+}
+
 bool get_config_path(string *path) {
   const char *home = getenv("HOME");
   if (!home) return false;
 
   str_append(path, home);
-  str_append(path, "/.local/share/wakit");
+  str_append(path, "/.local/share/" CONFIG_FILE_NAME);
   return true;
 }
 
-// Return values:
-//   1  --> Error while opening
-//   -1 --> Format error
-//   0  --> OK
+// A new file next to the path (path.XXXXXX), that replaces it when it's
+// complete. NULL on error
+FILE *open_temporary(const char *path, string *tmp_path) {
+  str_replace(tmp_path, (char *) path);
+  str_append(tmp_path, ".XXXXXX");
+
+  const int fd = mkstemp(tmp_path->str);
+  if (fd == -1) return NULL;
+  FILE *f = fdopen(fd, "wb");
+  if (!f) {
+    close(fd);
+    remove(tmp_path->str);
+  }
+  return f;
+}
+
+/// Locking ///
+
+// The save file is replaced on each save, so the lock is taken on a separate
+// file. Its byte LOCK_LIST is held by one writer or by any number of readers.
+// Byte LOCK_TURNSTILE is held by the writers while they wait for the readers
+// to leave, and by the readers only while they take their lock, so the new
+// readers queue behind a waiting writer (instead of starving it).
+// The locks taken by the same process are nested (only the outermost one is
+// taken/released)
+#define LOCK_TURNSTILE 0
+#define LOCK_LIST 1
+
+static int config_lock_fd = -1;
+static int config_lock_depth = 0;
+
+static bool lock_byte(int fd, off_t byte, short type) {
+  struct flock lock = { .l_type = type, .l_whence = SEEK_SET, .l_start = byte, .l_len = 1 };
+  while (fcntl(fd, F_OFD_SETLKW, &lock)) {
+    if (errno != EINTR) return false;
+  }
+  return true;
+}
+
+bool lock_config(bool exclusive) {
+  if (config_lock_depth) {
+    // Held by the process (a shared lock becomes exclusive until it's released)
+    if ( exclusive && (!lock_byte(config_lock_fd, LOCK_TURNSTILE, F_WRLCK)
+                       || !lock_byte(config_lock_fd, LOCK_LIST, F_WRLCK)) )
+      return false;
+    config_lock_depth++;
+    return true;
+  }
+
+  string path = {0};
+  if (!get_config_path(&path)) return false;
+  str_append(&path, ".lock");
+  config_lock_fd = open(path.str, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  str_free(&path);
+  if (config_lock_fd == -1) {
+    ERROR("Unable to open the lock of the save file");
+    return false;
+  }
+
+  const bool locked = (exclusive)
+    ? lock_byte(config_lock_fd, LOCK_TURNSTILE, F_WRLCK) && lock_byte(config_lock_fd, LOCK_LIST, F_WRLCK)
+    : lock_byte(config_lock_fd, LOCK_TURNSTILE, F_WRLCK) && lock_byte(config_lock_fd, LOCK_LIST, F_RDLCK)
+      && lock_byte(config_lock_fd, LOCK_TURNSTILE, F_UNLCK);
+  if (!locked) {
+    ERROR("Unable to lock the save file");
+    close(config_lock_fd);
+    config_lock_fd = -1;
+    return false;
+  }
+
+  config_lock_depth = 1;
+  return true;
+}
+
+void unlock_config() {
+  if (!config_lock_depth || --config_lock_depth) return;
+
+  close(config_lock_fd); // Releases the locks
+  config_lock_fd = -1;
+}
+
+/// Header ///
+
+// Generation of the last list loaded by this process
+static uint64_t loaded_generation = 0;
+
+uint64_t loaded_config_generation() {
+  return loaded_generation;
+}
+
+// Leaves the file after the header. The files without a header (saved
+// before it existed) are generation 0
+bool read_config_header(FILE *f, uint64_t *generation) {
+  char magic[sizeof(CONFIG_MAGIC) - 1];
+  uint32_t version;
+  *generation = 0;
+
+  if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, CONFIG_MAGIC, sizeof(magic))) {
+    rewind(f);
+    return true;
+  }
+
+  if ( !fread(&version, sizeof(uint32_t), 1, f) || !fread(generation, sizeof(uint64_t), 1, f) ) {
+    ERROR("Save file is corrupted :´(");
+    return false;
+  }
+  if (version > CONFIG_VERSION) {
+    ERROR("The save file was written by a newer version of wakit");
+    return false;
+  }
+  return true;
+}
+
+bool write_config_header(FILE *f, uint64_t generation) {
+  const uint32_t version = CONFIG_VERSION;
+  return fwrite(CONFIG_MAGIC, sizeof(CONFIG_MAGIC) - 1, 1, f)
+         && fwrite(&version, sizeof(uint32_t), 1, f)
+         && fwrite(&generation, sizeof(uint64_t), 1, f);
+}
+
+// Generation of the saved list (0 if there isn't one)
+bool read_config_generation(uint64_t *generation) {
+  *generation = 0;
+
+  string path = {0};
+  if (!get_config_path(&path)) return false;
+  if (!lock_config(false)) {
+    str_free(&path);
+    return false;
+  }
+
+  FILE *f = fopen(path.str, "rb");
+  str_free(&path);
+  const bool ok = !f || read_config_header(f, generation);
+  if (f) fclose(f);
+  unlock_config();
+  return ok;
+}
+
+// Reads the body of a command loaded without it. The record is searched by
+// name if the file changed since then
+bool load_cmd_body(cmd *c) {
+  if (!c->lazy_body) return true;
+
+  string path = {0};
+  if (!get_config_path(&path) || !lock_config(false)) {
+    str_free(&path);
+    return false;
+  }
+  FILE *f = fopen(path.str, "rb");
+  str_free(&path);
+  if (!f) {
+    unlock_config();
+    return false;
+  }
+
+  cmd record;
+  INIT_CMD(record);
+  uint64_t generation;
+  bool found = !fseek(f, c->offset, SEEK_SET)
+               && read_cmd_from_file(f, &record) == 0
+               && !strcmp(record.name.str, c->name.str);
+  if (!found) {
+    rewind(f);
+    if (!read_config_header(f, &generation)) fseek(f, 0, SEEK_END);
+    str_free(&record.name);
+    str_free(&record.cmd);
+    str_free(&record.app);
+    while (!found && read_cmd_from_file(f, &record) == 0) {
+      found = !strcmp(record.name.str, c->name.str);
+      if (found) break;
+      str_free(&record.name);
+      str_free(&record.cmd);
+      str_free(&record.app);
+    }
+  }
+  fclose(f);
+  unlock_config();
+
+  if (found) {
+    str_free(&c->cmd);
+    c->cmd = record.cmd;
+    record.cmd = (string) {0};
+    c->lazy_body = false;
+  } else {
+    ERROR("The command isn't in the save file anymore");
+  }
+  str_free(&record.name);
+  str_free(&record.cmd);
+  str_free(&record.app);
+  return found;
+}
+
 int load_cmd_list(cmd_node **list) {
+  return load_cmd_list_fields(list, WithBodies);
+}
+
+static int read_cmd_list(cmd_node **list, cmd_projection projection) {
   string path = {0};
   if (!get_config_path(&path)) {
     ERROR("Get yourself a home");
     return 1;
   }
 
+  if (!lock_config(false)) {
+    str_free(&path);
+    return 1;
+  }
+
   FILE *f = fopen(path.str, "rb");
   if (!f) {
+    unlock_config();
     str_insert_at(&path, 0, "Can't open file ");
     str_append(&path, ", continuing without loading it...");
     DEBUG(path.str);
     str_free(&path);
+    loaded_generation = 0;
     return 0;
   }
   str_free(&path);
 
+  uint64_t generation;
+  if (!read_config_header(f, &generation)) {
+    fclose(f);
+    unlock_config();
+    return -1;
+  }
+
+  // The nodes are appended after the last one (without walking the list for
+  // each of them)
+  cmd_node **tail = list;
+  while (*tail) tail = &(*tail)->next;
+
   cmd c;
   INIT_CMD(c);
   int ret;
-  while ((ret = read_cmd_from_file(f, &c)) == 0) {
-    add_command(list, c);
+  while ((ret = read_cmd_fields(f, &c, projection)) == 0) {
+    cmd_node *new_node = malloc(sizeof(cmd_node));
+    if (!new_node) {
+      ERROR("No free space");
+      str_free(&c.name);
+      str_free(&c.cmd);
+      str_free(&c.app);
+      ret = -1;
+      break;
+    }
+    new_node->info = c;
+    new_node->next = NULL;
+    *tail = new_node;
+    tail = &new_node->next;
     INIT_CMD(c);
   }
 
   fclose(f);
+  unlock_config();
+  if (ret == 1) loaded_generation = generation;
   return (ret == 1) ? 0 : -1;
 }
 
+// Return values:
+//   1  --> Error while opening
+//   -1 --> Format error
+//   0  --> OK
+int load_cmd_list_fields(cmd_node **list, cmd_projection projection) {
+  trace_span span = trace_begin("load_cmd_list");
+  const int ret = read_cmd_list(list, projection);
+  trace_end(&span);
+  return ret;
+}
+
 bool write_cmd_to_file(FILE *f, cmd c) {
+  // It would be saved without its body
+  if (c.lazy_body) return false;
+
   return str_write_to_file(c.name, f)
          && str_write_to_file(c.cmd, f)
          && fwrite(&c.type, sizeof(cmd_type), 1, f)
@@ -170,40 +452,51 @@ bool write_cmd_to_file(FILE *f, cmd c) {
          && fwrite(&c.default_for_app, sizeof(bool), 1, f);
 }
 
+// The file is written next to the old one and then renamed, so it's replaced
+// atomically (a reader never sees it half written, and a failed save keeps
+// the old one). To not lose concurrent changes, the list should have been
+// loaded while holding the exclusive lock (see lock_config())
 bool save_cmd_list(cmd_node *list) {
-  if (!list) {
-    ERROR("No list was given");
-    return false;
-  }
-
-  string path = {0};
+  string path = {0}, tmp_path = {0};
   if (!get_config_path(&path)) {
     ERROR("Get yourself a home");
-    return 1;
+    return false;
+  }
+  if (!lock_config(true)) {
+    str_free(&path);
+    return false;
   }
+  str_append(&tmp_path, path.str);
+  str_append(&tmp_path, ".tmp");
 
-  FILE *f = fopen(path.str, "wb");
+  uint64_t generation;
+  FILE *f = (read_config_generation(&generation)) ? fopen(tmp_path.str, "wb") : NULL;
   if (!f) {
+    unlock_config();
     str_insert_at(&path, 0, "Can't open file ");
     ERROR(path.str);
     str_free(&path);
+    str_free(&tmp_path);
     return false;
   }
 
-  while (list) {
-    if (!write_cmd_to_file(f, list->info)) {
-      str_insert_at(&path, 0, "Couldn't write file ");
-      ERROR(path.str);
-      str_free(&path);
-      return false;
-    }
-
+  bool ok = write_config_header(f, generation + 1);
+  while (list && ok) {
+    ok = write_cmd_to_file(f, list->info);
     list = list->next;
   }
+  if (fclose(f)) ok = false;
+  if (ok && rename(tmp_path.str, path.str)) ok = false;
 
-  fclose(f);
+  if (!ok) {
+    str_insert_at(&path, 0, "Couldn't write file ");
+    ERROR(path.str);
+    remove(tmp_path.str);
+  }
+  unlock_config();
   str_free(&path);
-  return true;
+  str_free(&tmp_path);
+  return ok;
 }
 
 void free_cmd(cmd_node *cmd) {
@@ -241,6 +534,61 @@ cmd_node *default_app_profile(cmd_node *list, char *app_name) {
   return NULL;
 }
 
+// Multi-step commands should have valid steps
+bool valid_command(const char *command) {
+  if (!is_multi_step(command)) return true;
+
+  plan p;
+  if (!parse_plan(command, &p)) return false;
+  free_plan(&p);
+  return true;
+}
+
+static int add_new_command(cmd new_cmd) {
+  const char *name = new_cmd.name.str;
+  cmd_node *list = NULL;
+  if (load_cmd_list(&list) != 0) {
+    str_free(&new_cmd.name);
+    str_free(&new_cmd.cmd);
+    str_free(&new_cmd.app);
+    return 1;
+  }
+
+  // Search if the name is unique
+  cmd_node *aux = list;
+  while (aux && strcmp(aux->info.name.str, name)) aux = aux->next;
+  if (aux) {
+    ERROR("Command name is already registered");
+    free_cmd_list(&list);
+    str_free(&new_cmd.name);
+    str_free(&new_cmd.cmd);
+    str_free(&new_cmd.app);
+    return 1;
+  }
+
+  // Make it the default profile if there's already one
+  cmd_node *def_profile = NULL;
+  if (new_cmd.default_for_app && (def_profile = default_app_profile(list, new_cmd.app.str))) {
+    DEBUG("There's already a default profile for the app. Disabling it...");
+    def_profile->info.default_for_app = false;
+  }
+
+  if (!add_command(&list, new_cmd)) {
+    free_cmd_list(&list);
+    return 1;
+  }
+  if (!valid_references(list, name)) {
+    free_cmd_list(&list);
+    return 1;
+  }
+  if (!save_cmd_list(list)) {
+    free_cmd_list(&list);
+    return 1;
+  }
+  free_cmd_list(&list);
+  return 0;
+}
+
 int create_command(char *name, char *command, char *type) {
   cmd new_cmd;
   INIT_CMD(new_cmd);
@@ -257,6 +605,7 @@ int create_command(char *name, char *command, char *type) {
     str_free(&err);
     return 1;
   }
+  if (!valid_command(command)) return 1;
   str_append(&new_cmd.name, name);
   str_append(&new_cmd.cmd, command);
 
@@ -280,40 +629,16 @@ int create_command(char *name, char *command, char *type) {
     new_cmd.default_for_app = false;
   }
 
-  cmd_node *list = NULL;
-  if (load_cmd_list(&list) != 0) return 1;
-
-  // Search if the name is unique
-  cmd_node *aux = list;
-  while (aux && strcmp(aux->info.name.str, name)) aux = aux->next;
-  if (aux) {
-    ERROR("Command name is already registered");
-    free_cmd_list(&list);
+  // The prompts are done, so the list is locked only while it's changed
+  if (!lock_config(true)) {
     str_free(&new_cmd.name);
     str_free(&new_cmd.cmd);
     str_free(&new_cmd.app);
     return 1;
   }
-
-  // Make it the default profile if there's already one
-  cmd_node *def_profile = NULL;
-  if (new_cmd.default_for_app && (def_profile = default_app_profile(list, new_cmd.app.str))) {
-    DEBUG("There's already a default profile for the app. Disabling it...");
-    def_profile->info.default_for_app = false;
-  }
-
-  if (!add_command(&list, new_cmd)) {
-    free_cmd_list(&list);
-    return 1;
-  }
-  if (!save_cmd_list(list)) {
-    free_cmd_list(&list);
-    return 1;
-  }
-  free_cmd_list(&list);
-  return 0;
-
-  free_cmd_list(&list);
+  int ret = add_new_command(new_cmd);
+  unlock_config();
+  return ret;
 }
 
 int list_commands(cmd_node *list, int argc, char *argv[]) {
@@ -420,19 +745,38 @@ int list_commands(cmd_node *list, int argc, char *argv[]) {
   return 0;
 }
 
+// The composed commands are followed by their flattened form, commented
 int print_instructions(cmd_node *list, char *wakit_path) {
   if (!list) return 1;
 
+  flattened_set flattened;
+  if (!flatten_list(list, &flattened)) return 1;
+
+  string escaped = {0}, escaped_name = {0};
   while (list) {
     cmd info = list->info;
-    if (!str_search_and_replace(&info.cmd, "\"", "\\\"")) return 1;
-    printf("%s -a \"%s\" \"%s\" ", wakit_path, info.name.str, info.cmd.str);
+    // The quotes are escaped in copies (the command of the list is left as is)
+    str_replace(&escaped_name, info.name.str);
+    str_replace(&escaped, (info.cmd.str) ? info.cmd.str : "");
+    if ( !str_search_and_replace(&escaped_name, "\"", "\\\"")
+         || !str_search_and_replace(&escaped, "\"", "\\\"") ) {
+      free_flattened(&flattened);
+      str_free(&escaped);
+      str_free(&escaped_name);
+      return 1;
+    }
+    printf("%s -a \"%s\" \"%s\" ", wakit_path, escaped_name.str, escaped.str);
 
     switch (info.type) {
       case Profile:
         printf("profile");
 
-        if (!info.app.str) return 1;
+        if (!info.app.str) {
+          free_flattened(&flattened);
+          str_free(&escaped);
+          str_free(&escaped_name);
+          return 1;
+        }
         if (!strcmp(info.app.str, "generic")) {
           printf(" # Generic\n");
           break;
@@ -446,9 +790,21 @@ int print_instructions(cmd_node *list, char *wakit_path) {
         break;
     }
 
+    const char *flat = search_flattened(&flattened, info.name.str);
+    if (flat) {
+      printf("# Flattened:\n");
+      for (const char *line = flat; line; line = strchr(line, '\n')) {
+        if (*line == '\n') line++;
+        printf("#   %.*s\n", (int) strcspn(line, "\n"), line);
+      }
+    }
+
     list = list->next;
   }
 
+  free_flattened(&flattened);
+  str_free(&escaped);
+  str_free(&escaped_name);
   return 0;
 }
 
@@ -474,30 +830,56 @@ cmd_node *remove_command(cmd_node **list, char *name) {
   return current;
 }
 
+// The command is run once for each device of its target (see tablet.h), in
+// parallel. Multi-step commands run their steps in a pool (see plan.h)
 int run_cmd(cmd cmd, string *output) {
-  string command = {0}, model = {0};
-  str_append(&command, cmd.cmd.str);
-  str_append(&model, "'");
-  str_append(&model, TABLET_MODEL);
-  str_append(&model, "'");
-  str_search_and_replace(&command, MODEL_PLACEHOLDER, model.str);
-
-  int ret = console_output(command.str, output);
-  str_free(&command);
-  str_free(&model);
+  // The body is only read for this run
+  const bool lazy = cmd.lazy_body;
+  if (lazy && !load_cmd_body(&cmd)) return 1;
+
+  // Composed commands run their flattened form (see macro.h)
+  const char *command = cmd.cmd.str;
+  flattened_set flattened = {0};
+  if (has_references(command)
+      && (!cached_flattened(&flattened) || !(command = search_flattened(&flattened, cmd.name.str)))) {
+    ERROR("Unable to resolve the references to other commands");
+    free_flattened(&flattened);
+    if (lazy) str_free(&cmd.cmd);
+    return 1;
+  }
+
+  trace_span span = trace_begin("run_cmd");
+  command_run *r = start_command(command, NULL);
+  free_flattened(&flattened);
+  if (lazy) str_free(&cmd.cmd);
+  if (!r) {
+    trace_end(&span);
+    return 1;
+  }
+
+  while (!update_command(r)) supervisor_wait(-1);
+  const int ret = finish_command(r, output);
+  trace_end(&span);
   return ret;
 }
 
 int menu() {
-  cmd_node *list = NULL;
-  if (load_cmd_list(&list) != 0) return 1;
+  // Ordered by frecency (the menu is cached until the list or the usage change)
+  string input = {0};
+  if (!cached_menu(&input)) return 1;
 
-  if (!list) {
+  if (!input.str) {
     DEBUG("Empty list.");
     return 0;
   }
 
-  cmd_node *selected = ask_for_cmd(list);
+  string name = {0};
+  const bool answered = ask_for_name(input.str, NULL, &name);
+  str_free(&input);
+
+  cmd_node *list = NULL, *selected = NULL;
+  if (answered && load_cmd_list_fields(&list, WithoutBodies) == 0) selected = search_cmd(list, name.str);
+  str_free(&name);
 
   if (!selected) {
     DEBUG("Didn't select anything");
@@ -505,6 +887,7 @@ int menu() {
     return 0;
   }
 
+  record_command_use(selected->info.name.str);
   string output = {0};
   int ret = run_cmd(selected->info, &output);
 
@@ -538,6 +921,7 @@ bool run(cmd_node *list, char *cmd_name) {
     return false;
   }
 
+  record_command_use(selected->info.name.str);
   string output = {0};
   int ret = run_cmd(selected->info, &output);
 
@@ -567,12 +951,13 @@ cmd duplicate_cmd(cmd info) {
   str_append(&(new.cmd), info.cmd.str);
   new.type = info.type;
   new.default_for_app = info.default_for_app;
+  new.lazy_body = info.lazy_body;
+  new.offset = info.offset;
 
   return new;
 }
 
-// Creates a separated list with the available profiles for the given app
-cmd_node *search_profiles_app(cmd_node *list, char *app_name) {
+static cmd_node *find_profiles_app(cmd_node *list, char *app_name) {
   cmd_node *availables = NULL, *aux = NULL;
   if ( (aux = default_app_profile(list, app_name)) ) {
     add_command(&availables, duplicate_cmd(aux->info));
@@ -602,163 +987,29 @@ cmd_node *search_profiles_app(cmd_node *list, char *app_name) {
   return availables;
 }
 
-struct generic_selection_list {
-  string app;
-  cmd_node *profile; // (should be generic)
-
-  struct generic_selection_list *next;
-};
-typedef struct generic_selection_list generic_selection_list;
-
-void free_generic_selection(generic_selection_list **list) {
-  while (*list) {
-    generic_selection_list *aux = *list;
-    *list = aux->next;
-    str_free(&(aux->app));
-    free_cmd_list(&(aux->profile));
-    free(aux);
-  }
-}
-
-cmd_node *search_generic_selection(generic_selection_list *list, const char *app_name) {
-  while (list && strcmp(list->app.str, app_name)) list = list->next;
-  if (!list) return NULL;
-
-  cmd_node *n = malloc(sizeof(cmd_node));
-  n->next = NULL;
-  n->info = duplicate_cmd(list->profile->info);
-  return n;
+// Creates a separated list with the available profiles for the given app
+cmd_node *search_profiles_app(cmd_node *list, char *app_name) {
+  trace_span span = trace_begin("search_profiles_app");
+  cmd_node *availables = find_profiles_app(list, app_name);
+  trace_end(&span);
+  return availables;
 }
 
-int start_daemon() {
-  cmd_node *list = NULL;
-  if (load_cmd_list(&list) != 0) return 1;
-
-  if (!list) {
-    DEBUG("Empty list.");
-    return 0;
+// Saves a list that was loaded without the lock because the user was asked
+// something afterwards. It's only saved if nobody changed it meanwhile
+static bool save_unchanged_list(cmd_node *list) {
+  uint64_t generation;
+  bool ok = true;
+  if (!lock_config(true)) {
+    ok = false;
+  } else if (!read_config_generation(&generation) || generation != loaded_config_generation()) {
+    ERROR("The list was changed meanwhile. Try again");
+    ok = false;
+  } else if (!save_cmd_list(list)) {
+    ok = false;
   }
-
-  // To remember the selection of a generic profile (custom profiles are
-  // remembered by changing to 'true' the default_for_app variable)
-  generic_selection_list *generic_selection = NULL;
-
-  DEBUG("Daemon running...");
-  string last_app = {0}, app = {0};
-  while (access(STOP_DAEMON_PATH, F_OK)) {
-    // If it's unable to get the active window's app name, default to generic...
-    if (!get_active_window(&app)) str_replace(&app, "generic");
-
-    if (!last_app.str || strcmp(app.str, last_app.str)) {
-      cmd_node *profile = NULL;
-      cmd_node *available_profiles = NULL;
-      if ( !(available_profiles = search_generic_selection(generic_selection, app.str)) )
-        available_profiles = search_profiles_app(list, app.str);
-
-      if (available_profiles && available_profiles->next) { // More than one profile
-        while (!profile) profile = ask_for_cmd(available_profiles);
-
-        // Remember the selection for this session.
-        //
-        // We can activate default_for_app as the changes to the list are not
-        // been saved to disk and it will make the custom profile selected
-        // enable automatically when focusing in the app again.
-        //
-        // If it's a generic profile, it's added to the list "generic_selection"
-        // for future reference.
-        if (strcmp(app.str, "generic")) {
-          if (!strcmp(profile->info.app.str, "generic")) {
-            generic_selection_list *new_element = malloc(sizeof(generic_selection_list));
-            new_element->app = (string) {NULL, 0, 0};
-            str_append(&(new_element->app), app.str);
-            new_element->profile = malloc(sizeof(cmd_node));
-            new_element->profile->next = NULL;
-            new_element->profile->info = duplicate_cmd(profile->info);
-            new_element->next = generic_selection;
-            generic_selection = new_element;
-          } else {
-            search_cmd(list, profile->info.name.str)->info.default_for_app = true;
-          }
-        }
-
-      } else {
-        profile = available_profiles;
-      }
-
-      // Debug information
-      DEBUG("----------------------------------------");
-      if (!strcmp(app.str, "generic")) DEBUG("Unable to get the active window's app name. Defaulting to generic...");
-      string debug_msg = {0};
-      str_append(&debug_msg, "The window focused has changed: ");
-      if (last_app.str) str_append(&debug_msg, last_app.str);
-      else str_append(&debug_msg, "[empty]");
-      str_append(&debug_msg, " --> ");
-      str_append(&debug_msg, app.str);
-      DEBUG(debug_msg.str);
-      cmd_node *aux = available_profiles;
-      if (aux && aux->info.default_for_app) { // Found a default profile
-        str_replace(&debug_msg, "Found a default profile: ");
-        str_append(&debug_msg, aux->info.name.str);
-      } else {
-        str_replace(&debug_msg, "Available profiles for the app: ");
-        while (aux) {
-          str_append(&debug_msg, aux->info.name.str);
-          if (aux->next) str_append(&debug_msg, ", ");
-          aux = aux->next;
-        }
-      }
-      DEBUG(debug_msg.str);
-      str_replace(&debug_msg, "Profile selected: ");
-      if (profile) str_append(&debug_msg, profile->info.name.str);
-      else str_append(&debug_msg, "No profile was found");
-      DEBUG(debug_msg.str);
-
-      // Update running file
-      FILE *f = fopen(RUNNING_DAEMON_PATH, "w");
-      string text = {0};
-      str_append(&text, app.str);
-      str_append(&text, " | ");
-      if (profile) str_append(&text, profile->info.name.str);
-      else str_append(&text, "-no profile-");
-      fwrite(text.str, text.str_len, 1, f);
-      str_free(&text);
-      fclose(f);
-
-      if (profile) {
-        // Apply profile
-        int ret = run_cmd(profile->info, &debug_msg);
-
-        if (debug_msg.str) {
-          str_insert_at(&debug_msg, 0, "Command output: ");
-          DEBUG(debug_msg.str);
-        }
-
-        if (ret) {
-          str_replace(&debug_msg, "The command failed with exit code ");
-          str_append_int(&debug_msg, ret);
-        } else {
-          str_replace(&debug_msg, "The command was executed successfully");
-        }
-        DEBUG(debug_msg.str);
-      }
-
-      str_free(&debug_msg);
-      free_cmd_list(&available_profiles);
-      str_replace(&last_app, app.str);
-    }
-
-    sleep(DAEMON_DELAY);
-  }
-  DEBUG("Daemon closed...");
-
-  if (remove(STOP_DAEMON_PATH))    ERROR("Unable to remove the stop file...");
-  if (remove(RUNNING_DAEMON_PATH)) ERROR("Unable to remove the running file...");
-
-  str_free(&app);
-  str_free(&last_app);
-  free_cmd_list(&list);
-  free_generic_selection(&generic_selection);
-  return 0;
+  unlock_config();
+  return ok;
 }
 
 int move_command_menu(char *name) {
@@ -796,13 +1047,15 @@ int move_command_menu(char *name) {
     return 1;
   }
 
-  save_cmd_list(list);
+  // The list isn't locked while the user chooses the position
+  int ret = save_unchanged_list(list) ? 0 : 1;
   free_cmd_list(&list);
-  return 0;
+  return ret;
 }
 
 int main(int argc, char *argv[]) {
   int ret = 0;
+  trace_init();
 
   if (argc < 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
     print_help(argv[0]);
@@ -815,8 +1068,14 @@ int main(int argc, char *argv[]) {
     ret = create_command(argv[2], argv[3], argv[4]);
 
   } else if (!strcmp(argv[1], "-l")) {
+    // The bodies are only loaded if they're shown
+    cmd_projection projection = WithoutBodies;
+    for (int i=2; i<argc; i++) {
+      if (!strcmp(argv[i], "--show-cmd")) projection = WithBodies;
+    }
+
     cmd_node *list = NULL;
-    if (load_cmd_list(&list) != 0) {
+    if (load_cmd_list_fields(&list, projection) != 0) {
       free_cmd_list(&list);
       return 1;
     }
@@ -830,6 +1089,9 @@ int main(int argc, char *argv[]) {
       return 1;
     }
 
+    // Locked from the load to the save, so the changes made by other wakits
+    // meanwhile aren't lost
+    if (!lock_config(true)) return 1;
     cmd_node *list = NULL;
     if (load_cmd_list(&list) == -1) {
       ERROR("Can't load the save file");
@@ -842,12 +1104,18 @@ int main(int argc, char *argv[]) {
       return 1;
     }
     free_cmd(to_remove);
+    if (!valid_list_references(list)) {
+      ERROR("The command is used by other commands. Nothing was changed");
+      free_cmd_list(&list);
+      return 1;
+    }
     if (!save_cmd_list(list)) {
       ERROR("Can't save the file");
       free_cmd_list(&list);
       return 1;
     }
     free_cmd_list(&list);
+    unlock_config();
 
   } else if (!strcmp(argv[1], "-e")) {
     if (argc == 2) {
@@ -911,6 +1179,12 @@ int main(int argc, char *argv[]) {
       return 1;
     }
 
+    // The app is asked to the user after the load, so that list isn't locked
+    // (it's saved only if nobody changed it meanwhile). The rest is locked
+    // from the load to the save
+    bool asks_user = (var == cmd_app);
+    if (!asks_user && !lock_config(true)) return 1;
+
     cmd_node *list = NULL, *node = NULL;
     if (load_cmd_list(&list) != 0) return 1;
 
@@ -923,11 +1197,24 @@ int main(int argc, char *argv[]) {
     string app_name = {0};
     switch (var) {
       case cmd_name:
+        // The commands that use it are changed too
+        if (!rename_references(list, argv[2], argv[4])) {
+          free_cmd_list(&list);
+          return 1;
+        }
         str_replace(&(node->info.name), argv[4]);
         break;
 
       case cmd_command:
+        if (!valid_command(argv[4])) {
+          free_cmd_list(&list);
+          return 1;
+        }
         str_replace(&(node->info.cmd), argv[4]);
+        if (!valid_references(list, node->info.name.str)) {
+          free_cmd_list(&list);
+          return 1;
+        }
         break;
 
       case cmd_type:
@@ -988,43 +1275,90 @@ int main(int argc, char *argv[]) {
         break;
     }
 
-    if (!save_cmd_list(list)) ret = 1;
+    if (asks_user) {
+      if (!save_unchanged_list(list)) ret = 1;
+    } else {
+      if (!save_cmd_list(list)) ret = 1;
+      unlock_config();
+    }
     free_cmd_list(&list);
 
   } else if (!strcmp(argv[1], "-m")) {
     ret = menu();
 
   } else if (!strcmp(argv[1], "--export")) {
-    cmd_node *list = NULL;
-    if (load_cmd_list(&list) == -1) {
-      ERROR("Can't load the save file");
+    export_format format = ShellFormat;
+    if (argc > 3 || (argc == 3 && !parse_export_format(argv[2], &format))) {
+      ERROR("Expected --format=jsonl or --format=tsv");
       return 1;
     }
-    ret = print_instructions(list, argv[0]);
-    free_cmd_list(&list);
+
+    if (format != ShellFormat) {
+      ret = export_list(format);
+    } else {
+      cmd_node *list = NULL;
+      if (load_cmd_list(&list) == -1) {
+        ERROR("Can't load the save file");
+        return 1;
+      }
+      ret = print_instructions(list, argv[0]);
+      free_cmd_list(&list);
+    }
+
+  } else if (!strcmp(argv[1], "--import")) {
+    export_format format = JsonlFormat;
+    int arg = 2;
+    if (arg < argc && !strncmp(argv[arg], "--format=", 9)) {
+      if (!parse_export_format(argv[arg], &format)) {
+        ERROR("Expected --format=jsonl or --format=tsv");
+        return 1;
+      }
+      arg++;
+    }
+    if (argc - arg > 1) {
+      ERROR("Only the path of the file to import was expected");
+      return 1;
+    }
+    ret = import_list(format, (arg < argc) ? argv[arg] : NULL);
 
   } else if (!strcmp(argv[1], "-d")) {
-    if (!access(RUNNING_DAEMON_PATH, F_OK)) {
-      FILE *f = fopen(STOP_DAEMON_PATH, "w");
-      fclose(f);
+    if (stop_daemon(argc-2, argv+2)) {
       DEBUG("Closing daemon...");
     } else {
-      ret = start_daemon();
+      ret = start_daemon(argc-2, argv+2);
     }
 
+  } else if (!strcmp(argv[1], "--watch")) {
+    ret = watch_status(argc-2, argv+2);
+
+  } else if (!strcmp(argv[1], "--replay")) {
+    if (argc != 3) {
+      ERROR("The path of the trace was expected");
+      return 1;
+    }
+    ret = replay_trace(argv[2]);
+
   } else if (!strcmp(argv[1], "--run") || !strcmp(argv[1], "-r")) {
     if (argc != 3) {
       ERROR("Expected the command name.");
       return 1;
     }
+    // Only the body of the command run is read
     cmd_node *list = NULL;
-    if (load_cmd_list(&list) == -1) {
+    if (load_cmd_list_fields(&list, WithoutBodies) == -1) {
       ERROR("Can't load the save file");
       return 1;
     }
     ret = (run(list, argv[2])) ? 0 : 1;
     free_cmd_list(&list);
 
+  } else if (!strcmp(argv[1], "--batch")) {
+    if (argc > 3) {
+      ERROR("Only the path of the batch was expected");
+      return 1;
+    }
+    ret = run_batch((argc == 3) ? argv[2] : NULL);
+
   } else if (!strcmp(argv[1], "--move")) {
     if (argc != 3) {
       ERROR("The name of the command to move was expected");
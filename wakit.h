@@ -1,6 +1,8 @@
 #ifndef WAKIT_H
 #define WAKIT_H
 
+#include <stdint.h>
+
 #include "dynamic_string.h"
 
 typedef enum {
@@ -18,22 +20,56 @@ typedef struct {
   // empty for Actions
   string app;
   bool default_for_app;
+
+  // Set when the command was loaded without its body (see cmd_projection).
+  // The body is read from the record at 'offset' of the save file
+  bool lazy_body;
+  long offset;
 } cmd;
 
 // Init cmd strigs
 #define INIT_CMD(c) c.cmd  = (string) {NULL, 0, 0}; \
                     c.name = (string) {NULL, 0, 0}; \
-                    c.app  = (string) {NULL, 0, 0};
+                    c.app  = (string) {NULL, 0, 0}; \
+                    c.lazy_body = false;
+
+// Fields loaded of each command. The listings don't need the bodies (the
+// largest part of the file), so they're skipped and only read when the
+// command is run (see load_cmd_body())
+typedef enum {
+  WithBodies,
+  WithoutBodies
+} cmd_projection;
 
 typedef struct command_node {
   cmd info;
   struct command_node *next;
 } cmd_node;
 
+#define CONFIG_FILE_NAME "wakit"
+
+// The save file starts with a header: CONFIG_MAGIC, the version of the format
+// (uint32_t) and the generation of the list (uint64_t), which is increased on
+// each save. The files without it (version 0) are still read.
+#define CONFIG_MAGIC "wakitcfg"
+#define CONFIG_VERSION 1
+
 // cmd list operations
 bool add_command(cmd_node **list, cmd c);
 int load_cmd_list(cmd_node **list);
+int load_cmd_list_fields(cmd_node **list, cmd_projection projection);
+bool load_cmd_body(cmd *c);
 bool save_cmd_list(cmd_node *list);
+bool get_config_path(string *path);
+FILE *open_temporary(const char *path, string *tmp_path);
+int read_cmd_from_file(FILE *f, cmd *c);
+bool write_cmd_to_file(FILE *f, cmd c);
+bool read_config_header(FILE *f, uint64_t *generation);
+bool write_config_header(FILE *f, uint64_t generation);
+bool read_config_generation(uint64_t *generation);
+uint64_t loaded_config_generation();
+bool lock_config(bool exclusive);
+void unlock_config();
 void free_cmd_list(cmd_node **list);
 cmd_node *search_cmd(cmd_node *list, char *cmd_name);
 int print_instructions(cmd_node *list, char *wakit_path);
@@ -41,6 +77,7 @@ bool insert_command_node_at(cmd_node **list, cmd_node *node, unsigned int pos);
 cmd_node *remove_command(cmd_node **list, char *name);
 
 // cmd operations
+bool valid_command(const char *command);
 cmd duplicate_cmd(cmd info);
 void free_cmd(cmd_node *cmd);
 
@@ -49,7 +86,7 @@ void print_help(const char *app_path);
 int create_command(char *name, char *command, char *type);
 int menu();
 bool run(cmd_node *list, char *cmd_name);
-int start_daemon();
+int run_cmd(cmd cmd, string *output);
 
 cmd_node *default_app_profile(cmd_node *list, char *app_name);
 cmd_node *search_profiles_app(cmd_node *list, char *app_name);
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+
+#include "window_lru.h"
+
+bool window_lru_init(window_lru *lru, int capacity) {
+  *lru = (window_lru) {0};
+  lru->capacity = capacity;
+  lru->buckets_len = capacity * 2;
+  lru->entries = calloc(capacity, sizeof(window_entry));
+  lru->buckets = calloc(lru->buckets_len, sizeof(window_entry *));
+  if (!lru->entries || !lru->buckets) {
+    window_lru_free(lru);
+    return false;
+  }
+
+  for (int i=0; i<capacity; i++) {
+    lru->entries[i].next = lru->free_entries;
+    lru->free_entries = &lru->entries[i];
+  }
+  return true;
+}
+
+void window_lru_free(window_lru *lru) {
+  if (lru->entries) {
+    for (int i=0; i<lru->capacity; i++) str_free(&lru->entries[i].profile);
+  }
+  free(lru->entries);
+  free(lru->buckets);
+  *lru = (window_lru) {0};
+}
+
+static window_entry **bucket(window_lru *lru, unsigned long window) {
+  // The IDs of the windows of a client are consecutive
+  return &lru->buckets[(window * 2654435761UL) % lru->buckets_len];
+}
+
+static window_entry *find(window_lru *lru, unsigned long window) {
+  if (!lru->buckets_len) return NULL;
+
+  window_entry *e = *bucket(lru, window);
+  while (e && e->window != window) e = e->bucket_next;
+  return e;
+}
+
+static void unlink_recency(window_lru *lru, window_entry *e) {
+  if (e->prev) e->prev->next = e->next;
+  else lru->first = e->next;
+  if (e->next) e->next->prev = e->prev;
+  else lru->last = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void link_first(window_lru *lru, window_entry *e) {
+  e->prev = NULL;
+  e->next = lru->first;
+  if (lru->first) lru->first->prev = e;
+  lru->first = e;
+  if (!lru->last) lru->last = e;
+}
+
+static void unlink_bucket(window_lru *lru, window_entry *e) {
+  window_entry **aux = bucket(lru, e->window);
+  while (*aux && *aux != e) aux = &(*aux)->bucket_next;
+  if (*aux) *aux = e->bucket_next;
+  e->bucket_next = NULL;
+}
+
+// The profile bound to the window (NULL if there isn't one). It becomes the
+// most recently used window
+const char *window_lru_get(window_lru *lru, unsigned long window) {
+  window_entry *e = find(lru, window);
+  if (!e) return NULL;
+
+  unlink_recency(lru, e);
+  link_first(lru, e);
+  return e->profile.str;
+}
+
+bool window_lru_put(window_lru *lru, unsigned long window, const char *profile) {
+  if (!lru->capacity) return false;
+
+  window_entry *e = find(lru, window);
+  if (e) {
+    unlink_recency(lru, e);
+  } else {
+    // Reuse the least recently used entry when it's full
+    if ( (e = lru->free_entries) ) {
+      lru->free_entries = e->next;
+    } else {
+      e = lru->last;
+      unlink_recency(lru, e);
+      unlink_bucket(lru, e);
+    }
+
+    e->window = window;
+    window_entry **b = bucket(lru, window);
+    e->bucket_next = *b;
+    *b = e;
+  }
+
+  link_first(lru, e);
+  return str_replace(&e->profile, (char *) profile);
+}
+
+// When the window is destroyed
+void window_lru_remove(window_lru *lru, unsigned long window) {
+  window_entry *e = find(lru, window);
+  if (!e) return;
+
+  unlink_recency(lru, e);
+  unlink_bucket(lru, e);
+  str_free(&e->profile);
+  e->next = lru->free_entries;
+  lru->free_entries = e;
+}
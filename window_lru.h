@@ -0,0 +1,36 @@
+#ifndef WINDOW_LRU_H
+#define WINDOW_LRU_H
+
+#include <stdbool.h>
+
+#include "dynamic_string.h"
+
+#define WINDOW_LRU_CAPACITY 64
+
+typedef struct window_entry {
+  unsigned long window;
+  string profile;
+
+  struct window_entry *prev, *next; // Recency (the first is the most recent)
+  struct window_entry *bucket_next;
+} window_entry;
+
+// Profile bound to each window (by X window ID). When it's full, the least
+// recently used window is forgotten
+typedef struct {
+  window_entry *entries; // capacity entries (the unused ones are in 'free_entries')
+  window_entry **buckets;
+  int capacity;
+  int buckets_len;
+
+  window_entry *first, *last;
+  window_entry *free_entries;
+} window_lru;
+
+bool window_lru_init(window_lru *lru, int capacity);
+void window_lru_free(window_lru *lru);
+const char *window_lru_get(window_lru *lru, unsigned long window);
+bool window_lru_put(window_lru *lru, unsigned long window, const char *profile);
+void window_lru_remove(window_lru *lru, unsigned long window);
+
+#endif // WINDOW_LRU_H
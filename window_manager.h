@@ -6,4 +6,36 @@
 bool select_window(string *name);
 bool get_active_window(string *name);
 
+// Properties of a window, to identify its app (see matcher.h)
+#define WINDOW_CLASS 1 // WM_CLASS (instance and class)
+#define WINDOW_TITLE 2 // _NET_WM_NAME (or WM_NAME)
+#define WINDOW_EXE   4 // Path of the executable of the process
+
+typedef struct {
+  string instance;
+  string class;
+  string title;
+  string exe;
+} window_properties;
+
+// A monitor of the display (see focus_watch_output())
+typedef struct {
+  string name; // Of its output
+  int x, y, width, height;
+} monitor;
+
+typedef struct focus_watcher focus_watcher;
+typedef void (*window_destroyed_fn)(unsigned long window, void *data);
+
+focus_watcher *focus_watch_open(const char *display_name);
+void focus_watch_close(focus_watcher *w);
+int focus_watch_fd(focus_watcher *w);
+bool focus_watch_changed(focus_watcher *w, window_destroyed_fn destroyed, void *data);
+void focus_watch_track(focus_watcher *w, unsigned long window);
+bool focus_watch_idle(focus_watcher *w);
+bool focus_watch_window(focus_watcher *w, unsigned long *window, unsigned long *pid);
+bool focus_watch_output(focus_watcher *w, unsigned long window, string *output);
+void focus_watch_properties(focus_watcher *w, unsigned long window, int fields, window_properties *props);
+void free_window_properties(window_properties *props);
+
 #endif // WINDOW_MANAGER_H
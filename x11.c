@@ -1,4 +1,15 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/dpms.h>
+#include <X11/extensions/scrnsaver.h>
+
 #include "cli_io.h"
+#include "display.h"
+#include "trace.h"
 #include "window_manager.h"
 
 // Select window with the cursor and return its name
@@ -33,8 +44,7 @@ bool select_window(string *name) {
   return true;
 }
 
-// get_active_window should not print anything as it's being executed constantly
-bool get_active_window(string *name) {
+static bool read_active_window(string *name) {
   // Get PID
   string pid = {0};
   int ret = console_output("xdotool getactivewindow getwindowpid 2> /dev/null", &pid);
@@ -58,3 +68,283 @@ bool get_active_window(string *name) {
 
   return true;
 }
+
+// get_active_window should not print anything as it's being executed constantly
+bool get_active_window(string *name) {
+  trace_span span = trace_begin("get_active_window");
+  const bool found = read_active_window(name);
+  trace_end(&span);
+  return found;
+}
+
+/// Focus watcher ///
+
+// Watches the active window through the X connection (_NET_ACTIVE_WINDOW of
+// the root window), so the focus changes are notified instead of polled
+struct focus_watcher {
+  Display *display;
+  Window root;
+  Atom net_active_window;
+  Atom net_wm_pid;
+  Atom net_wm_name;
+  Atom utf8_string;
+
+  // To know when the screen is locked, blanked or off (see focus_watch_idle())
+  bool has_saver;
+  int saver_event_base;
+  bool has_dpms;
+
+  // The monitors (see focus_watch_output()). They're read again after the
+  // root window is resized, as RandR does when the monitors change
+  string display_name; // Empty for the one of the environment
+  monitor *monitors;
+  int monitors_len;
+  bool monitors_valid;
+};
+
+// Windows can be destroyed while their properties are read. The errors are
+// ignored instead of closing wakit
+static int ignore_x_errors(Display *display, XErrorEvent *event) {
+  return 0;
+}
+
+// The display is NULL for the one of the environment
+focus_watcher *focus_watch_open(const char *display_name) {
+  Display *display = XOpenDisplay(display_name);
+  if (!display) return NULL;
+
+  focus_watcher *w = calloc(1, sizeof(focus_watcher));
+  if (!w) {
+    XCloseDisplay(display);
+    return NULL;
+  }
+
+  XSetErrorHandler(ignore_x_errors);
+  w->display = display;
+  w->root = DefaultRootWindow(display);
+  w->net_active_window = XInternAtom(display, "_NET_ACTIVE_WINDOW", False);
+  w->net_wm_pid = XInternAtom(display, "_NET_WM_PID", False);
+  w->net_wm_name = XInternAtom(display, "_NET_WM_NAME", False);
+  w->utf8_string = XInternAtom(display, "UTF8_STRING", False);
+
+  if (display_name) str_append(&w->display_name, display_name);
+
+  XSelectInput(display, w->root, PropertyChangeMask | StructureNotifyMask);
+
+  int error_base, dpms_event_base;
+  w->has_saver = XScreenSaverQueryExtension(display, &w->saver_event_base, &error_base);
+  if (w->has_saver) XScreenSaverSelectInput(display, w->root, ScreenSaverNotifyMask);
+  w->has_dpms = DPMSQueryExtension(display, &dpms_event_base, &error_base) && DPMSCapable(display);
+
+  XFlush(display);
+  return w;
+}
+
+static void free_monitors(focus_watcher *w) {
+  for (int i=0; i<w->monitors_len; i++) str_free(&w->monitors[i].name);
+  free(w->monitors);
+  w->monitors = NULL;
+  w->monitors_len = 0;
+  w->monitors_valid = false;
+}
+
+void focus_watch_close(focus_watcher *w) {
+  if (!w) return;
+
+  XCloseDisplay(w->display);
+  free_monitors(w);
+  str_free(&w->display_name);
+  free(w);
+}
+
+// File descriptor of the X connection (readable when there are events)
+int focus_watch_fd(focus_watcher *w) {
+  return ConnectionNumber(w->display);
+}
+
+// Processes the pending events. Returns true if the active window changed
+// (or the screen saver was turned on/off, see focus_watch_idle(), or the
+// monitors changed, see focus_watch_output()).
+// The destroyed windows (see focus_watch_track()) are passed to 'destroyed'
+bool focus_watch_changed(focus_watcher *w, window_destroyed_fn destroyed, void *data) {
+  bool changed = false;
+
+  while (XPending(w->display)) {
+    XEvent event;
+    XNextEvent(w->display, &event);
+
+    if (event.type == PropertyNotify && event.xproperty.atom == w->net_active_window)
+      changed = true;
+    else if (w->has_saver && event.type == w->saver_event_base + ScreenSaverNotify)
+      changed = true;
+    else if (event.type == ConfigureNotify && event.xconfigure.window == w->root) {
+      free_monitors(w);
+      changed = true;
+    }
+    else if (event.type == DestroyNotify && destroyed && event.xdestroywindow.window == event.xdestroywindow.event)
+      destroyed(event.xdestroywindow.window, data);
+  }
+
+  return changed;
+}
+
+// If the screen saver is on (the screen is blanked or locked by a locker
+// that uses it) or the monitor isn't on (DPMS). DPMS doesn't send events,
+// so it should be checked again while it's idle
+bool focus_watch_idle(focus_watcher *w) {
+  if (w->has_saver) {
+    XScreenSaverInfo info;
+    if (XScreenSaverQueryInfo(w->display, w->root, &info) && info.state == ScreenSaverOn) return true;
+  }
+
+  if (w->has_dpms) {
+    CARD16 level;
+    BOOL enabled;
+    if (DPMSInfo(w->display, &level, &enabled) && enabled && level != DPMSModeOn) return true;
+  }
+
+  return false;
+}
+
+// Notifies when the window is destroyed (in focus_watch_changed())
+void focus_watch_track(focus_watcher *w, unsigned long window) {
+  XSelectInput(w->display, (Window) window, StructureNotifyMask);
+}
+
+// Reads a property with one item of 32 bits (a window or a cardinal)
+static bool get_property_long(Display *display, Window window, Atom property, Atom type, unsigned long *value) {
+  Atom actual_type;
+  int actual_format;
+  unsigned long items, bytes_after;
+  unsigned char *data = NULL;
+
+  if (XGetWindowProperty(display, window, property, 0, 1, False, type,
+                         &actual_type, &actual_format, &items, &bytes_after, &data) != Success
+      || !data
+  ) {
+    return false;
+  }
+
+  const bool found = (items == 1 && actual_format == 32);
+  if (found) *value = *((unsigned long *) data);
+  XFree(data);
+  return found;
+}
+
+// The active window and the pid of its process (_NET_WM_PID)
+bool focus_watch_window(focus_watcher *w, unsigned long *window, unsigned long *pid) {
+  trace_span span = trace_begin("get_active_window");
+  *window = 0;
+  const bool found = get_property_long(w->display, w->root, w->net_active_window, XA_WINDOW, window) && *window
+                     && get_property_long(w->display, (Window) *window, w->net_wm_pid, XA_CARDINAL, pid);
+  trace_end(&span);
+  return found;
+}
+
+static void get_property_string(Display *display, Window window, Atom property, Atom type, string *value) {
+  Atom actual_type;
+  int actual_format;
+  unsigned long items, bytes_after;
+  unsigned char *data = NULL;
+
+  str_free(value);
+  if (XGetWindowProperty(display, window, property, 0, 1024, False, type,
+                         &actual_type, &actual_format, &items, &bytes_after, &data) != Success
+      || !data
+  ) {
+    return;
+  }
+
+  if (actual_format == 8 && items) str_append(value, (char *) data);
+  XFree(data);
+}
+
+// Reads the properties of the window in 'fields' (WINDOW_CLASS and
+// WINDOW_TITLE). The ones that aren't available are left empty. The exe is
+// read from the process (see pid_cache.h)
+void focus_watch_properties(focus_watcher *w, unsigned long window, int fields, window_properties *props) {
+  if (fields & WINDOW_CLASS) {
+    XClassHint hint = {0};
+    str_free(&props->instance);
+    str_free(&props->class);
+    if (XGetClassHint(w->display, (Window) window, &hint)) {
+      if (hint.res_name) str_append(&props->instance, hint.res_name);
+      if (hint.res_class) str_append(&props->class, hint.res_class);
+      XFree(hint.res_name);
+      XFree(hint.res_class);
+    }
+  }
+
+  if (fields & WINDOW_TITLE) {
+    get_property_string(w->display, (Window) window, w->net_wm_name, w->utf8_string, &props->title);
+    if (!props->title.str) get_property_string(w->display, (Window) window, XA_WM_NAME, XA_STRING, &props->title);
+  }
+}
+
+void free_window_properties(window_properties *props) {
+  str_free(&props->instance);
+  str_free(&props->class);
+  str_free(&props->title);
+  str_free(&props->exe);
+}
+
+/// Monitors ///
+
+// Parses the output of 'xrandr --listactivemonitors'. After the first line,
+// each line is a monitor:
+//   <index>: +*<name> <width>/<mm>x<height>/<mm>+<x>+<y>  <output>
+static void parse_monitors(focus_watcher *w, char *output) {
+  char *line = strchr(output, '\n');
+  while (line && *(++line)) {
+    char *next = strchr(line, '\n');
+    if (next) *next = '\0';
+
+    int width, height, x, y;
+    char name[64];
+    if (sscanf(line, " %*d: %*s %d/%*dx%d/%*d+%d+%d %63s", &width, &height, &x, &y, name) == 5
+        && !strchr(name, '\'')
+    ) {
+      monitor *monitors = realloc(w->monitors, sizeof(monitor) * (w->monitors_len+1));
+      if (!monitors) return;
+      w->monitors = monitors;
+      w->monitors[w->monitors_len] = (monitor) { .name = {0}, .x = x, .y = y, .width = width, .height = height };
+      str_append(&w->monitors[w->monitors_len].name, name);
+      w->monitors_len++;
+    }
+
+    line = next;
+  }
+}
+
+// The monitors are read once, until they change (see focus_watch_changed())
+static void load_monitors(focus_watcher *w) {
+  if (w->monitors_valid) return;
+
+  string command = {0}, output = {0};
+  display_command(&command, w->display_name.str, "xrandr --listactivemonitors 2> /dev/null");
+  if (!console_output(command.str, &output) && output.str) parse_monitors(w, output.str);
+  str_free(&command);
+  str_free(&output);
+  w->monitors_valid = true;
+}
+
+// Name of the output of the monitor that has the center of the window.
+// Returns false if it isn't known
+bool focus_watch_output(focus_watcher *w, unsigned long window, string *output) {
+  load_monitors(w);
+  if (!window || !w->monitors_len) return false;
+
+  Window root, child;
+  int x, y;
+  unsigned int width, height, border, depth;
+  if (!XGetGeometry(w->display, (Window) window, &root, &x, &y, &width, &height, &border, &depth)
+      || !XTranslateCoordinates(w->display, (Window) window, w->root, width/2, height/2, &x, &y, &child)
+  ) return false;
+
+  for (int i=0; i<w->monitors_len; i++) {
+    monitor *m = &w->monitors[i];
+    if (x >= m->x && x < m->x + m->width && y >= m->y && y < m->y + m->height)
+      return str_replace(output, m->name.str);
+  }
+  return false;
+}